@@ -8,10 +8,7 @@ import Foundation
 
 func main(args: [String:Any]) -> [String:Any] {
 
-    var str = ""
-    var result: [String:Any] = [
-        "document": str
-    ]
+    var result: [String:Any] = [:]
 
     guard let cloudantDbName = args["cloudantDbName"] as? String,
         let cloudantHost = args["cloudantHost"] as? String,
@@ -20,9 +17,12 @@ func main(args: [String:Any]) -> [String:Any] {
         let cloudantId = args["cloudantId"] as? String else {
 
             print("Error: missing a required parameter for reading a Cloudant document.")
-            return result
+            return ["error": "Missing a required parameter for reading a Cloudant document"]
     }
 
+    // the orchestrator passes the trace id of the image, which ties these logs to it
+    let traceId = args["traceId"] as? String ?? ""
+
     var requestOptions: [ClientRequest.Options] = [ .method("GET"),
                                                     .schema("https://"),
                                                     .hostname(cloudantHost),
@@ -37,21 +37,30 @@ func main(args: [String:Any]) -> [String:Any] {
     headers["Content-Type"] = "application/json"
     requestOptions.append(.headers(headers))
 
+    // the document is returned as a JSON object, so it is parsed here and nowhere else
     let req = HTTP.request(requestOptions) { response in
         do {
-            if let response = response,
-                let responseStr = try response.readString() {
-                str = responseStr
+            guard let response = response else {
+                result = ["error": "No response was received from Cloudant"]
+                return
+            }
+            var data = Data()
+            _ = try response.readAllData(into: &data)
+            guard let document = try JSONSerialization.jsonObject(with: data, options: []) as? [String:Any] else {
+                result = ["error": "Cloudant did not return a JSON object"]
+                return
+            }
+            if let error = document["error"] {
+                result = ["error": "\(error): \(document["reason"] ?? "")"]
+            } else {
+                result = ["document": document]
             }
         } catch {
-            print("Error: \(error)")
+            print("Error [trace \(traceId)]: \(error)")
+            result = ["error": "\(error)"]
         }
     }
     req.end()
 
-    result = [
-        "document": str
-    ]
-
     return result
 }
@@ -6,64 +6,102 @@ import KituraNet
 import Dispatch
 import Foundation
 
-func main(args: [String:Any]) -> [String:Any] {
+/**
+ * Number of times a field update is sent before a conflict is given up on
+ */
+let maxUpdateAttempts = 5
 
-    var str = ""
-    var result: [String:Any] = [
-        "cloudantId": str,
-        "cloudantResult": str
-    ]
+func main(args: [String:Any]) -> [String:Any] {
 
     guard let cloudantDbName = args["cloudantDbName"] as? String,
         let cloudantUsername = args["cloudantUsername"] as? String,
         let cloudantPassword = args["cloudantPassword"] as? String,
         let cloudantHost = args["cloudantHost"] as? String,
-        let cloudantBody = args["cloudantBody"] as? String,
         let cloudantId = args["cloudantId"] as? String else {
 
             print("Error: missing a required parameter for writing a Cloudant document.")
-            return result
+            return ["error": "Missing a required parameter for writing a Cloudant document"]
     }
 
-    var requestOptions: [ClientRequest.Options] = [ .method("POST"),
-                                                    .schema("https://"),
+    var result: [String:Any] = [
+        "cloudantId": cloudantId
+    ]
+
+    // the orchestrator passes the trace id of the image, which ties these logs to it
+    let traceId = args["traceId"] as? String ?? ""
+
+    let requestOptions: [ClientRequest.Options] = [ .schema("https://"),
                                                     .hostname(cloudantHost),
                                                     .username(cloudantUsername),
                                                     .password(cloudantPassword),
                                                     .port(443),
-                                                    .path("/\(cloudantDbName)/")
+                                                    .headers(["Accept": "application/json", "Content-Type": "application/json"])
     ]
 
-    var headers = [String: String]()
-    headers["Accept"] = "application/json"
-    headers["Content-Type"] = "application/json"
-    requestOptions.append(.headers(headers))
-
-    if (cloudantBody == "") {
-        str = "Error: Unable to serialize cloudantBody parameter as a String instance"
+    // cloudantFields only carries the fields processing adds, which the design document's
+    // enrich update handler merges into the stored document; cloudantBody replaces it whole
+    let method: String
+    let path: String
+    let body: [String:Any]
+    if let cloudantFields = args["cloudantFields"] as? [String:Any] {
+        method = "PUT"
+        path = "/\(cloudantDbName)/_design/main_design/_update/enrich/\(cloudantId)"
+        body = cloudantFields
+    } else if let cloudantBody = args["cloudantBody"] as? [String:Any] {
+        method = "POST"
+        path = "/\(cloudantDbName)/"
+        body = cloudantBody
     } else {
-        let requestData: Data? = cloudantBody.data(using: String.Encoding.utf8, allowLossyConversion: true)
-
-        if let data = requestData {
-
-            let req = HTTP.request(requestOptions) { response in
-                do {
-                    if let responseUnwrapped = response,
-                        let responseStr = try responseUnwrapped.readString() {
-                        str = responseStr
-                    }
-                } catch {
-                    print("Error \(error)")
+        result["error"] = "Missing the cloudantBody or cloudantFields parameter"
+        return result
+    }
+
+    // the document arrives as a JSON object and is serialized once, here
+    guard let requestData = try? JSONSerialization.data(withJSONObject: body, options: []) else {
+        result["error"] = "Unable to serialize the document to write"
+        return result
+    }
+
+    // a field update conflicts only with a write that landed while the handler ran,
+    // so it is simply sent again against the new revision
+    for attempt in 1...maxUpdateAttempts {
+        var status = 0
+        var cloudantResult: [String:Any]?
+        var newRevision: String?
+
+        let req = HTTP.request(requestOptions + [.method(method), .path(path)]) { response in
+            do {
+                guard let response = response else {
+                    return
                 }
+                status = response.status
+                newRevision = response.headers["X-Couch-Update-NewRev"]?.first
+
+                var data = Data()
+                _ = try response.readAllData(into: &data)
+                cloudantResult = try JSONSerialization.jsonObject(with: data, options: []) as? [String:Any]
+            } catch {
+                print("Error [trace \(traceId)]: \(error)")
             }
-            req.end(data)
         }
-    }
+        req.end(requestData)
 
-    result = [
-        "cloudantId": cloudantId,
-        "cloudantResult": str
-    ]
+        if status == 409 && method == "PUT" && attempt < maxUpdateAttempts {
+            print("Conflict [trace \(traceId)]: retrying update of \(cloudantId), attempt \(attempt + 1)")
+            usleep(UInt32(100_000 * attempt))
+            continue
+        }
+
+        if var cloudantResult = cloudantResult {
+            if let newRevision = newRevision, cloudantResult["rev"] == nil {
+                cloudantResult["rev"] = newRevision
+            }
+            result["cloudantResult"] = cloudantResult
+        } else {
+            result["error"] = "No response was received from Cloudant"
+        }
+        break
+    }
 
     return result
 }
@@ -32,9 +32,25 @@ func main(args: [String:Any]) -> [String:Any] {
                                                     .path("/push/images/\(cloudantId)")
     ]
 
+    // the processed document, when given, saves kitura from reading it back
+    var body = Data()
+    if let document = args["document"] as? [String:Any],
+        let documentData = try? JSONSerialization.data(withJSONObject: document, options: []) {
+        body = documentData
+    }
+
     var requestHeaders = [String: String]()
     requestHeaders["Authorization"] = authHeader
-    requestHeaders["Content-Length"] = "0"
+
+    // the trace id and the orchestrator's spans join the trace kitura started at upload
+    if let traceId = args["traceId"] as? String, !traceId.isEmpty {
+        requestHeaders["X-BluePic-Trace-Id"] = traceId
+        if let traceSpans = args["traceSpans"] as? String, !traceSpans.isEmpty {
+            requestHeaders["X-BluePic-Trace-Spans"] = traceSpans
+        }
+    }
+    requestHeaders["Content-Type"] = "application/json"
+    requestHeaders["Content-Length"] = String(body.count)
     requestOptions.append(.headers(requestHeaders))
 
     let req = HTTP.request(requestOptions) { resp in
@@ -44,7 +60,7 @@ func main(args: [String:Any]) -> [String:Any] {
             str = "Status error code or nil reponse received from Kitura server."
         }
     }
-    req.end("--request body (ignore this value)--")
+    req.end(body)
 
     result = [
         "response": "\(str)"
@@ -5,128 +5,288 @@
 import KituraNet
 import Dispatch
 import Foundation
-import SwiftyJSON
 
 func main(args: [String:Any]) -> [String:Any] {
 
-    var error: String = ""
-    var returnValue: String = ""
-    let imageId = args["imageId"] as? String ?? ""
     let targetNamespace = args["namespace"] as? String ?? ""
 
-    let cloudantReadInvocation = Whisk.invoke(actionNamed: "/\(targetNamespace)/bluepic/cloudantRead", withParameters: ["cloudantId": imageId])
+    // weather and visual recognition each get this long, in milliseconds, to answer
+    let branchTimeout = args["branchTimeout"] as? Int ?? 20000
 
-    var document: JSON = [:]
-    if let documentResponse = cloudantReadInvocation["response"] as? [String:Any],
-        let documentPayload = documentResponse["result"] as? [String:Any],
-        let documentString = documentPayload["document"] as? String,
-        let documentData = documentString.data(using: String.Encoding.utf8, allowLossyConversion: true) {
+    // the server batches several images into one invocation when it is busy
+    guard let imageIds = args["imageIds"] as? [String] else {
+        return process(imageId: args["imageId"] as? String ?? "",
+                       document: args["document"] as? [String:Any],
+                       traceId: args["traceId"] as? String ?? "",
+                       targetNamespace: targetNamespace,
+                       branchTimeout: branchTimeout)
+    }
 
-        document = JSON(data: documentData)
+    // each image carries the id of its own trace, and the server sends the documents it just created
+    let traceIds = args["traceIds"] as? [String] ?? []
+    let documents = args["documents"] as? [Any] ?? []
+    var results: [[String:Any]] = []
+    for (index, imageId) in imageIds.enumerated() {
+        let traceId = index < traceIds.count ? traceIds[index] : ""
+        let document = index < documents.count ? documents[index] as? [String:Any] : nil
+        results.append(process(imageId: imageId, document: document, traceId: traceId,
+                               targetNamespace: targetNamespace, branchTimeout: branchTimeout))
+    }
+    var result: [String:Any] = [
+        "success": !results.contains { $0["success"] as? Bool != true },
+        "results": results
+    ]
+    let errors = results.flatMap { $0["error"] as? String }
+    if (!errors.isEmpty) {
+        result["error"] = errors.joined(separator: "; ")
     }
+    return result
+}
 
-    // check if document was read from cloudant successfully
-    // there *should not* be a value for documnet["error"] because if that key exists,
-    // then there is an error message being returned from cloudant
-    if (document.exists() && !document["error"].exists()) {
+/**
+ * Timed steps of one image's processing, reported to kitura with the callback
+ * so they join the trace the server started when the image was uploaded.
+ * Steps may be recorded from several threads at once.
+ */
+class Trace {
 
-        // request data from weather & visual recognition services
-        let location = document["location"]
+    let id: String
+    private let queue = DispatchQueue(label: "traceQueue")
+    private var spans: [[String:Any]] = []
+    private var timings: [String:Int] = [:]
+    private var timedOut: [String] = []
 
-        var weatherInvocation: [String:Any] = [:]
-        if let latitude = location["latitude"].number,
-            let longitude = location["longitude"].number {
-            weatherInvocation = Whisk.invoke(actionNamed: "/\(targetNamespace)/bluepic/weather", withParameters: [
-                "latitude": String(describing: latitude),
-                "longitude": String(describing: longitude)
-                ])
+    init(id: String) {
+        self.id = id
+    }
+
+    /**
+     * Records a step in the Chrome trace event fields the server expects, with
+     * times in microseconds since 1970
+     */
+    func record(_ name: String, start: Date, end: Date = Date()) {
+        let duration = Int(end.timeIntervalSince(start) * 1_000_000)
+        let span: [String:Any] = [
+            "name": name,
+            "cat": "cloudFunctions",
+            "ts": Int(start.timeIntervalSince1970 * 1_000_000),
+            "dur": duration
+        ]
+        queue.sync {
+            spans.append(span)
+            timings[name] = duration / 1000
         }
-        var visualInvocation: [String:Any] = [:]
-        let imageURL = document["url"].string
-        var imageURLUnwrapped: String = ""
-        if let imageURLUnwrapped = imageURL {
-            visualInvocation = Whisk.invoke(actionNamed: "/\(targetNamespace)/bluepic/visualRecognition", withParameters: [
-                "imageURL": "\(imageURLUnwrapped)"
-                ])
+    }
+
+    /**
+     * Invokes an action of the bluepic package, passing the trace id along and
+     * recording the time the invocation took
+     */
+    func invoke(_ action: String, namespace: String, parameters: [String:Any]) -> [String:Any] {
+        var parameters = parameters
+        parameters["traceId"] = id
+        let start = Date()
+        let invocation = Whisk.invoke(actionNamed: "/\(namespace)/bluepic/\(action)", withParameters: parameters)
+        record(action, start: start)
+        return invocation
+    }
+
+    /**
+     * Invokes independent actions at the same time, keyed by action name, and
+     * waits at most `timeout` milliseconds for each of them. An action that times
+     * out is left out of the results and whatever it returns later is dropped.
+     */
+    func invokeConcurrently(_ branches: [String:[String:Any]], namespace: String, timeout: Int) -> [String:[String:Any]] {
+        var results: [String:[String:Any]] = [:]
+        var pending: [(String, DispatchSemaphore)] = []
+        let deadline = DispatchTime.now() + .milliseconds(timeout)
+
+        for (action, parameters) in branches {
+            let done = DispatchSemaphore(value: 0)
+            DispatchQueue.global().async {
+                let invocation = self.invoke(action, namespace: namespace, parameters: parameters)
+                self.queue.sync {
+                    results[action] = invocation
+                }
+                done.signal()
+            }
+            pending.append((action, done))
         }
 
-        // parse weather data and update cloudant document
-        var weather: JSON = [:]
-        if let weatherResponse = weatherInvocation["response"] as? [String:Any],
-            let weatherPayload = weatherResponse["result"] as? [String:Any],
-            let weatherString: String = weatherPayload["weather"] as? String,
-            let weatherData = weatherString.data(using: String.Encoding.utf8, allowLossyConversion: true) {
+        var late: [String] = []
+        for (action, done) in pending where done.wait(timeout: deadline) == .timedOut {
+            late.append(action)
+        }
 
-            weather = JSON(data: weatherData)
+        return queue.sync { () -> [String:[String:Any]] in
+            timedOut.append(contentsOf: late)
+            for action in late {
+                results[action] = nil
+            }
+            return results
         }
+    }
 
-        // if the weather data exists without error, add it to the cloudant document, otherwise don't add it
-        if (weather.exists() && !weather["error"].exists()) {
-            let observation = weather["observation"]
-            var newWeather: JSON = [:]
-            newWeather["iconId"] = observation["icon_code"]
-            newWeather["description"] = observation["sky_cover"]
-            newWeather["temperature"] = observation["imperial"]["temp"]
-            document["location"]["weather"] = newWeather
+    /**
+     * Milliseconds taken by each step so far, and the steps that timed out
+     */
+    func stageTimings() -> [String:Any] {
+        return queue.sync { () -> [String:Any] in
+            var stages: [String:Any] = [:]
+            for (name, duration) in timings {
+                stages[name] = duration
+            }
+            if (!timedOut.isEmpty) {
+                stages["timedOut"] = timedOut
+            }
+            return stages
         }
+    }
+
+    /**
+     * The spans recorded so far as a JSON array
+     */
+    func spansJSON() -> String {
+        let spans = queue.sync { self.spans }
+        guard let data = try? JSONSerialization.data(withJSONObject: spans, options: []),
+            let json = String(data: data, encoding: String.Encoding.utf8) else {
+            return "[]"
+        }
+        return json
+    }
+}
 
-        // parse visual recognition data and update cloudant document
-        var visualRecognition: JSON = [:]
-        if let visualResponse = visualInvocation["response"] as? [String:Any],
-            let visualPayload = visualResponse["result"] as? [String:Any],
-            let visualString: String = visualPayload["visualRecognition"] as? String,
-            let visualData = visualString.data(using: String.Encoding.utf8, allowLossyConversion: true) {
+/**
+ * The result an invoked action returned, or nil if its activation failed
+ */
+func actionResult(_ invocation: [String:Any]) -> [String:Any]? {
+    guard let response = invocation["response"] as? [String:Any] else {
+        return nil
+    }
+    return response["result"] as? [String:Any]
+}
+
+/**
+ * A coordinate of the document as the weather action expects it
+ */
+func coordinate(_ value: Any?) -> String? {
+    switch value {
+    case let number as Double:
+        return String(describing: number)
+    case let number as Int:
+        return String(describing: number)
+    case let number as NSNumber:
+        return String(describing: number)
+    default:
+        return nil
+    }
+}
+
+/**
+ * Reads, enriches and writes back a single image document, then calls back to kitura.
+ * The actions exchange the document and their results as JSON objects, so it is
+ * parsed once when read and serialized once when written.
+ *
+ * The server sends the document it has just created, which spares the read; only
+ * the fields processing adds are written back.
+ */
+func process(imageId: String, document: [String:Any]?, traceId: String, targetNamespace: String,
+             branchTimeout: Int) -> [String:Any] {
 
-            visualRecognition = JSON(data: visualData)
+    var error: String = ""
+    var returnValue: String = ""
+    let trace = Trace(id: traceId)
+    let processStart = Date()
+
+    var givenDocument = document
+    if givenDocument?["_id"] as? String != imageId {
+        givenDocument = nil
+    }
+
+    // cloudantRead only returns a document when cloudant answered without an error
+    let readDocument = { () -> [String:Any]? in
+        let cloudantReadInvocation = trace.invoke("cloudantRead", namespace: targetNamespace, parameters: ["cloudantId": imageId])
+        return actionResult(cloudantReadInvocation)?["document"] as? [String:Any]
+    }
+
+    if var document = givenDocument ?? readDocument() {
+
+        // request data from weather & visual recognition services, which don't depend
+        // on each other, at the same time
+        var location = document["location"] as? [String:Any]
+
+        var branches: [String:[String:Any]] = [:]
+        if let latitude = coordinate(location?["latitude"]),
+            let longitude = coordinate(location?["longitude"]) {
+            branches["weather"] = [
+                "latitude": latitude,
+                "longitude": longitude
+            ]
+        }
+        // an upload the server matched to an earlier copy already carries its tags
+        if let imageURL = document["url"] as? String, (document["tags"] as? [Any])?.isEmpty ?? true {
+            branches["visualRecognition"] = [
+                "imageURL": imageURL
+            ]
         }
+        let invocations = trace.invokeConcurrently(branches, namespace: targetNamespace, timeout: branchTimeout)
 
-        document["tags"] = visualRecognition
+        // if the weather data exists without error, add it to the cloudant document, otherwise don't add it
+        var fields: [String:Any] = [:]
+        if let weatherInvocation = invocations["weather"],
+            let weather = actionResult(weatherInvocation)?["weather"] as? [String:Any] {
+            location?["weather"] = weather
+            document["location"] = location
+            fields["weather"] = weather
+        }
 
-        var writeJSON: JSON = [:]
-        if var documentUnwrapped = document.rawString() {
+        // likewise the tags from visual recognition
+        if let visualInvocation = invocations["visualRecognition"],
+            let tags = actionResult(visualInvocation)?["visualRecognition"] as? [[String:Any]] {
+            document["tags"] = tags
+            fields["tags"] = tags
+        }
 
-            // write the results back to cloudant
-            let cloudantWriteInvocation = Whisk.invoke(actionNamed: "/\(targetNamespace)/bluepic/cloudantWrite", withParameters: [
+        // write only the added fields back to cloudant, which merges them into the stored document
+        var writeResult: [String:Any] = ["ok": true]
+        if (!fields.isEmpty) {
+            let cloudantWriteInvocation = trace.invoke("cloudantWrite", namespace: targetNamespace, parameters: [
                 "cloudantId": imageId,
-                "cloudantBody": documentUnwrapped
+                "cloudantFields": fields
                 ])
-            if let writeResponse = cloudantWriteInvocation["response"] as? [String:Any],
-                let writePayload = writeResponse["result"] as? [String:Any],
-                let writeResultString: String = writePayload["cloudantResult"] as? String,
-                let writeData = writeResultString.data(using: String.Encoding.utf8, allowLossyConversion: true) {
+            writeResult = actionResult(cloudantWriteInvocation)?["cloudantResult"] as? [String:Any] ?? [:]
+        }
 
-                writeJSON = JSON(data: writeData)
-            }
+        if writeResult["ok"] as? Bool == true {
 
-        }
+            if let revision = writeResult["rev"] as? String {
+                document["_rev"] = revision
+            }
+            // obtain auth credentials for callback to kitura
+//            let kituraAuthInvocation = Whisk.invoke(actionNamed: "/\(targetNamespace)/bluepic/kituraRequestAuth", withParameters: [:])
 
-        if (writeJSON.exists() && !writeJSON["error"].exists()) {
-            if(writeJSON["ok"] != true) {
-                error = "Error writing to Cloudant"
-            } else {
-                // obtain auth credentials for callback to kitura
-//                let kituraAuthInvocation = Whisk.invoke(actionNamed: "/\(targetNamespace)/bluepic/kituraRequestAuth", withParameters: [:])
-
-//                if let authResponse: [String:Any] = kituraAuthInvocation["response"] as? [String:Any],
-//                    let authPayload: [String:Any] = authResponse["result"] as? [String:Any],
-//                    let authHeaderPayload = authPayload["authHeader"],
-//                    let authHeader = authHeaderPayload as? String {
-//                    if (authHeader.isEmpty) {
-//                        error = "Unable to obtain auth header from Kitura"
-//                    }
-                    let kituraCallbackInvocation = Whisk.invoke(actionNamed: "/\(targetNamespace)/bluepic/kituraCallback", withParameters: [
-                        "authHeader": "",
-                        "cloudantId": imageId
-                        ])
-
-                    if let callbackResponse = kituraCallbackInvocation["response"] as? [String:Any],
-                        let callbackPayload = callbackResponse["result"] as? [String:Any],
-                        let callbackResponseString = callbackPayload["response"] as? String {
-
-                        returnValue = "Processed request through callback to kitura with server response: \(callbackResponseString)"
-                    }
+//            if let authResponse: [String:Any] = kituraAuthInvocation["response"] as? [String:Any],
+//                let authPayload: [String:Any] = authResponse["result"] as? [String:Any],
+//                let authHeaderPayload = authPayload["authHeader"],
+//                let authHeader = authHeaderPayload as? String {
+//                if (authHeader.isEmpty) {
+//                    error = "Unable to obtain auth header from Kitura"
 //                }
-            }
+                // the callback carries the spans so far; kitura times the rest
+                trace.record("processImage", start: processStart)
+                let kituraCallbackInvocation = trace.invoke("kituraCallback", namespace: targetNamespace, parameters: [
+                    "authHeader": "",
+                    "cloudantId": imageId,
+                    "document": document,
+                    "traceSpans": trace.spansJSON()
+                    ])
+
+                if let callbackResponseString = actionResult(kituraCallbackInvocation)?["response"] as? String {
+                    returnValue = "Processed request through callback to kitura with server response: \(callbackResponseString)"
+                }
+//            }
+        } else {
+            error = "Error writing to Cloudant"
         }
 
     } else {
@@ -135,7 +295,9 @@ func main(args: [String:Any]) -> [String:Any] {
 
     var result: [String:Any] = [
         "success": (error == ""),
-        "response": returnValue
+        "response": returnValue,
+        "traceId": traceId,
+        "timings": trace.stageTimings()
     ]
     if (error != "") {
         result["error"] = error
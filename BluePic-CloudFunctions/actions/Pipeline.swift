@@ -0,0 +1,677 @@
+/**
+ * Image processing pipeline fused into a single Cloud Functions action
+ *
+ * Runs the same steps as the orchestrator (read the document from cloudant, ask the
+ * weather and visual recognition services about it, write the fields they add back,
+ * call back to kitura)
+ * in this process instead of invoking an action for each, so an image costs one
+ * activation. The stages hand each other typed values instead of JSON strings.
+ */
+
+import KituraNet
+import Dispatch
+import Foundation
+import SwiftyJSON
+
+func main(args: [String:Any]) -> [String:Any] {
+
+    guard let services = Services(args: args) else {
+        print("Error: missing a required parameter for the image processing pipeline.")
+        return [
+            "success": false,
+            "error": "Missing a required parameter for the image processing pipeline"
+        ]
+    }
+
+    // weather and visual recognition each get this long, in milliseconds, to answer
+    let branchTimeout = args["branchTimeout"] as? Int ?? 20000
+
+    // the server batches several images into one invocation when it is busy
+    guard let imageIds = args["imageIds"] as? [String] else {
+        var result = process(imageId: args["imageId"] as? String ?? "",
+                             document: args["document"] as? [String:Any],
+                             traceId: args["traceId"] as? String ?? "",
+                             services: services,
+                             branchTimeout: branchTimeout)
+        services.saveWeatherCache()
+        result["weatherCache"] = services.weatherCacheStats
+        return result
+    }
+
+    // each image carries the id of its own trace, and the server sends the documents it just created
+    let traceIds = args["traceIds"] as? [String] ?? []
+    let documents = args["documents"] as? [Any] ?? []
+    var results: [[String:Any]] = []
+    for (index, imageId) in imageIds.enumerated() {
+        let traceId = index < traceIds.count ? traceIds[index] : ""
+        let document = index < documents.count ? documents[index] as? [String:Any] : nil
+        results.append(process(imageId: imageId, document: document, traceId: traceId, services: services,
+                               branchTimeout: branchTimeout))
+    }
+    var result: [String:Any] = [
+        "success": !results.contains { $0["success"] as? Bool != true },
+        "results": results
+    ]
+    let errors = results.flatMap { $0["error"] as? String }
+    if (!errors.isEmpty) {
+        result["error"] = errors.joined(separator: "; ")
+    }
+    services.saveWeatherCache()
+    result["weatherCache"] = services.weatherCacheStats
+    return result
+}
+
+/**
+ * Current weather at the location of an image
+ */
+struct WeatherObservation {
+    let iconId: Int
+    let description: String
+    let temperature: Int
+
+    /// The `location.weather` field of an image document
+    var json: JSON {
+        return JSON([
+            "iconId": iconId,
+            "description": description,
+            "temperature": temperature
+        ])
+    }
+}
+
+/**
+ * Class of an image found by visual recognition
+ */
+struct ImageTag {
+    let label: String
+    let confidence: Double
+}
+
+/**
+ * Status and body of a response from one of the services
+ */
+struct ServiceResponse {
+    let status: Int
+    let body: Data
+
+    /// New revision of a document changed by an update handler
+    let revision: String?
+}
+
+/**
+ * The services the pipeline talks to, set up once per activation from the package
+ * parameters and shared by every image and stage of it
+ */
+struct Services {
+
+    /// Number of times a field update is sent before a conflict is given up on
+    static let maxUpdateAttempts = 5
+
+    private let cloudant: [ClientRequest.Options]
+    private let cloudantDbName: String
+    private let weather: [ClientRequest.Options]?
+    private let weatherCache: WeatherCache?
+    private let visualRecognitionKey: String?
+    private let kitura: [ClientRequest.Options]
+
+    init?(args: [String:Any]) {
+        guard let cloudantDbName = args["cloudantDbName"] as? String,
+            let cloudantHost = args["cloudantHost"] as? String,
+            let cloudantUsername = args["cloudantUsername"] as? String,
+            let cloudantPassword = args["cloudantPassword"] as? String,
+            let kituraHost = args["kituraHost"] as? String,
+            let kituraPort = args["kituraPort"] as? Int else {
+                return nil
+        }
+
+        let jsonHeaders = ["Accept": "application/json", "Content-Type": "application/json"]
+        self.cloudantDbName = cloudantDbName
+        cloudant = [ .schema("https://"),
+                     .hostname(cloudantHost),
+                     .username(cloudantUsername),
+                     .password(cloudantPassword),
+                     .port(443),
+                     .headers(jsonHeaders)
+        ]
+
+        if let username = args["weatherUsername"] as? String,
+            let password = args["weatherPassword"] as? String {
+            weather = [ .schema("https://"),
+                        .hostname("twcservice.mybluemix.net"),
+                        .username(username),
+                        .password(password)
+            ]
+        } else {
+            weather = nil
+        }
+        weatherCache = WeatherCache(args: args)
+
+        visualRecognitionKey = args["visualRecognitionKey"] as? String
+
+        kitura = [ .schema(args["kituraSchema"] as? String ?? "http"),
+                   .hostname(kituraHost),
+                   .port(Int16(kituraPort))
+        ]
+    }
+
+    var hasWeather: Bool {
+        return weather != nil
+    }
+
+    var hasVisualRecognition: Bool {
+        return visualRecognitionKey != nil
+    }
+
+    /// Writes the weather cache once for the whole activation, including misses whose fetch failed
+    func saveWeatherCache() {
+        weatherCache?.save()
+    }
+
+    /// Hit rate of the weather cache, or nil when it is turned off
+    var weatherCacheStats: [String:Any]? {
+        return weatherCache?.stats()
+    }
+
+    /**
+     * Reads an image document, returning nil if cloudant answered with an error
+     */
+    func readDocument(id: String, traceId: String) -> JSON? {
+        guard let response = send(cloudant + [.method("GET"), .path("/\(cloudantDbName)/\(id)")], traceId: traceId),
+            response.status == 200 else {
+            return nil
+        }
+
+        let document = JSON(data: response.body)
+        return document.exists() && !document["error"].exists() ? document : nil
+    }
+
+    /**
+     * Merges the fields processing adds into the stored image document with the design
+     * document's enrich update handler, returning the document's new revision. The update
+     * only conflicts with a write that landed while the handler ran, so it is sent again
+     * on a conflict.
+     */
+    func updateFields(_ fields: JSON, id: String, traceId: String) -> String? {
+        guard let body = try? fields.rawData() else {
+            return nil
+        }
+
+        let path = "/\(cloudantDbName)/_design/main_design/_update/enrich/\(id)"
+        for attempt in 1...Services.maxUpdateAttempts {
+            guard let response = send(cloudant + [.method("PUT"), .path(path)], body: body, traceId: traceId) else {
+                return nil
+            }
+            if response.status == 409 && attempt < Services.maxUpdateAttempts {
+                print("Conflict [trace \(traceId)]: retrying update of \(id), attempt \(attempt + 1)")
+                usleep(UInt32(100_000 * attempt))
+                continue
+            }
+            guard JSON(data: response.body)["ok"].bool == true else {
+                return nil
+            }
+            return response.revision ?? ""
+        }
+        return nil
+    }
+
+    /**
+     * Current weather observation at a location, from the cache when an image close
+     * by in place and time has been processed
+     */
+    func observeWeather(latitude: String, longitude: String, traceId: String) -> WeatherObservation? {
+        guard let weather = weather else {
+            return nil
+        }
+
+        var cacheKey: String?
+        if let cache = weatherCache, let lat = Double(latitude), let lon = Double(longitude) {
+            let key = cache.key(latitude: lat, longitude: lon, language: "en-US")
+            if let cached = cache.lookup(key),
+                let iconId = cached["iconId"] as? Int,
+                let description = cached["description"] as? String {
+                return WeatherObservation(iconId: iconId, description: description,
+                                          temperature: cached["temperature"] as? Int ?? 0)
+            }
+            cacheKey = key
+        }
+
+        let path = "/api/weather/v1/geocode/\(latitude)/\(longitude)/observations.json?language=en-US"
+        guard let response = send(weather + [.method("GET"), .path(path)], traceId: traceId) else {
+            return nil
+        }
+
+        let observation = JSON(data: response.body)["observation"]
+        guard let iconId = observation["wx_icon"].int,
+            let description = observation["wx_phrase"].string else {
+            print("Error [trace \(traceId)]: Unable to resolve sky cover and icon code weather response data")
+            return nil
+        }
+        let result = WeatherObservation(iconId: iconId, description: description, temperature: observation["temp"].int ?? 0)
+        if let cache = weatherCache, let key = cacheKey {
+            cache.store(result.json.dictionaryObject ?? [:], key: key)
+        }
+        return result
+    }
+
+    /**
+     * Classes visual recognition finds in the image at a URL
+     */
+    func classify(imageURL: String, traceId: String) -> [ImageTag]? {
+        guard let visualRecognitionKey = visualRecognitionKey else {
+            return nil
+        }
+
+        let path = "/visual-recognition/api/v3/classify?api_key=\(visualRecognitionKey)&url=\(imageURL)&version=2016-05-20"
+        let options: [ClientRequest.Options] = [ .method("GET"),
+                                                 .schema("https://"),
+                                                 .hostname("gateway-a.watsonplatform.net"),
+                                                 .port(443),
+                                                 .path(path)
+        ]
+        guard let response = send(options, traceId: traceId) else {
+            return nil
+        }
+
+        let classes = JSON(data: response.body)["images"][0]["classifiers"][0]["classes"].arrayValue
+        return classes.flatMap { imageClass -> ImageTag? in
+            guard let label = imageClass["class"].string, let confidence = imageClass["score"].double else {
+                return nil
+            }
+            return ImageTag(label: label, confidence: confidence)
+        }
+    }
+
+    /**
+     * Calls back to kitura with the processed document, which sends the push notification
+     */
+    func callback(imageId: String, document: JSON, traceId: String, traceSpans: String) -> String {
+        var headers = ["Authorization": "", "Content-Type": "application/json"]
+
+        // the trace id and the pipeline's spans join the trace kitura started at upload
+        if (!traceId.isEmpty) {
+            headers["X-BluePic-Trace-Id"] = traceId
+            headers["X-BluePic-Trace-Spans"] = traceSpans
+        }
+
+        let body = (try? document.rawData()) ?? Data()
+        headers["Content-Length"] = String(body.count)
+        let options = kitura + [.method("POST"), .path("/push/images/\(imageId)"), .headers(headers)]
+        guard let response = send(options, body: body, traceId: traceId) else {
+            return "Status error code or nil reponse received from Kitura server."
+        }
+        return "HTTP \(response.status)"
+    }
+
+    private func send(_ options: [ClientRequest.Options], body: Data? = nil, traceId: String) -> ServiceResponse? {
+        var result: ServiceResponse?
+        let req = HTTP.request(options) { response in
+            guard let response = response else {
+                return
+            }
+            do {
+                var data = Data()
+                _ = try response.readAllData(into: &data)
+                result = ServiceResponse(status: response.status, body: data,
+                                         revision: response.headers["X-Couch-Update-NewRev"]?.first)
+            } catch {
+                print("Error [trace \(traceId)]: \(error)")
+            }
+        }
+        if let body = body {
+            req.end(body)
+        } else {
+            req.end()
+        }
+        return result
+    }
+}
+
+/**
+ * Timed steps of one image's processing, reported to kitura with the callback
+ * so they join the trace the server started when the image was uploaded.
+ * Steps may be recorded from several threads at once.
+ */
+class Trace {
+
+    let id: String
+    private let queue = DispatchQueue(label: "traceQueue")
+    private var spans: [[String:Any]] = []
+    private var timings: [String:Int] = [:]
+    private var timedOut: [String] = []
+
+    init(id: String) {
+        self.id = id
+    }
+
+    /**
+     * Records a step in the Chrome trace event fields the server expects, with
+     * times in microseconds since 1970
+     */
+    func record(_ name: String, start: Date, end: Date = Date()) {
+        let duration = Int(end.timeIntervalSince(start) * 1_000_000)
+        let span: [String:Any] = [
+            "name": name,
+            "cat": "cloudFunctions",
+            "ts": Int(start.timeIntervalSince1970 * 1_000_000),
+            "dur": duration
+        ]
+        queue.sync {
+            spans.append(span)
+            timings[name] = duration / 1000
+        }
+    }
+
+    /**
+     * Runs a step, recording the time it took
+     */
+    func time<T>(_ name: String, _ step: () -> T) -> T {
+        let start = Date()
+        let result = step()
+        record(name, start: start)
+        return result
+    }
+
+    /**
+     * Runs a step on another thread, recording the time it took. The result is
+     * dropped if it is not ready by `deadline`.
+     */
+    func branch<T>(_ name: String, deadline: DispatchTime, _ step: @escaping () -> T?) -> () -> T? {
+        var result: T?
+        let done = DispatchSemaphore(value: 0)
+        DispatchQueue.global().async {
+            result = self.time(name, step)
+            done.signal()
+        }
+        return {
+            guard done.wait(timeout: deadline) == .success else {
+                self.queue.sync {
+                    self.timedOut.append(name)
+                }
+                return nil
+            }
+            return result
+        }
+    }
+
+    /**
+     * Milliseconds taken by each step so far, and the steps that timed out
+     */
+    func stageTimings() -> [String:Any] {
+        return queue.sync { () -> [String:Any] in
+            var stages: [String:Any] = [:]
+            for (name, duration) in timings {
+                stages[name] = duration
+            }
+            if (!timedOut.isEmpty) {
+                stages["timedOut"] = timedOut
+            }
+            return stages
+        }
+    }
+
+    /**
+     * The spans recorded so far as a JSON array
+     */
+    func spansJSON() -> String {
+        let spans = queue.sync { self.spans }
+        guard let data = try? JSONSerialization.data(withJSONObject: spans, options: []),
+            let json = String(data: data, encoding: String.Encoding.utf8) else {
+            return "[]"
+        }
+        return json
+    }
+}
+
+/**
+ * Reads, enriches and writes back a single image document, then calls back to kitura.
+ * The server sends the document it has just created, which spares the read; only the
+ * fields processing adds are written back.
+ */
+func process(imageId: String, document: [String:Any]?, traceId: String, services: Services,
+             branchTimeout: Int) -> [String:Any] {
+
+    var error: String = ""
+    var returnValue: String = ""
+    let trace = Trace(id: traceId)
+    let processStart = Date()
+
+    var givenDocument = document.map { JSON($0) }
+    if givenDocument?["_id"].string != imageId {
+        givenDocument = nil
+    }
+
+    if var document = givenDocument
+        ?? trace.time("cloudantRead", { services.readDocument(id: imageId, traceId: traceId) }) {
+
+        // weather and visual recognition don't depend on each other, so they run at the same time
+        let deadline = DispatchTime.now() + .milliseconds(branchTimeout)
+        let location = document["location"]
+
+        var awaitWeather: () -> WeatherObservation? = { nil }
+        if services.hasWeather,
+            let latitude = location["latitude"].number,
+            let longitude = location["longitude"].number {
+            awaitWeather = trace.branch("weather", deadline: deadline) {
+                services.observeWeather(latitude: String(describing: latitude),
+                                        longitude: String(describing: longitude),
+                                        traceId: traceId)
+            }
+        }
+
+        var awaitTags: () -> [ImageTag]? = { nil }
+        // an upload the server matched to an earlier copy already carries its tags
+        if services.hasVisualRecognition, let imageURL = document["url"].string, document["tags"].arrayValue.isEmpty {
+            awaitTags = trace.branch("visualRecognition", deadline: deadline) {
+                services.classify(imageURL: imageURL, traceId: traceId)
+            }
+        }
+
+        var fields: JSON = [:]
+        if let observation = awaitWeather() {
+            document["location"]["weather"] = observation.json
+            fields["weather"] = observation.json
+        }
+        if let tags = awaitTags() {
+            document["tags"] = JSON(tags.map { ["label": $0.label, "confidence": $0.confidence] })
+            fields["tags"] = document["tags"]
+        }
+
+        // nothing is written when processing added nothing
+        var revision: String? = document["_rev"].stringValue
+        if (!fields.dictionaryValue.isEmpty) {
+            revision = trace.time("cloudantWrite") { services.updateFields(fields, id: imageId, traceId: traceId) }
+        }
+
+        if let revision = revision {
+            if (!revision.isEmpty) {
+                document["_rev"] = JSON(revision)
+            }
+
+            // the callback carries the spans so far; kitura times the rest
+            trace.record("processImage", start: processStart)
+            let response = trace.time("kituraCallback") {
+                services.callback(imageId: imageId, document: document, traceId: traceId, traceSpans: trace.spansJSON())
+            }
+            returnValue = "Processed request through callback to kitura with server response: \(response)"
+        } else {
+            error = "Error writing to Cloudant"
+        }
+
+    } else {
+        error = "Unable to fetch document from Cloudant"
+    }
+
+    var result: [String:Any] = [
+        "success": (error == ""),
+        "response": returnValue,
+        "traceId": traceId,
+        "timings": trace.stageTimings()
+    ]
+    if (error != "") {
+        result["error"] = error
+    }
+
+    return result
+}
+
+/**
+ * Weather observations cached by geohash cell and time bucket.
+ *
+ * The cache lives in a file, so it outlives the activation that filled it and is
+ * shared by every later activation the same warm container runs. Observations are
+ * bucketed by `weatherCacheTTL` seconds, and a cell of `weatherCachePrecision`
+ * geohash characters spans about 5km at the default of 5.
+ */
+class WeatherCache {
+
+    /// Entries kept at most, after the expired ones are dropped
+    static let capacity = 5000
+
+    let path: String
+    let ttl: Int
+    let precision: Int
+
+    private var entries: [String:[String:Any]] = [:]
+    private var hits = 0
+    private var misses = 0
+
+    /**
+     * The cache configured by the action parameters, or nil if it is turned off
+     */
+    init?(args: [String:Any]) {
+        path = args["weatherCachePath"] as? String ?? "/tmp/bluepic-weather-cache.json"
+        ttl = args["weatherCacheTTL"] as? Int ?? 900
+        precision = min(12, args["weatherCachePrecision"] as? Int ?? 5)
+        guard ttl > 0, precision > 0, !path.isEmpty else {
+            return nil
+        }
+
+        if let data = FileManager.default.contents(atPath: path),
+            let object = (try? JSONSerialization.jsonObject(with: data, options: [])) as? [String:Any] {
+            entries = object["entries"] as? [String:[String:Any]] ?? [:]
+            hits = object["hits"] as? Int ?? 0
+            misses = object["misses"] as? Int ?? 0
+        }
+    }
+
+    /**
+     * Key of the cell holding a location, in the time bucket holding `now`
+     */
+    func key(latitude: Double, longitude: Double, language: String, now: Date = Date()) -> String {
+        let bucket = Int(now.timeIntervalSince1970) / ttl
+        return "\(WeatherCache.geohash(latitude: latitude, longitude: longitude, precision: precision)):\(bucket):\(language)"
+    }
+
+    /**
+     * The observation cached under a key, counting the lookup as a hit or a miss
+     */
+    func lookup(_ key: String, now: Date = Date()) -> [String:Any]? {
+        if let entry = entries[key],
+            let expires = entry["expires"] as? Int,
+            expires > Int(now.timeIntervalSince1970),
+            let weather = entry["weather"] as? [String:Any] {
+            hits += 1
+            return weather
+        }
+        misses += 1
+        return nil
+    }
+
+    /**
+     * Caches an observation until the end of the key's time bucket
+     */
+    func store(_ weather: [String:Any], key: String, now: Date = Date()) {
+        let seconds = Int(now.timeIntervalSince1970)
+        entries[key] = [
+            "weather": weather,
+            "expires": (seconds / ttl + 1) * ttl
+        ]
+
+        for (entryKey, entry) in entries where (entry["expires"] as? Int ?? 0) <= seconds {
+            entries[entryKey] = nil
+        }
+        if entries.count > WeatherCache.capacity {
+            let oldest = entries.sorted { ($0.value["expires"] as? Int ?? 0) < ($1.value["expires"] as? Int ?? 0) }
+            for (entryKey, _) in oldest.prefix(entries.count - WeatherCache.capacity) {
+                entries[entryKey] = nil
+            }
+        }
+    }
+
+    /**
+     * The hit rate of the container so far, and whether the current lookup hit
+     */
+    func stats(hit: Bool? = nil) -> [String:Any] {
+        let lookups = hits + misses
+        var stats: [String:Any] = [
+            "hits": hits,
+            "misses": misses,
+            "hitRate": lookups > 0 ? Double(hits) / Double(lookups) : 0
+        ]
+        if let hit = hit {
+            stats["hit"] = hit
+        }
+        return stats
+    }
+
+    /**
+     * Writes the entries and counters to the cache file, once at the end of an activation
+     */
+    func save() {
+        let object: [String:Any] = ["entries": entries, "hits": hits, "misses": misses]
+        guard let data = try? JSONSerialization.data(withJSONObject: object, options: []) else {
+            return
+        }
+        do {
+            try data.write(to: URL(fileURLWithPath: path), options: .atomic)
+        } catch {
+            print("Error: unable to save the weather cache: \(error)")
+        }
+    }
+
+    /**
+     * Geohash of a location, whose prefixes name ever larger cells around it
+     */
+    static func geohash(latitude: Double, longitude: Double, precision: Int) -> String {
+        let alphabet = Array("0123456789bcdefghjkmnpqrstuvwxyz".characters)
+        var latitudeRange = (-90.0, 90.0)
+        var longitudeRange = (-180.0, 180.0)
+        var hash = ""
+        var length = 0
+        var index = 0
+        var bits = 0
+        var evenBit = true
+
+        while length < precision {
+            if (evenBit) {
+                let middle = (longitudeRange.0 + longitudeRange.1) / 2
+                if (longitude >= middle) {
+                    index = index * 2 + 1
+                    longitudeRange.0 = middle
+                } else {
+                    index = index * 2
+                    longitudeRange.1 = middle
+                }
+            } else {
+                let middle = (latitudeRange.0 + latitudeRange.1) / 2
+                if (latitude >= middle) {
+                    index = index * 2 + 1
+                    latitudeRange.0 = middle
+                } else {
+                    index = index * 2
+                    latitudeRange.1 = middle
+                }
+            }
+            evenBit = !evenBit
+
+            bits += 1
+            if (bits == 5) {
+                hash.append(alphabet[index])
+                length += 1
+                bits = 0
+                index = 0
+            }
+        }
+        return hash
+    }
+}
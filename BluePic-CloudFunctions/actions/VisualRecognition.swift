@@ -9,16 +9,14 @@ import SwiftyJSON
 
 func main(args: [String:Any]) -> [String:Any] {
 
-    var str = ""
-    var result: [String:Any] = [
-        "visualRecognition": str
-    ]
-
     guard let visualRecognitionKey = args["visualRecognitionKey"] as? String,
         let imageURL = args["imageURL"] as? String else {
-            return result
+            return ["error": "Missing a required parameter for visual recognition"]
     }
 
+    // the orchestrator passes the trace id of the image, which ties these logs to it
+    let traceId = args["traceId"] as? String ?? ""
+
     let requestOptions: [ClientRequest.Options] = [ .method("GET"),
                                                     .schema("https://"),
                                                     .hostname("gateway-a.watsonplatform.net"),
@@ -26,35 +24,32 @@ func main(args: [String:Any]) -> [String:Any] {
                                                     .path("/visual-recognition/api/v3/classify?api_key=\(visualRecognitionKey)&url=\(imageURL)&version=2016-05-20")
     ]
 
+    // the classes are returned in the shape of the image document's tags field
+    var result: [String:Any] = [:]
     let req = HTTP.request(requestOptions) { response in
         do {
-            if let response = response, let responseStr = try response.readString(),
-            let dataResponse = responseStr.data(using: String.Encoding.utf8, allowLossyConversion: true) {
-
-                let jsonObj = JSON(data: dataResponse)
+            guard let response = response else {
+                result = ["error": "No response was received from Visual Recognition"]
+                return
+            }
 
-                if let imageClasses = jsonObj["images"][0]["classifiers"][0]["classes"].array {
-                	for imageClass in imageClasses {
+            var data = Data()
+            _ = try response.readAllData(into: &data)
+            let jsonObj = JSON(data: data)
 
-                		if let label = imageClass["class"].string, let confidence = imageClass["score"].double {
-                			if (str.characters.count > 0) {
-   		                    	str = str + ","
-                            }
-                			str += "{\"label\":\"\(label)\",\"confidence\":\(confidence)}"
-                		}
-                	}
+            var tags: [[String:Any]] = []
+            for imageClass in jsonObj["images"][0]["classifiers"][0]["classes"].arrayValue {
+                if let label = imageClass["class"].string, let confidence = imageClass["score"].double {
+                    tags.append(["label": label, "confidence": confidence])
                 }
             }
+            result = ["visualRecognition": tags]
         } catch {
-            print("Error: \(error)")
+            print("Error [trace \(traceId)]: \(error)")
+            result = ["error": "\(error)"]
         }
     }
     req.end()
 
-	str = "[\(str)]"
-    result = [
-        "visualRecognition": str
-    ]
-
     return result
 }
@@ -10,23 +10,32 @@ import SwiftyJSON
 
 func main(args: [String:Any]) -> [String:Any] {
 
-    var str = ""
-    var result: [String:Any] = [
-        "weather": str
-    ]
-
     guard   let username = args["weatherUsername"] as? String,
             let password = args["weatherPassword"] as? String,
             let latitude = args["latitude"] as? String,
             let longitude = args["longitude"] as? String else {
 
-            str = "Error: missing a required parameter for retrieving weather data."
-            return result
+            return ["error": "Missing a required parameter for retrieving weather data"]
     }
 
     let language = args["language"] as? String ?? "en-US"
     let units = args["units"] as? String ?? "e"
 
+    // photos taken close together in place and time share one observation
+    let cache = WeatherCache(args: args)
+    var cacheKey: String?
+    if let cache = cache, let lat = Double(latitude), let lon = Double(longitude) {
+        let key = cache.key(latitude: lat, longitude: lon, language: language)
+        if let weather = cache.lookup(key) {
+            cache.save()
+            return [
+                "weather": weather,
+                "cache": cache.stats(hit: true)
+            ]
+        }
+        cacheKey = key
+    }
+
     let requestOptions: [ClientRequest.Options] = [ .method("GET"),
                                                     .schema("https://"),
                                                     .hostname("twcservice.mybluemix.net"),
@@ -35,41 +44,209 @@ func main(args: [String:Any]) -> [String:Any] {
                                                     .path("/api/weather/v1/geocode/\(latitude)/\(longitude)/observations.json?language=\(language)")
     ]
 
+    // the observation is returned in the shape of the image document's location.weather field
+    var result: [String:Any] = [:]
     let req = HTTP.request(requestOptions) { response  in
         do {
             guard let response = response else {
-                str = "No response was received from Weather Insights"
+                result = ["error": "No response was received from Weather Insights"]
                 return
             }
 
             var data = Data()
-            _ = try response.read(into: &data)
+            _ = try response.readAllData(into: &data)
             let json = SwiftyJSON.JSON(data: data)
 
             guard   let icon_code = json["observation"]["wx_icon"].int,
                     let sky_cover = json["observation"]["wx_phrase"].string else {
 
-                str = "Unable to resolve sky cover and icon code weather response data"
+                result = ["error": "Unable to resolve sky cover and icon code weather response data"]
                 return
             }
 
-            let temp = json["observation"]["temp"].int ?? 0
-
-
-            str = "{ \"observation\":{" +
-                    "\"icon_code\":\(icon_code)," +
-                    "\"sky_cover\":\"\(sky_cover)\"," +
-                    "\"imperial\":{\"temp\":\(temp)}" +
-                    "}}"
+            result = [
+                "weather": [
+                    "iconId": icon_code,
+                    "description": sky_cover,
+                    "temperature": json["observation"]["temp"].int ?? 0
+                ]
+            ]
         } catch {
-            str = "Error \(error)"
+            result = ["error": "Error \(error)"]
         }
     }
     req.end()
 
-    result = [
-        "weather": "\(str)"
-    ]
+    // the miss is saved even when the fetch failed, so the hit rate counts it
+    if let cache = cache, let key = cacheKey {
+        if let weather = result["weather"] as? [String:Any] {
+            cache.store(weather, key: key)
+        }
+        cache.save()
+        result["cache"] = cache.stats(hit: false)
+    }
 
     return result
 }
+
+/**
+ * Weather observations cached by geohash cell and time bucket.
+ *
+ * The cache lives in a file, so it outlives the activation that filled it and is
+ * shared by every later activation the same warm container runs. Observations are
+ * bucketed by `weatherCacheTTL` seconds, and a cell of `weatherCachePrecision`
+ * geohash characters spans about 5km at the default of 5.
+ */
+class WeatherCache {
+
+    /// Entries kept at most, after the expired ones are dropped
+    static let capacity = 5000
+
+    let path: String
+    let ttl: Int
+    let precision: Int
+
+    private var entries: [String:[String:Any]] = [:]
+    private var hits = 0
+    private var misses = 0
+
+    /**
+     * The cache configured by the action parameters, or nil if it is turned off
+     */
+    init?(args: [String:Any]) {
+        path = args["weatherCachePath"] as? String ?? "/tmp/bluepic-weather-cache.json"
+        ttl = args["weatherCacheTTL"] as? Int ?? 900
+        precision = min(12, args["weatherCachePrecision"] as? Int ?? 5)
+        guard ttl > 0, precision > 0, !path.isEmpty else {
+            return nil
+        }
+
+        if let data = FileManager.default.contents(atPath: path),
+            let object = (try? JSONSerialization.jsonObject(with: data, options: [])) as? [String:Any] {
+            entries = object["entries"] as? [String:[String:Any]] ?? [:]
+            hits = object["hits"] as? Int ?? 0
+            misses = object["misses"] as? Int ?? 0
+        }
+    }
+
+    /**
+     * Key of the cell holding a location, in the time bucket holding `now`
+     */
+    func key(latitude: Double, longitude: Double, language: String, now: Date = Date()) -> String {
+        let bucket = Int(now.timeIntervalSince1970) / ttl
+        return "\(WeatherCache.geohash(latitude: latitude, longitude: longitude, precision: precision)):\(bucket):\(language)"
+    }
+
+    /**
+     * The observation cached under a key, counting the lookup as a hit or a miss
+     */
+    func lookup(_ key: String, now: Date = Date()) -> [String:Any]? {
+        if let entry = entries[key],
+            let expires = entry["expires"] as? Int,
+            expires > Int(now.timeIntervalSince1970),
+            let weather = entry["weather"] as? [String:Any] {
+            hits += 1
+            return weather
+        }
+        misses += 1
+        return nil
+    }
+
+    /**
+     * Caches an observation until the end of the key's time bucket
+     */
+    func store(_ weather: [String:Any], key: String, now: Date = Date()) {
+        let seconds = Int(now.timeIntervalSince1970)
+        entries[key] = [
+            "weather": weather,
+            "expires": (seconds / ttl + 1) * ttl
+        ]
+
+        for (entryKey, entry) in entries where (entry["expires"] as? Int ?? 0) <= seconds {
+            entries[entryKey] = nil
+        }
+        if entries.count > WeatherCache.capacity {
+            let oldest = entries.sorted { ($0.value["expires"] as? Int ?? 0) < ($1.value["expires"] as? Int ?? 0) }
+            for (entryKey, _) in oldest.prefix(entries.count - WeatherCache.capacity) {
+                entries[entryKey] = nil
+            }
+        }
+    }
+
+    /**
+     * The hit rate of the container so far, and whether the current lookup hit
+     */
+    func stats(hit: Bool? = nil) -> [String:Any] {
+        let lookups = hits + misses
+        var stats: [String:Any] = [
+            "hits": hits,
+            "misses": misses,
+            "hitRate": lookups > 0 ? Double(hits) / Double(lookups) : 0
+        ]
+        if let hit = hit {
+            stats["hit"] = hit
+        }
+        return stats
+    }
+
+    /**
+     * Writes the entries and counters to the cache file, once at the end of an activation
+     */
+    func save() {
+        let object: [String:Any] = ["entries": entries, "hits": hits, "misses": misses]
+        guard let data = try? JSONSerialization.data(withJSONObject: object, options: []) else {
+            return
+        }
+        do {
+            try data.write(to: URL(fileURLWithPath: path), options: .atomic)
+        } catch {
+            print("Error: unable to save the weather cache: \(error)")
+        }
+    }
+
+    /**
+     * Geohash of a location, whose prefixes name ever larger cells around it
+     */
+    static func geohash(latitude: Double, longitude: Double, precision: Int) -> String {
+        let alphabet = Array("0123456789bcdefghjkmnpqrstuvwxyz".characters)
+        var latitudeRange = (-90.0, 90.0)
+        var longitudeRange = (-180.0, 180.0)
+        var hash = ""
+        var length = 0
+        var index = 0
+        var bits = 0
+        var evenBit = true
+
+        while length < precision {
+            if (evenBit) {
+                let middle = (longitudeRange.0 + longitudeRange.1) / 2
+                if (longitude >= middle) {
+                    index = index * 2 + 1
+                    longitudeRange.0 = middle
+                } else {
+                    index = index * 2
+                    longitudeRange.1 = middle
+                }
+            } else {
+                let middle = (latitudeRange.0 + latitudeRange.1) / 2
+                if (latitude >= middle) {
+                    index = index * 2 + 1
+                    latitudeRange.0 = middle
+                } else {
+                    index = index * 2
+                    latitudeRange.1 = middle
+                }
+            }
+            evenBit = !evenBit
+
+            bits += 1
+            if (bits == 5) {
+                hash.append(alphabet[index])
+                length += 1
+                bits = 0
+                index = 0
+            }
+        }
+        return hash
+    }
+}
@@ -0,0 +1,73 @@
+#!/bin/bash
+#
+# Copyright 2017 IBM Corp. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the “License”);
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an “AS IS” BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Processes the same image with the orchestrated actions and with the fused
+# pipeline action in turn, and reports how long each activation took.
+# Each run writes the image document and calls back to kitura, which sends
+# a push notification, so point it at an image of a test user.
+
+# Color vars to be used in shell script output
+RED='\033[0;31m'
+YELLOW='\033[0;33m'
+GREEN='\033[0;32m'
+NC='\033[0m'
+
+function usage() {
+  echo -e "${YELLOW}Usage: $0 <image id> [runs]${NC}"
+}
+
+if [ -z "$1" ]; then
+  usage
+  exit 1
+fi
+
+IMAGE_ID=$1
+RUNS=${2:-10}
+
+# Invokes an action blocking and prints the duration of its activation in milliseconds
+function activationDuration() {
+  bx wsk action invoke "$1" -p imageId "$IMAGE_ID" --blocking\
+    | grep -m 1 '"duration":'\
+    | tr -dc '0-9'
+}
+
+# Runs an action RUNS times and prints the min, median, mean and max duration
+function measure() {
+  local action=$1
+  local durations=()
+  for ((run = 1; run <= RUNS; run++)); do
+    local duration=$(activationDuration "$action")
+    if [ -z "$duration" ]; then
+      echo -e "${RED}Run $run of $action did not complete${NC}"
+      continue
+    fi
+    durations+=("$duration")
+  done
+
+  printf '%s\n' "${durations[@]}" | sort -n | awk -v action="$action" '
+    { values[NR] = $1; sum += $1 }
+    END {
+      if (NR == 0) { exit }
+      printf "%-30s runs %3d  min %6d ms  p50 %6d ms  mean %8.1f ms  max %6d ms\n",
+        action, NR, values[1], values[int((NR + 1) / 2)], sum / NR, values[NR]
+    }'
+}
+
+echo -e "${YELLOW}Processing image $IMAGE_ID $RUNS times with each mode...${NC}"
+echo -e "${GREEN}"
+measure bluepic/processImage
+measure bluepic/processImagePipeline
+echo -e "${NC}"
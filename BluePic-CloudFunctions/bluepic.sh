@@ -67,6 +67,7 @@ function install() {
   bx wsk action create --kind swift:3.1.1 bluepic/kituraRequestAuth actions/KituraRequestAuth.swift -t 300000
   bx wsk action create --kind swift:3.1.1 bluepic/kituraCallback actions/KituraCallback.swift -t 300000
   bx wsk action create --kind swift:3.1.1 bluepic/processImage actions/Orchestrator.swift -t 300000
+  bx wsk action create --kind swift:3.1.1 bluepic/processImagePipeline actions/Pipeline.swift -t 300000
 
   echo -e "${GREEN}Install Complete${NC}"
   bx wsk list
@@ -102,6 +103,7 @@ function uninstall() {
   bx wsk action delete bluepic/cloudantRead
   bx wsk action delete bluepic/cloudantWrite
   bx wsk action delete bluepic/processImage
+  bx wsk action delete bluepic/processImagePipeline
   bx wsk action delete bluepic/kituraRequestAuth
   bx wsk action delete bluepic/kituraCallback
 
@@ -36,7 +36,8 @@ let package = Package(
       .package(url: "https://github.com/ibm-bluemix-mobile-services/bluemix-objectstorage-serversdk-swift.git", .upToNextMinor(from: "0.8.0")),
       .package(url: "https://github.com/ibm-bluemix-mobile-services/bms-pushnotifications-serversdk-swift.git", .upToNextMinor(from: "0.6.0")),
       .package(url: "https://github.com/ibm-cloud-security/appid-serversdk-swift.git", .upToNextMinor(from: "2.0.0")),
-      .package(url: "https://github.com/IBM-Swift/Kitura-CredentialsFacebook.git", .upToNextMinor(from: "2.0.0"))
+      .package(url: "https://github.com/IBM-Swift/Kitura-CredentialsFacebook.git", .upToNextMinor(from: "2.0.0")),
+      .package(url: "https://github.com/IBM-Swift/BlueCryptor.git", .upToNextMinor(from: "0.8.0"))
     ],
     targets: [
         .target(
@@ -48,16 +49,31 @@ let package = Package(
                             "BluemixAppID",
                             "CredentialsFacebook",
                             "BluemixPushNotifications",
-                            "SwiftyRequest"
+                            "SwiftyRequest",
+                            "CZlib",
+                            "Cryptor",
+                            "CAtomics"
                           ]
         ),
+        .target(
+            name: "CAtomics",
+            dependencies: []
+        ),
+        .target(
+            name: "CZlib",
+            dependencies: []
+        ),
         .target(
             name: "BluePicServer",
             dependencies: ["BluePicApp"]
         ),
+        .target(
+            name: "BluePicBenchmark",
+            dependencies: ["BluePicApp"]
+        ),
         .testTarget(
             name: "BluePicAppTests",
-            dependencies: ["BluePicServer"]
+            dependencies: ["BluePicApp", "BluePicServer"]
         )
     ]
 )
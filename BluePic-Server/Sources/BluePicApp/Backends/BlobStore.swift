@@ -0,0 +1,174 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import LoggerAPI
+import BluemixObjectStorage
+import CloudEnvironment
+
+/// Reasons a blob store could not hand back a container
+enum BlobStoreError: Error {
+
+  /// The blob store answered that no container has the name
+  case containerNotFound
+
+  /// The blob store could not be reached or authenticated with
+  case unavailable
+}
+
+/// Container of objects in a blob store; every user has one holding their images
+protocol BlobContainer: class {
+
+  var name: String { get }
+
+  /**
+   Stores an object, replacing any object of the same name.
+
+   - parameter name:       name of the object
+   - parameter data:       contents of the object
+   - parameter metadata:   object metadata headers, such as `X-Object-Manifest`
+   - parameter completion: called with nil on success
+   */
+  func storeObject(name: String, data: Data, metadata: [String: String], completion: @escaping (Error?) -> Void)
+
+  /// Deletes an object, calling `completion` with nil on success
+  func deleteObject(name: String, completion: @escaping (Error?) -> Void)
+}
+
+/// Store of the image binaries, which clients download straight from their public URLs
+protocol BlobStore: class {
+
+  /// Creates a container readable by anyone, calling back with nil if it could not be created
+  func createContainer(named name: String, completion: @escaping (BlobContainer?) -> Void)
+
+  /**
+   Looks up an existing container.
+
+   - parameter completion: called with the container, or with `BlobStoreError.containerNotFound` when
+     there is none and with another error when the blob store could not tell
+   */
+  func retrieveContainer(named name: String, completion: @escaping (BlobContainer?, Error?) -> Void)
+
+  /// Public URL of an object
+  func url(forObject name: String, inContainer containerName: String) -> String
+}
+
+/// Images kept in IBM Cloud Object Storage
+final class ObjectStorageBlobStore: BlobStore {
+
+  private let connection: ObjectStorageConn
+  private let projectID: String
+
+  init(credentials: ObjectStorageCredentials) {
+    connection = ObjectStorageConn(credentials: credentials)
+    projectID = credentials.projectID
+  }
+
+  func createContainer(named name: String, completion: @escaping (BlobContainer?) -> Void) {
+    // Cofigure container for public access and web hosting
+    let configureContainer = { (container: ObjectStorageContainer) -> Void in
+      let metadata: Dictionary = [
+        "X-Container-Meta-Web-Listings": "true",
+        "X-Container-Read": ".r:*,.rlistings"
+      ]
+      container.updateMetadata(metadata: metadata) { error in
+        if error != nil {
+          Log.error("Could not configure container named '\(name)' for public access and web hosting.")
+          completion(nil)
+        } else {
+          Log.verbose("Configured successfully container named '\(name)' for public access and web hosting.")
+          completion(ObjectStorageBlobContainer(container: container))
+        }
+      }
+    }
+
+    connection.getObjectStorage { objStorage in
+      guard let objStorage = objStorage else {
+        completion(nil)
+        return
+      }
+
+      objStorage.createContainer(name: name) { error, container in
+        if let container = container, error == nil {
+          configureContainer(container)
+        } else {
+          Log.error("Could not create container named '\(name)'.")
+          completion(nil)
+        }
+      }
+    }
+  }
+
+  func retrieveContainer(named name: String, completion: @escaping (BlobContainer?, Error?) -> Void) {
+    connection.getObjectStorage { objStorage in
+      guard let objStorage = objStorage else {
+        completion(nil, BlobStoreError.unavailable)
+        return
+      }
+
+      Log.debug("retrieving container: \(name)")
+      objStorage.retrieveContainer(name: name) { error, container in
+        if let container = container, error == nil {
+          completion(ObjectStorageBlobContainer(container: container), nil)
+        } else if case .some(ObjectStorageError.notFound) = error {
+          Log.error("Could not find container named '\(name)'.")
+          completion(nil, BlobStoreError.containerNotFound)
+        } else {
+          // Auth, network and server errors say nothing about whether the container exists
+          Log.error("Could not retrieve container named '\(name)': \(String(describing: error))")
+          completion(nil, error ?? BlobStoreError.unavailable)
+        }
+      }
+    }
+  }
+
+  func url(forObject name: String, inContainer containerName: String) -> String {
+    let baseURL = "https://dal.objectstorage.open.softlayer.com/v1/AUTH_\(projectID)"
+    return "\(baseURL)/\(containerName)/\(name)"
+  }
+}
+
+/// Object Storage container
+final class ObjectStorageBlobContainer: BlobContainer {
+
+  private let container: ObjectStorageContainer
+
+  init(container: ObjectStorageContainer) {
+    self.container = container
+  }
+
+  var name: String {
+    return container.name
+  }
+
+  func storeObject(name: String, data: Data, metadata: [String: String], completion: @escaping (Error?) -> Void) {
+    if metadata.isEmpty {
+      container.storeObject(name: name, data: data) { error, _ in
+        completion(error)
+      }
+    } else {
+      container.storeObject(name: name, data: data, metadata: metadata) { error, _ in
+        completion(error)
+      }
+    }
+  }
+
+  func deleteObject(name: String, completion: @escaping (Error?) -> Void) {
+    container.deleteObject(name: name) { error in
+      completion(error)
+    }
+  }
+}
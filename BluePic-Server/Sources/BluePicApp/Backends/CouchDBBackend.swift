@@ -0,0 +1,163 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import CouchDB
+import KituraNet
+import SwiftyJSON
+
+/// Documents kept in a Cloudant or CouchDB database, whose API is called directly for reads
+final class CouchDBBackend: DatabaseBackend {
+
+  private struct DatabaseInfo: Decodable {
+    let updateSeq: UpdateSequence
+
+    enum CodingKeys: String, CodingKey {
+      case updateSeq = "update_seq"
+    }
+  }
+
+  let database: Database
+
+  init(database: Database) {
+    self.database = database
+  }
+
+  func queryView(_ view: View, params: [Database.QueryParameters], callback: @escaping (BodyReader?, Error?) -> Void) {
+    let query = params.flatMap { $0.queryItem }.map { name, value in
+      name + "=" + Database.escape(value)
+    }.joined(separator: "&")
+
+    let requestOptions = database.requestOptions(method: "GET", path: "/_design/main_design/_view/\(view.rawValue)?\(query)")
+
+    let req = HTTP.request(requestOptions) { response in
+      guard let response = response, response.statusCode == .OK else {
+        callback(nil, BluePicLocalizedError.readDocumentFailed)
+        return
+      }
+      callback(response, nil)
+    }
+    req.end()
+  }
+
+  func create(document: Data, callback: @escaping (String?, Error?) -> Void) {
+    database.create(SwiftyJSON.JSON(data: document)) { _, revision, _, error in
+      guard error == nil, let revision = revision else {
+        callback(nil, error ?? BluePicLocalizedError.createDatabaseObjectFailed("document"))
+        return
+      }
+      callback(revision, nil)
+    }
+  }
+
+  func bulkCreate(documents: [Data], callback: @escaping ([BulkWriteResult]?, Error?) -> Void) {
+    var body = Data("{\"docs\":[".utf8)
+    for (index, document) in documents.enumerated() {
+      if index > 0 {
+        body.append(UInt8(ascii: ","))
+      }
+      body.append(document)
+    }
+    body.append(Data("]}".utf8))
+
+    let requestOptions = database.requestOptions(method: "POST", path: "/_bulk_docs",
+                                                 headers: ["Content-Type": "application/json"])
+    let req = HTTP.request(requestOptions) { response in
+      do {
+        guard let response = response, response.statusCode == .created || response.statusCode == .accepted else {
+          throw BluePicLocalizedError.createDatabaseObjectFailed("documents")
+        }
+
+        var data = Data()
+        _ = try response.readAllData(into: &data)
+        callback(try JSONDecoder().decode([BulkWriteResult].self, from: data), nil)
+      } catch {
+        callback(nil, error)
+      }
+    }
+    req.end(body)
+  }
+
+  func updateSequence(callback: @escaping (String?) -> Void) {
+    var sequence: String?
+    let req = HTTP.request(database.requestOptions(method: "GET", path: "")) { response in
+      guard let response = response, response.statusCode == .OK else {
+        return
+      }
+      var data = Data()
+      _ = try? response.readAllData(into: &data)
+      sequence = (try? JSONDecoder().decode(DatabaseInfo.self, from: data))?.updateSeq.value
+    }
+    req.end()
+    callback(sequence)
+  }
+
+  func changes(since: String, timeout: Int, includeDocs: Bool, callback: @escaping (Data?, Error?) -> Void) {
+    let path = "/_changes?feed=longpoll&timeout=\(timeout)&include_docs=\(includeDocs)&since=\(Database.escape(since))"
+    let req = HTTP.request(database.requestOptions(method: "GET", path: path)) { response in
+      do {
+        guard let response = response, response.statusCode == .OK else {
+          throw BluePicLocalizedError.readDocumentFailed
+        }
+
+        var data = Data()
+        _ = try response.readAllData(into: &data)
+        callback(data, nil)
+      } catch {
+        callback(nil, error)
+      }
+    }
+    req.end()
+  }
+}
+
+extension Database {
+
+  private static let unreserved = CharacterSet.alphanumerics.union(CharacterSet(charactersIn: "-._~"))
+
+  /// Percent encodes a path segment or query value
+  static func escape(_ value: String) -> String {
+    return value.addingPercentEncoding(withAllowedCharacters: unreserved) ?? value
+  }
+
+  /**
+   * Request options for calling the CouchDB API of this database directly.
+   *
+   * - parameter method: HTTP method
+   * - parameter path: Path relative to the database, including any query string
+   * - parameter headers: Additional request headers
+   */
+  func requestOptions(method: String, path: String, headers: [String: String] = [:]) -> [ClientRequest.Options] {
+    var allHeaders = ["Accept": "application/json"]
+    for (name, value) in headers {
+      allHeaders[name] = value
+    }
+
+    var options: [ClientRequest.Options] = [
+      .method(method),
+      .schema(connProperties.secured ? "https://" : "http://"),
+      .hostname(connProperties.host),
+      .port(connProperties.port),
+      .path("/\(Database.escape(name))\(path)"),
+      .headers(allHeaders)
+    ]
+    if let username = connProperties.username, let password = connProperties.password {
+      options.append(.username(username))
+      options.append(.password(password))
+    }
+    return options
+  }
+}
@@ -0,0 +1,121 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import CouchDB
+import KituraNet
+
+/// Response body that is read a chunk at a time
+protocol BodyReader: class {
+
+  /// Appends the next chunk of the body to `data`, returning its length, or 0 once the body has been read
+  func read(into data: inout Data) throws -> Int
+}
+
+extension BodyReader {
+
+  /// Reads the rest of the body
+  func readAll() throws -> Data {
+    var data = Data()
+    while try read(into: &data) > 0 {}
+    return data
+  }
+}
+
+extension ClientResponse: BodyReader {}
+
+/// Body held in memory, handed out in chunks the way a network response arrives
+final class DataBodyReader: BodyReader {
+
+  private let data: Data
+  private let chunkSize: Int
+  private var offset = 0
+
+  init(_ data: Data, chunkSize: Int = 16 * 1024) {
+    self.data = data
+    self.chunkSize = max(1, chunkSize)
+  }
+
+  func read(into buffer: inout Data) throws -> Int {
+    let start = data.startIndex + offset
+    let end = min(data.endIndex, start + chunkSize)
+    guard start < end else {
+      return 0
+    }
+    buffer.append(data[start..<end])
+    offset += end - start
+    return end - start
+  }
+}
+
+/// Outcome of one document of a bulk write, in the form of a `_bulk_docs` response entry
+struct BulkWriteResult: Codable {
+  let id: String?
+
+  /// Revision of the written document, absent when it failed
+  let rev: String?
+
+  let error: String?
+  let reason: String?
+}
+
+/**
+ Store of the BluePic documents.
+
+ View responses and the changes feed are exchanged in CouchDB's wire format, with
+ every view row on a line of its own, so each backend is read by the same
+ streaming decoders.
+ */
+protocol DatabaseBackend: class {
+
+  /**
+   Queries a view of the main design document.
+
+   - parameter view:     view to query
+   - parameter params:   Database.QueryParameters
+   - parameter callback: called with the response body, or the error that prevented the query
+   */
+  func queryView(_ view: View, params: [Database.QueryParameters], callback: @escaping (BodyReader?, Error?) -> Void)
+
+  /**
+   Creates a document.
+
+   - parameter document: JSON encoded document; an `_id` is generated when it has none
+   - parameter callback: called with the revision of the new document, or an error
+   */
+  func create(document: Data, callback: @escaping (String?, Error?) -> Void)
+
+  /**
+   Creates several documents with one request; each succeeds or fails on its own.
+
+   - parameter documents: JSON encoded documents
+   - parameter callback:  called with the outcome of each document in order, or the error that failed the request
+   */
+  func bulkCreate(documents: [Data], callback: @escaping ([BulkWriteResult]?, Error?) -> Void)
+
+  /// Reads the current update sequence, calling back with nil if it could not be read
+  func updateSequence(callback: @escaping (String?) -> Void)
+
+  /**
+   Long polls for changes made after a sequence.
+
+   - parameter since:       sequence to report changes after, or "now"
+   - parameter timeout:     how long to wait for a change, in milliseconds
+   - parameter includeDocs: whether changes carry the current document
+   - parameter callback:    called with the `_changes` response body, or an error
+   */
+  func changes(since: String, timeout: Int, includeDocs: Bool, callback: @escaping (Data?, Error?) -> Void)
+}
@@ -0,0 +1,139 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+import Kitura
+
+/**
+ Blob store held in process memory, for running the server without Object Storage.
+
+ Objects are served by the server itself under `/blobs/<container>/<object>`.
+ Like Object Storage, an empty object carrying an `X-Object-Manifest` header
+ reads as the concatenation of the objects named by the manifest prefix, so
+ segmented uploads come back whole.
+ */
+final class InMemoryBlobStore: BlobStore {
+
+  static let manifestHeader = "X-Object-Manifest"
+
+  private struct Object {
+    let data: Data
+    let metadata: [String: String]
+  }
+
+  private final class Container: BlobContainer {
+    let name: String
+    private unowned let store: InMemoryBlobStore
+
+    init(name: String, store: InMemoryBlobStore) {
+      self.name = name
+      self.store = store
+    }
+
+    func storeObject(name: String, data: Data, metadata: [String: String], completion: @escaping (Error?) -> Void) {
+      store.queue.sync(flags: .barrier) {
+        store.containers[self.name]?[name] = Object(data: data, metadata: metadata)
+      }
+      completion(nil)
+    }
+
+    func deleteObject(name: String, completion: @escaping (Error?) -> Void) {
+      store.queue.sync(flags: .barrier) {
+        _ = store.containers[self.name]?.removeValue(forKey: name)
+      }
+      completion(nil)
+    }
+  }
+
+  /// Reads run concurrently, writes as barriers
+  private let queue = DispatchQueue(label: "inMemoryBlobStoreQueue", attributes: .concurrent)
+  private var containers = [String: [String: Object]]()
+  private let baseURL: String
+
+  /// - parameter baseURL: URL of this server, which the object URLs handed to clients start with
+  init(baseURL: String) {
+    self.baseURL = baseURL.hasSuffix("/") ? String(baseURL.dropLast()) : baseURL
+  }
+
+  func createContainer(named name: String, completion: @escaping (BlobContainer?) -> Void) {
+    queue.sync(flags: .barrier) {
+      if containers[name] == nil {
+        containers[name] = [:]
+      }
+    }
+    completion(Container(name: name, store: self))
+  }
+
+  func retrieveContainer(named name: String, completion: @escaping (BlobContainer?, Error?) -> Void) {
+    let exists = queue.sync { containers[name] != nil }
+    if exists {
+      completion(Container(name: name, store: self), nil)
+    } else {
+      completion(nil, BlobStoreError.containerNotFound)
+    }
+  }
+
+  func url(forObject name: String, inContainer containerName: String) -> String {
+    return "\(baseURL)/blobs/\(InMemoryBlobStore.escape(containerName))/\(InMemoryBlobStore.escape(name))"
+  }
+
+  /// Contents of an object, with manifests resolved to their segments
+  func contents(ofObject name: String, inContainer containerName: String) -> Data? {
+    return queue.sync {
+      guard let object = containers[containerName]?[name] else {
+        return nil
+      }
+      guard let manifest = object.metadata[InMemoryBlobStore.manifestHeader],
+        let slash = manifest.index(of: "/") else {
+          return object.data
+      }
+
+      let segmentContainer = String(manifest[..<slash])
+      let prefix = String(manifest[manifest.index(after: slash)...])
+      let segments = (containers[segmentContainer] ?? [:]).filter { $0.key.hasPrefix(prefix) }
+      var data = Data()
+      for segment in segments.sorted(by: { $0.key < $1.key }) {
+        data.append(segment.value.data)
+      }
+      return data
+    }
+  }
+
+  private static func escape(_ value: String) -> String {
+    return value.addingPercentEncoding(withAllowedCharacters: .urlPathAllowed) ?? value
+  }
+}
+
+extension ServerController {
+
+  /// Route serving the objects of the in-memory blob store
+  func getBlob(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
+    guard let store = servedBlobStore,
+      let containerName = request.parameters["container"],
+      let objectName = request.parameters["object"],
+      let data = store.contents(ofObject: objectName, inContainer: containerName) else {
+        response.status(.notFound)
+        next()
+        return
+    }
+
+    response.headers["Content-Type"] = ContentType.sharedInstance.getContentType(forFileName: objectName)
+      ?? "application/octet-stream"
+    response.status(.OK).send(data: data)
+    next()
+  }
+}
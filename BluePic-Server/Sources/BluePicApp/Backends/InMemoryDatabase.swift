@@ -0,0 +1,508 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+import CouchDB
+
+/// Enum identifying why the in-memory database refused a request
+enum InMemoryDatabaseError: Error {
+  case invalidDocument
+  case conflict(String)
+  case unknownView(String)
+  case invalidQuery(String)
+}
+
+/**
+ Database held in process memory, for running the server without Cloudant.
+
+ The views of the main design document are kept materialized in collation
+ order and updated as documents are written, so a query is a binary search
+ followed by a copy of the rows already rendered to JSON. Responses and the
+ changes feed are rendered in CouchDB's wire format.
+ */
+public final class InMemoryDatabase: DatabaseBackend {
+
+  private struct Row {
+    let key: ViewKey
+    let id: String
+
+    /// Row rendered up to its closing brace, `{"id":..,"key":..,"value":..`
+    let fields: String
+
+    /// Document returned for the row with `include_docs`, the one named by an `_id` in the value if any
+    let docId: String?
+
+    /// Value summed by reducing views
+    let count: Int
+  }
+
+  private struct Document {
+    let rev: String
+    let json: String
+    let sequence: Int
+  }
+
+  private struct Waiter {
+    let since: Int
+    let includeDocs: Bool
+    let callback: (Data) -> Void
+  }
+
+  private static let allViews: [View] = [.images, .images_by_id, .images_by_tag, .images_per_user, .tags, .users,
+                                          .image_docs, .image_docs_by_tag, .images_by_content_hash]
+
+  /// Reads run concurrently, writes as barriers
+  private let queue = DispatchQueue(label: "inMemoryDatabaseQueue", attributes: .concurrent)
+
+  private var documents = [String: Document]()
+  private var views = [View: [Row]]()
+  private var sequence = 0
+  private var waiters = [Int: Waiter]()
+  private var nextWaiterId = 0
+
+  public init() {
+    for view in InMemoryDatabase.allViews {
+      views[view] = []
+    }
+  }
+
+  /// Current update sequence
+  public var currentSequence: Int {
+    return queue.sync { sequence }
+  }
+
+  /**
+   Loads documents from a JSON file, either a bare array of documents or an object
+   holding them under `docs` as accepted by `_bulk_docs`. Existing documents with
+   the same ids are replaced.
+   */
+  public func load(contentsOf url: URL) throws {
+    let json = try JSONSerialization.jsonObject(with: Data(contentsOf: url), options: [])
+    guard let docs = (json as? [String: Any])?["docs"] as? [[String: Any]] ?? json as? [[String: Any]] else {
+      throw InMemoryDatabaseError.invalidDocument
+    }
+
+    queue.sync(flags: .barrier) {
+      for doc in docs {
+        store(doc, id: doc["_id"] as? String ?? InMemoryDatabase.newId(), keepSorted: false)
+      }
+      for view in InMemoryDatabase.allViews {
+        views[view]?.sort(by: InMemoryDatabase.precedes)
+      }
+      notifyWaiters()
+    }
+  }
+
+  /**
+   Creates a document, or updates one when the `_rev` it carries is current.
+
+   - parameter data: JSON encoded document; an `_id` is generated when it has none
+
+   - returns: id and new revision of the document
+   */
+  public func createDocument(_ data: Data) throws -> (id: String, rev: String) {
+    guard let doc = try JSONSerialization.jsonObject(with: data, options: []) as? [String: Any] else {
+      throw InMemoryDatabaseError.invalidDocument
+    }
+    let id = doc["_id"] as? String ?? InMemoryDatabase.newId()
+
+    return try queue.sync(flags: .barrier) {
+      if let existing = documents[id], existing.rev != doc["_rev"] as? String {
+        throw InMemoryDatabaseError.conflict(id)
+      }
+      let rev = store(doc, id: id, keepSorted: true)
+      notifyWaiters()
+      return (id, rev)
+    }
+  }
+
+  /**
+   Creates several documents, as CouchDB's `_bulk_docs` does.
+
+   - parameter body: JSON object with the documents in `docs`
+
+   - returns: the response body, with the outcome of each document in order
+   */
+  public func bulkDocsResponse(_ body: Data) throws -> Data {
+    guard let object = try JSONSerialization.jsonObject(with: body, options: []) as? [String: Any],
+      let docs = object["docs"] as? [Any] else {
+        throw InMemoryDatabaseError.invalidDocument
+    }
+    return try JSONEncoder().encode(createDocuments(docs.map { $0 as? [String: Any] }))
+  }
+
+  /**
+   Queries a view of the main design document.
+
+   - parameter name:  name of the view
+   - parameter query: query parameters as sent to the CouchDB view API, with JSON encoded values
+
+   - returns: the response body, one row per line
+   */
+  public func viewResponse(named name: String, query: [String: String]) throws -> Data {
+    guard let view = View(rawValue: name) else {
+      throw InMemoryDatabaseError.unknownView(name)
+    }
+    return try queue.sync {
+      try self.query(view, parameters: query)
+    }
+  }
+
+  /**
+   Long polls for changes made after a sequence.
+
+   - parameter since:       sequence to report changes after, or "now"
+   - parameter timeout:     how long to wait for a change, in milliseconds
+   - parameter includeDocs: whether changes carry the current document
+   - parameter callback:    called on a global queue with the `_changes` response body
+   */
+  public func waitForChanges(since: String, timeout: Int, includeDocs: Bool, callback: @escaping (Data) -> Void) {
+    queue.async(flags: .barrier) {
+      let since = since == "now" ? self.sequence : Int(since) ?? 0
+      guard self.sequence <= since else {
+        let data = self.changesResponse(since: since, includeDocs: includeDocs)
+        DispatchQueue.global().async { callback(data) }
+        return
+      }
+
+      let waiterId = self.nextWaiterId
+      self.nextWaiterId += 1
+      self.waiters[waiterId] = Waiter(since: since, includeDocs: includeDocs, callback: callback)
+
+      self.queue.asyncAfter(deadline: .now() + .milliseconds(timeout), flags: .barrier) {
+        guard let waiter = self.waiters.removeValue(forKey: waiterId) else {
+          return
+        }
+        let data = self.changesResponse(since: waiter.since, includeDocs: waiter.includeDocs)
+        DispatchQueue.global().async { waiter.callback(data) }
+      }
+    }
+  }
+
+  // MARK: DatabaseBackend
+
+  func queryView(_ view: View, params: [Database.QueryParameters], callback: @escaping (BodyReader?, Error?) -> Void) {
+    var query = [String: String]()
+    for (name, value) in params.flatMap({ $0.queryItem }) {
+      query[name] = value
+    }
+
+    do {
+      let body = try queue.sync { try self.query(view, parameters: query) }
+      callback(DataBodyReader(body), nil)
+    } catch {
+      callback(nil, error)
+    }
+  }
+
+  func create(document: Data, callback: @escaping (String?, Error?) -> Void) {
+    do {
+      callback(try createDocument(document).rev, nil)
+    } catch {
+      callback(nil, error)
+    }
+  }
+
+  func bulkCreate(documents: [Data], callback: @escaping ([BulkWriteResult]?, Error?) -> Void) {
+    let docs = documents.map { (try? JSONSerialization.jsonObject(with: $0, options: [])) as? [String: Any] }
+    callback(createDocuments(docs), nil)
+  }
+
+  func updateSequence(callback: @escaping (String?) -> Void) {
+    callback(String(currentSequence))
+  }
+
+  func changes(since: String, timeout: Int, includeDocs: Bool, callback: @escaping (Data?, Error?) -> Void) {
+    waitForChanges(since: since, timeout: timeout, includeDocs: includeDocs) { data in
+      callback(data, nil)
+    }
+  }
+
+  // MARK: Writes, called as barriers on `queue`
+
+  private static func newId() -> String {
+    return UUID().uuidString.lowercased().replacingOccurrences(of: "-", with: "")
+  }
+
+  /// Creates documents in one write, reporting each one that is not a JSON object as invalid
+  private func createDocuments(_ docs: [[String: Any]?]) -> [BulkWriteResult] {
+    return queue.sync(flags: .barrier) {
+      let results = docs.map { doc -> BulkWriteResult in
+        guard let doc = doc else {
+          return BulkWriteResult(id: nil, rev: nil, error: "bad_request", reason: "Document must be a JSON object.")
+        }
+        let id = doc["_id"] as? String ?? InMemoryDatabase.newId()
+        if let existing = documents[id], existing.rev != doc["_rev"] as? String {
+          return BulkWriteResult(id: id, rev: nil, error: "conflict", reason: "Document update conflict.")
+        }
+        return BulkWriteResult(id: id, rev: store(doc, id: id, keepSorted: true), error: nil, reason: nil)
+      }
+      notifyWaiters()
+      return results
+    }
+  }
+
+  /// Stores a document and the rows it emits, returning its new revision
+  @discardableResult
+  private func store(_ doc: [String: Any], id: String, keepSorted: Bool) -> String {
+    let generation = documents[id].flatMap { Int(String($0.rev.prefix { $0 != "-" })) } ?? 0
+    let rev = "\(generation + 1)-\(InMemoryDatabase.newId())"
+
+    var doc = doc
+    doc["_id"] = id
+    doc["_rev"] = rev
+
+    if documents[id] != nil {
+      for view in InMemoryDatabase.allViews {
+        views[view] = views[view]?.filter { $0.id != id }
+      }
+    }
+
+    sequence += 1
+    documents[id] = Document(rev: rev, json: jsonFragment(doc), sequence: sequence)
+
+    for (view, row) in InMemoryDatabase.map(doc, id: id) {
+      if keepSorted, let rows = views[view] {
+        let index = InMemoryDatabase.partition(rows.count) { InMemoryDatabase.precedes(row, rows[$0]) }
+        views[view]?.insert(row, at: index)
+      } else {
+        views[view]?.append(row)
+      }
+    }
+    return rev
+  }
+
+  /// Answers the outstanding long polls
+  private func notifyWaiters() {
+    for waiter in waiters.values {
+      let data = changesResponse(since: waiter.since, includeDocs: waiter.includeDocs)
+      DispatchQueue.global().async { waiter.callback(data) }
+    }
+    waiters.removeAll()
+  }
+
+  /// The map functions of the main design document
+  private static func map(_ doc: [String: Any], id: String) -> [(View, Row)] {
+    var rows = [(View, Row)]()
+    let emit = { (view: View, key: ViewKey, value: Any) in
+      rows.append((view, InMemoryDatabase.row(key, id: id, value: value)))
+    }
+
+    switch doc["type"] as? String {
+    case .some("user"):
+      emit(.users, .string(id), doc)
+
+    case .some("image"):
+      let docId = ViewKey.string(id)
+      let uploadedTs = ViewKey(any: doc["uploadedTs"] ?? NSNull())
+      let userId = doc["userId"] ?? NSNull()
+      let user: [String: Any] = ["_id": userId]
+
+      emit(.images, .array([uploadedTs, docId, .number(0)]), id)
+      emit(.images, .array([uploadedTs, docId, .number(1)]), user)
+      emit(.images_by_id, .array([docId, .number(0)]), id)
+      emit(.images_by_id, .array([docId, .number(1)]), user)
+      emit(.images_per_user, .array([ViewKey(any: userId), uploadedTs]), doc)
+      emit(.image_docs, .array([uploadedTs, docId]), NSNull())
+      if let contentHash = doc["contentHash"] as? String {
+        emit(.images_by_content_hash, .array([.string(contentHash), uploadedTs]), NSNull())
+      }
+
+      for tag in doc["tags"] as? [[String: Any]] ?? [] {
+        let label = ViewKey(any: tag["label"] ?? NSNull())
+        emit(.tags, label, 1)
+        emit(.images_by_tag, .array([label, uploadedTs, docId, .number(0)]), id)
+        emit(.images_by_tag, .array([label, uploadedTs, docId, .number(1)]), user)
+        emit(.image_docs_by_tag, .array([label, uploadedTs, docId]), NSNull())
+      }
+
+    default:
+      break
+    }
+    return rows
+  }
+
+  private static func row(_ key: ViewKey, id: String, value: Any) -> Row {
+    let docId: String?
+    if let linked = value as? [String: Any] {
+      docId = linked["_id"] as? String
+    } else {
+      docId = id
+    }
+    return Row(key: key,
+               id: id,
+               fields: "{\"id\":" + jsonFragment(id) + ",\"key\":" + key.json + ",\"value\":" + jsonFragment(value),
+               docId: docId,
+               count: value as? Int ?? 0)
+  }
+
+  /// Collation order of view rows: by key, then by document id
+  private static func precedes(_ lhs: Row, _ rhs: Row) -> Bool {
+    return lhs.key != rhs.key ? lhs.key < rhs.key : lhs.id < rhs.id
+  }
+
+  /// First position in `0..<count` for which `isPast` holds, for a predicate that never turns back to false
+  private static func partition(_ count: Int, isPast: (Int) -> Bool) -> Int {
+    var low = 0
+    var high = count
+    while low < high {
+      let middle = low + (high - low) / 2
+      if isPast(middle) {
+        high = middle
+      } else {
+        low = middle + 1
+      }
+    }
+    return low
+  }
+
+  // MARK: Reads, called on `queue`
+
+  /// Evaluates a view query the way CouchDB does for the parameters the server sends
+  private func query(_ view: View, parameters: [String: String]) throws -> Data {
+    let rows = views[view] ?? []
+    let flag = { (name: String, defaultValue: Bool) -> Bool in
+      parameters[name].map { $0 == "true" } ?? defaultValue
+    }
+    let key = { (name: String) throws -> ViewKey? in
+      guard let json = parameters[name] else {
+        return nil
+      }
+      guard let key = ViewKey(json: json) else {
+        throw InMemoryDatabaseError.invalidQuery("Invalid \(name)")
+      }
+      return key
+    }
+
+    let descending = flag("descending", false)
+    let includeDocs = flag("include_docs", false)
+    let inclusiveEnd = flag("inclusive_end", true)
+    let limit = max(0, parameters["limit"].flatMap { Int($0) } ?? Int.max)
+    let skip = max(0, parameters["skip"].flatMap { Int($0) } ?? 0)
+    let startKey = try key("startkey")
+    let endKey = try key("endkey")
+    let startDocId = parameters["startkey_docid"].flatMap { ViewKey(json: $0) }
+
+    let reducing = view.isSummed && flag("reduce", true)
+
+    // Rows selected by the query, in the order of iteration, with skip and limit applied unless reducing
+    var selected = [Row]()
+    var offset = 0
+    if let keys = try key("keys") {
+      guard case .array(let wanted) = keys else {
+        throw InMemoryDatabaseError.invalidQuery("keys must be an array")
+      }
+      for wantedKey in wanted {
+        var index = InMemoryDatabase.partition(rows.count) { !(rows[$0].key < wantedKey) }
+        while index < rows.count && rows[index].key == wantedKey {
+          selected.append(rows[index])
+          index += 1
+        }
+      }
+      if !reducing {
+        selected = Array(selected.dropFirst(skip).prefix(limit))
+      }
+    } else {
+      let count = rows.count
+      let rowAt = { (position: Int) -> Row in
+        descending ? rows[count - 1 - position] : rows[position]
+      }
+
+      var first = 0
+      if let startKey = startKey {
+        first = InMemoryDatabase.partition(count) { position in
+          let row = rowAt(position)
+          if row.key == startKey, case .some(.string(let docId)) = startDocId {
+            return descending ? row.id <= docId : row.id >= docId
+          }
+          return descending ? !(startKey < row.key) : !(row.key < startKey)
+        }
+      }
+      var end = count
+      if let endKey = endKey {
+        end = InMemoryDatabase.partition(count) { position in
+          let row = rowAt(position)
+          if row.key == endKey {
+            return !inclusiveEnd
+          }
+          return descending ? row.key < endKey : endKey < row.key
+        }
+      }
+
+      if !reducing && first < end {
+        // Only the rows of the page are copied
+        first += min(skip, end - first)
+        end = limit >= end - first ? end : first + limit
+      }
+      selected = first < end ? (first..<end).map(rowAt) : []
+      offset = first
+    }
+
+    if reducing {
+      let groupLevel = parameters["group_level"].flatMap { Int($0) }
+      let group = flag("group", false) || groupLevel != nil
+      return reduce(selected, group: group, groupLevel: groupLevel, skip: skip, limit: limit)
+    }
+
+    var body = "{\"total_rows\":\(rows.count),\"offset\":\(offset),\"rows\":[\r\n"
+    body += selected.map { row -> String in
+      guard includeDocs else {
+        return row.fields + "}"
+      }
+      let doc = row.docId.flatMap { documents[$0]?.json } ?? "null"
+      return row.fields + ",\"doc\":" + doc + "}"
+    }.joined(separator: ",\r\n")
+    body += "\r\n]}\n"
+    return Data(body.utf8)
+  }
+
+  private func reduce(_ rows: [Row], group: Bool, groupLevel: Int?, skip: Int, limit: Int) -> Data {
+    var groups = [(key: ViewKey, sum: Int)]()
+    for row in rows {
+      let key = group ? row.key.grouped(level: groupLevel) : .null
+      if let last = groups.last, last.key == key {
+        groups[groups.count - 1].sum += row.count
+      } else {
+        groups.append((key, row.count))
+      }
+    }
+
+    let lines = groups.dropFirst(skip).prefix(limit).map { "{\"key\":\($0.key.json),\"value\":\($0.sum)}" }
+    return Data(("{\"rows\":[\r\n" + lines.joined(separator: ",\r\n") + "\r\n]}\n").utf8)
+  }
+
+  /// Body of a `_changes` response listing the latest change of every document written after `since`
+  private func changesResponse(since: Int, includeDocs: Bool) -> Data {
+    let changed = documents.filter { $0.value.sequence > since }.sorted { $0.value.sequence < $1.value.sequence }
+    let results = changed.map { change -> String in
+      let doc = change.value
+      var result = "{\"seq\":\(doc.sequence),\"id\":" + jsonFragment(change.key) + ",\"changes\":[{\"rev\":\"\(doc.rev)\"}]"
+      if includeDocs {
+        result += ",\"doc\":" + doc.json
+      }
+      return result + "}"
+    }
+    return Data(("{\"results\":[" + results.joined(separator: ",") + "],\"last_seq\":\(sequence)}").utf8)
+  }
+}
+
+private extension View {
+
+  var isSummed: Bool {
+    return self == .tags
+  }
+}
@@ -0,0 +1,184 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import CouchDB
+
+/**
+ Database that records the latency of each call to the one it wraps.
+
+ A view query is timed until its response starts, since the rows are read as
+ the client response is written. The long polled changes feed is not timed;
+ its duration is the poll timeout rather than the database's latency.
+ */
+final class InstrumentedDatabase: DatabaseBackend {
+
+  private static let views: [View] = [.images, .images_by_id, .images_by_tag, .images_per_user, .tags, .users,
+                                       .image_docs, .image_docs_by_tag, .images_by_content_hash]
+
+  private let backend: DatabaseBackend
+  private let viewMetrics: [View: OperationMetrics]
+  private let createMetrics: OperationMetrics
+  private let bulkCreateMetrics: OperationMetrics
+  private let updateSequenceMetrics: OperationMetrics
+
+  /// - parameter dependency: name the calls are recorded under
+  init(_ backend: DatabaseBackend, dependency: String, registry: MetricsRegistry) {
+    self.backend = backend
+    var viewMetrics = [View: OperationMetrics]()
+    for view in InstrumentedDatabase.views {
+      viewMetrics[view] = registry.dependency(dependency, operation: "view_" + view.rawValue)
+    }
+    self.viewMetrics = viewMetrics
+    createMetrics = registry.dependency(dependency, operation: "create")
+    bulkCreateMetrics = registry.dependency(dependency, operation: "bulk_create")
+    updateSequenceMetrics = registry.dependency(dependency, operation: "update_sequence")
+  }
+
+  func queryView(_ view: View, params: [Database.QueryParameters], callback: @escaping (BodyReader?, Error?) -> Void) {
+    guard let metrics = viewMetrics[view] else {
+      backend.queryView(view, params: params, callback: callback)
+      return
+    }
+    let started = metrics.start()
+    backend.queryView(view, params: params) { body, error in
+      metrics.finish(started)
+      callback(body, error)
+    }
+  }
+
+  func create(document: Data, callback: @escaping (String?, Error?) -> Void) {
+    let started = createMetrics.start()
+    backend.create(document: document) { revision, error in
+      self.createMetrics.finish(started)
+      callback(revision, error)
+    }
+  }
+
+  func bulkCreate(documents: [Data], callback: @escaping ([BulkWriteResult]?, Error?) -> Void) {
+    let started = bulkCreateMetrics.start()
+    backend.bulkCreate(documents: documents) { results, error in
+      self.bulkCreateMetrics.finish(started)
+      callback(results, error)
+    }
+  }
+
+  func updateSequence(callback: @escaping (String?) -> Void) {
+    let started = updateSequenceMetrics.start()
+    backend.updateSequence { sequence in
+      self.updateSequenceMetrics.finish(started)
+      callback(sequence)
+    }
+  }
+
+  func changes(since: String, timeout: Int, includeDocs: Bool, callback: @escaping (Data?, Error?) -> Void) {
+    backend.changes(since: since, timeout: timeout, includeDocs: includeDocs, callback: callback)
+  }
+}
+
+/// Blob store that records the latency of each call to the one it wraps and to its containers
+final class InstrumentedBlobStore: BlobStore {
+
+  private final class Container: BlobContainer {
+    private let container: BlobContainer
+    private let storeObjectMetrics: OperationMetrics
+    private let deleteObjectMetrics: OperationMetrics
+
+    init(_ container: BlobContainer, store: InstrumentedBlobStore) {
+      self.container = container
+      storeObjectMetrics = store.storeObjectMetrics
+      deleteObjectMetrics = store.deleteObjectMetrics
+    }
+
+    var name: String {
+      return container.name
+    }
+
+    func storeObject(name: String, data: Data, metadata: [String: String], completion: @escaping (Error?) -> Void) {
+      let metrics = storeObjectMetrics
+      let started = metrics.start()
+      container.storeObject(name: name, data: data, metadata: metadata) { error in
+        metrics.finish(started)
+        completion(error)
+      }
+    }
+
+    func deleteObject(name: String, completion: @escaping (Error?) -> Void) {
+      let metrics = deleteObjectMetrics
+      let started = metrics.start()
+      container.deleteObject(name: name) { error in
+        metrics.finish(started)
+        completion(error)
+      }
+    }
+  }
+
+  private let backend: BlobStore
+  private let createContainerMetrics: OperationMetrics
+  private let retrieveContainerMetrics: OperationMetrics
+  private let storeObjectMetrics: OperationMetrics
+  private let deleteObjectMetrics: OperationMetrics
+
+  /// - parameter dependency: name the calls are recorded under
+  init(_ backend: BlobStore, dependency: String, registry: MetricsRegistry) {
+    self.backend = backend
+    createContainerMetrics = registry.dependency(dependency, operation: "create_container")
+    retrieveContainerMetrics = registry.dependency(dependency, operation: "retrieve_container")
+    storeObjectMetrics = registry.dependency(dependency, operation: "store_object")
+    deleteObjectMetrics = registry.dependency(dependency, operation: "delete_object")
+  }
+
+  func createContainer(named name: String, completion: @escaping (BlobContainer?) -> Void) {
+    let started = createContainerMetrics.start()
+    backend.createContainer(named: name) { container in
+      self.createContainerMetrics.finish(started)
+      completion(container.map { Container($0, store: self) })
+    }
+  }
+
+  func retrieveContainer(named name: String, completion: @escaping (BlobContainer?, Error?) -> Void) {
+    let started = retrieveContainerMetrics.start()
+    backend.retrieveContainer(named: name) { container, error in
+      self.retrieveContainerMetrics.finish(started)
+      completion(container.map { Container($0, store: self) }, error)
+    }
+  }
+
+  func url(forObject name: String, inContainer containerName: String) -> String {
+    return backend.url(forObject: name, inContainer: containerName)
+  }
+}
+
+/// Notifier that records the latency of each notification sent through the one it wraps
+final class InstrumentedNotifier: Notifier {
+
+  private let notifier: Notifier
+  private let metrics: OperationMetrics
+
+  /// - parameter dependency: name the notifications are recorded under
+  init(_ notifier: Notifier, dependency: String, registry: MetricsRegistry) {
+    self.notifier = notifier
+    metrics = registry.dependency(dependency, operation: "send")
+  }
+
+  func send(_ message: PushMessage, completion: @escaping (Error?) -> Void) {
+    let started = metrics.start()
+    notifier.send(message) { error in
+      self.metrics.finish(started)
+      completion(error)
+    }
+  }
+}
@@ -0,0 +1,98 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+import LoggerAPI
+import BluemixPushNotifications
+import CloudEnvironment
+
+/// A push notification for a set of devices
+struct PushMessage {
+  let alert: String
+
+  /// Category of the notification, which selects the actions the client offers
+  let category: String?
+
+  /// Data handed to the client along with the alert
+  let payload: [String: Any]?
+
+  let deviceIds: [String]
+}
+
+/// Delivers push notifications to devices
+protocol Notifier: class {
+
+  /// Sends a notification, calling `completion` with nil once it was accepted for delivery
+  func send(_ message: PushMessage, completion: @escaping (Error?) -> Void)
+}
+
+/// Notifications delivered through IBM Cloud Push Notifications
+final class PushNotificationsNotifier: Notifier {
+
+  private let client: PushNotifications
+
+  init(credentials: PushSDKCredentials) {
+    client = PushNotifications(bluemixRegion: PushNotifications.Region.US_SOUTH,
+                               bluemixAppGuid: credentials.appGuid,
+                               bluemixAppSecret: credentials.appSecret)
+  }
+
+  func send(_ message: PushMessage, completion: @escaping (Error?) -> Void) {
+    let apnsSettings = Notification.Settings.Apns(
+      badge: nil,
+      interactiveCategory: message.category,
+      iosActionKey: nil,
+      sound: nil,
+      type: ApnsType.DEFAULT,
+      payload: message.payload
+    )
+
+    let target = Notification.Target(deviceIds: message.deviceIds, userIds: nil, platforms: nil, tagNames: nil)
+    let notificationMessage = Notification.Message(alert: message.alert, url: nil)
+    let notification = Notification(message: notificationMessage, target: target, apnsSettings: apnsSettings, gcmSettings: nil)
+
+    client.send(notification: notification) { error in
+      completion(error)
+    }
+  }
+}
+
+/// Keeps the most recent notifications in memory instead of delivering them, for running without Push Notifications
+final class InMemoryNotifier: Notifier {
+
+  /// Number of notifications remembered
+  static let capacity = 1000
+
+  private let queue = DispatchQueue(label: "inMemoryNotifierQueue")
+  private var messages = [PushMessage]()
+
+  /// Notifications sent, oldest first
+  var sentMessages: [PushMessage] {
+    return queue.sync { messages }
+  }
+
+  func send(_ message: PushMessage, completion: @escaping (Error?) -> Void) {
+    Log.info("Push notification for \(message.deviceIds.count) device(s): \(message.alert)")
+    queue.sync {
+      messages.append(message)
+      if messages.count > InMemoryNotifier.capacity {
+        messages.removeFirst(messages.count - InMemoryNotifier.capacity)
+      }
+    }
+    completion(nil)
+  }
+}
@@ -0,0 +1,125 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+
+/// A view key, ordered with CouchDB collation: null, booleans, numbers, strings, arrays, objects
+indirect enum ViewKey: Comparable {
+  case null
+  case bool(Bool)
+  case number(Double)
+  case string(String)
+  case array([ViewKey])
+  case object
+
+  /// Parses a key as sent in a query parameter, such as `["2016-05-05T13:25:43",{}]`
+  init?(json: String) {
+    guard let data = json.data(using: .utf8),
+      let value = try? JSONSerialization.jsonObject(with: data, options: .allowFragments) else {
+        return nil
+    }
+    self.init(any: value)
+  }
+
+  init(any value: Any) {
+    switch value {
+    case let string as String:
+      self = .string(string)
+    case let array as [Any]:
+      self = .array(array.map { ViewKey(any: $0) })
+    case is [String: Any]:
+      self = .object
+    case is NSNull:
+      self = .null
+    case let bool as Bool where type(of: value) == Bool.self:
+      self = .bool(bool)
+    case let int as Int:
+      self = .number(Double(int))
+    case let double as Double:
+      self = .number(double)
+    case let number as NSNumber:
+      self = .number(number.doubleValue)
+    default:
+      self = .null
+    }
+  }
+
+  /// JSON text of the key, as written in view rows
+  var json: String {
+    switch self {
+    case .null: return "null"
+    case .bool(let bool): return bool ? "true" : "false"
+    case .number(let number):
+      return number == number.rounded() && abs(number) < 1e15 ? String(Int(number)) : String(number)
+    case .string(let string): return jsonFragment(string)
+    case .array(let elements): return "[" + elements.map { $0.json }.joined(separator: ",") + "]"
+    case .object: return "{}"
+    }
+  }
+
+  /// Key truncated to its first `level` elements, for grouped reductions
+  func grouped(level: Int?) -> ViewKey {
+    guard let level = level, case .array(let elements) = self else {
+      return self
+    }
+    return .array(Array(elements.prefix(level)))
+  }
+
+  private var rank: Int {
+    switch self {
+    case .null: return 0
+    case .bool: return 1
+    case .number: return 2
+    case .string: return 3
+    case .array: return 4
+    case .object: return 5
+    }
+  }
+
+  static func < (lhs: ViewKey, rhs: ViewKey) -> Bool {
+    switch (lhs, rhs) {
+    case (.bool(let l), .bool(let r)): return !l && r
+    case (.number(let l), .number(let r)): return l < r
+    case (.string(let l), .string(let r)): return l < r
+    case (.array(let l), .array(let r)):
+      for (lElement, rElement) in zip(l, r) where lElement != rElement {
+        return lElement < rElement
+      }
+      return l.count < r.count
+    default: return lhs.rank < rhs.rank
+    }
+  }
+
+  static func == (lhs: ViewKey, rhs: ViewKey) -> Bool {
+    switch (lhs, rhs) {
+    case (.null, .null), (.object, .object): return true
+    case (.bool(let l), .bool(let r)): return l == r
+    case (.number(let l), .number(let r)): return l == r
+    case (.string(let l), .string(let r)): return l == r
+    case (.array(let l), .array(let r)): return l == r
+    default: return false
+    }
+  }
+}
+
+/// JSON text of a single value, which may be a string or number as well as a container
+func jsonFragment(_ value: Any) -> String {
+  guard let data = try? JSONSerialization.data(withJSONObject: [value], options: []),
+    let array = String(data: data, encoding: .utf8) else {
+      return "null"
+  }
+  return String(array.dropFirst().dropLast())
+}
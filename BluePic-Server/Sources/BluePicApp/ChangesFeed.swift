@@ -0,0 +1,261 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+import LoggerAPI
+
+/// Fields of a changed document that subscribers act on
+struct ChangedDocument: Decodable {
+  let type: String?
+  let tagLabels: [String]
+
+  private struct Label: Decodable {
+    let label: String
+  }
+
+  enum CodingKeys: String, CodingKey {
+    case type
+    case tags
+  }
+
+  init(from decoder: Decoder) throws {
+    let values = try decoder.container(keyedBy: CodingKeys.self)
+    type = try values.decodeIfPresent(String.self, forKey: .type)
+    tagLabels = (try? values.decode([Label].self, forKey: .tags))?.map { $0.label } ?? []
+  }
+}
+
+/// A single entry of the database `_changes` feed
+struct DatabaseChange: Decodable {
+  let id: String
+  let deleted: Bool
+
+  /// Current document, when the feed is followed with `include_docs`
+  let doc: ChangedDocument?
+
+  enum CodingKeys: String, CodingKey {
+    case id
+    case deleted
+    case doc
+  }
+
+  init(from decoder: Decoder) throws {
+    let values = try decoder.container(keyedBy: CodingKeys.self)
+    id = try values.decode(String.self, forKey: .id)
+    deleted = try values.decodeIfPresent(Bool.self, forKey: .deleted) ?? false
+    doc = try? values.decode(ChangedDocument.self, forKey: .doc)
+  }
+}
+
+/// Update sequence, an integer on CouchDB 1.x and an opaque string on CouchDB 2.x and Cloudant
+struct UpdateSequence: Decodable {
+  let value: String
+
+  init(from decoder: Decoder) throws {
+    let container = try decoder.singleValueContainer()
+    if let int = try? container.decode(Int.self) {
+      value = String(int)
+    } else {
+      value = try container.decode(String.self)
+    }
+  }
+}
+
+/**
+ Follows the `_changes` feed of a database with long polling and fans every
+ change out to its subscribers.
+
+ Following starts from the current update sequence, and only once that sequence
+ is known are subscribers reset, so state they rebuild from reads made after
+ the reset misses no later change. A failed poll leads to the same restart,
+ since changes made before it resumes will never be seen.
+ */
+final class ChangesFeed {
+
+  private struct ChangesResponse: Decodable {
+    let results: [DatabaseChange]
+    let lastSeq: UpdateSequence
+
+    enum CodingKeys: String, CodingKey {
+      case results
+      case lastSeq = "last_seq"
+    }
+  }
+
+  private let database: DatabaseBackend
+  private let timeout: Int
+  private let includeDocs: Bool
+  private let retryDelay: TimeInterval
+  private let pollQueue = DispatchQueue(label: "changesFeedPollQueue")
+  private let stateQueue = DispatchQueue(label: "changesFeedStateQueue")
+
+  private var running = false
+  private var sequence: String?
+
+  /// Bumped by every local write, so a poll that started before it cannot report a sequence without it
+  private var writeGeneration = 0
+  private var changeHandlers = [(DatabaseChange) -> Void]()
+  private var resetHandlers = [() -> Void]()
+
+  /**
+   - parameter database:    database to follow
+   - parameter timeout:     long poll timeout, in milliseconds
+   - parameter includeDocs: whether changes carry the current document
+   - parameter retryDelay:  delay before polling again after a failure, in seconds
+   */
+  init(database: DatabaseBackend, timeout: Int = 60000, includeDocs: Bool = false, retryDelay: TimeInterval = 5) {
+    self.database = database
+    self.timeout = timeout
+    self.includeDocs = includeDocs
+    self.retryDelay = retryDelay
+  }
+
+  /**
+   Registers callbacks for changes and for resets of the feed.
+
+   - parameter onChange: called for every change, on the feed's queue
+   - parameter onReset:  called on the feed's queue once the sequence changes are followed from is
+                         known, when following starts and after changes may have been missed
+   */
+  func subscribe(onChange: @escaping (DatabaseChange) -> Void, onReset: @escaping () -> Void) {
+    stateQueue.sync {
+      changeHandlers.append(onChange)
+      resetHandlers.append(onReset)
+    }
+  }
+
+  /// Starts following the feed from its current sequence
+  func start() {
+    let alreadyRunning: Bool = stateQueue.sync {
+      defer { running = true }
+      return running
+    }
+    guard !alreadyRunning else {
+      return
+    }
+    pollQueue.async { self.resume() }
+  }
+
+  /// Stops following the feed once the outstanding poll returns
+  func stop() {
+    stateQueue.sync { running = false }
+  }
+
+  private var isRunning: Bool {
+    return stateQueue.sync { running }
+  }
+
+  /**
+   Sequence of the database as of the last change delivered to subscribers, or nil
+   while the feed is catching up after a failure or a write made by this server.
+   */
+  var currentSequence: String? {
+    return stateQueue.sync { sequence }
+  }
+
+  /**
+   Forgets the current sequence until the feed next catches up, for use after a write.
+   Writes made by other clients, such as the processing sequence, are only reflected
+   once the feed delivers them.
+   */
+  func markStale() {
+    stateQueue.sync {
+      writeGeneration += 1
+      sequence = nil
+    }
+  }
+
+  private var currentWriteGeneration: Int {
+    return stateQueue.sync { writeGeneration }
+  }
+
+  /// Records a sequence read while `generation` was current, unless a local write happened since
+  private func store(sequence: String?, readAt generation: Int) {
+    stateQueue.sync {
+      self.sequence = generation == writeGeneration ? sequence : nil
+    }
+  }
+
+  /**
+   Follows the feed from the current update sequence, which `since=now` would only learn
+   on the first change. Subscribers are reset once the sequence is known; until then the
+   lookup is retried. Must be called on `pollQueue`.
+   */
+  private func resume() {
+    guard isRunning else {
+      return
+    }
+
+    let generation = currentWriteGeneration
+    database.updateSequence { sequence in
+      self.pollQueue.async {
+        guard let sequence = sequence else {
+          Log.error("Failed to read the database update sequence; retrying.")
+          self.pollQueue.asyncAfter(deadline: .now() + self.retryDelay) {
+            self.resume()
+          }
+          return
+        }
+
+        self.stateQueue.sync { self.resetHandlers }.forEach { $0() }
+        self.store(sequence: sequence, readAt: generation)
+        self.poll(since: sequence)
+      }
+    }
+  }
+
+  private func poll(since: String) {
+    guard isRunning else {
+      return
+    }
+
+    let generation = currentWriteGeneration
+    database.changes(since: since, timeout: timeout, includeDocs: includeDocs) { data, error in
+      self.pollQueue.async { self.handleChanges(data, error: error, generation: generation) }
+    }
+  }
+
+  /// Must be called on `pollQueue`
+  private func handleChanges(_ data: Data?, error: Error?, generation: Int) {
+    var lastSeq: String?
+    do {
+      guard let data = data, error == nil else {
+        throw error ?? BluePicLocalizedError.readDocumentFailed
+      }
+      let changes = try JSONDecoder().decode(ChangesResponse.self, from: data)
+
+      let handlers = stateQueue.sync { changeHandlers }
+      for change in changes.results {
+        handlers.forEach { $0(change) }
+      }
+      lastSeq = changes.lastSeq.value
+    } catch {
+      Log.error("Failed to read changes feed: \(error)")
+    }
+
+    if let lastSeq = lastSeq {
+      store(sequence: lastSeq, readAt: generation)
+      pollQueue.async { self.poll(since: lastSeq) }
+    } else {
+      // Subscribers are reset once resuming has a sequence to follow from
+      stateQueue.sync { self.sequence = nil }
+      pollQueue.asyncAfter(deadline: .now() + retryDelay) {
+        self.resume()
+      }
+    }
+  }
+}
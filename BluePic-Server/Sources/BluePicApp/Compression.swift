@@ -0,0 +1,343 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+import Kitura
+import LoggerAPI
+import CZlib
+
+/// Content codings the server can apply to a response
+enum ContentEncoding: String {
+  case gzip
+  case deflate
+
+  /// zlib window bits selecting the gzip or zlib wrapper
+  fileprivate var windowBits: Int32 {
+    switch self {
+    case .gzip: return MAX_WBITS + 16
+    case .deflate: return MAX_WBITS
+    }
+  }
+
+  /// The preferred coding acceptable to the client, gzip winning ties
+  static func negotiate(_ acceptEncoding: String?) -> ContentEncoding? {
+    guard let acceptEncoding = acceptEncoding else {
+      return nil
+    }
+
+    var qualities = [String: Double]()
+    for entry in acceptEncoding.split(separator: ",") {
+      let parts = entry.split(separator: ";").map { String($0).trimmingCharacters(in: .whitespaces).lowercased() }
+      guard let coding = parts.first, !coding.isEmpty else {
+        continue
+      }
+      let quality = parts.dropFirst().first(where: { $0.hasPrefix("q=") }).flatMap { Double(String($0.dropFirst(2))) } ?? 1
+      qualities[coding] = quality
+    }
+
+    let wildcard = qualities["*"] ?? 0
+    let candidates = [ContentEncoding.gzip, .deflate].map { ($0, qualities[$0.rawValue] ?? wildcard) }
+    guard let best = candidates.max(by: { $0.1 < $1.1 }), best.1 > 0 else {
+      return nil
+    }
+    return best.0
+  }
+}
+
+/**
+ Pool of zlib deflate streams, so compressing a response reuses the state
+ (and its several hundred kilobytes of buffers) of an earlier one instead of
+ allocating it afresh.
+ */
+final class DeflaterPool {
+
+  private let level: Int32
+  private let capacity: Int
+  private let queue = DispatchQueue(label: "deflaterPoolQueue")
+  private var idle = [ContentEncoding: [UnsafeMutablePointer<z_stream>]]()
+
+  /**
+   - parameter level:    zlib compression level, 1 (fastest) to 9 (smallest)
+   - parameter capacity: number of idle streams kept per encoding
+   */
+  init(level: Int, capacity: Int = 16) {
+    self.level = Int32(min(9, max(1, level)))
+    self.capacity = capacity
+  }
+
+  deinit {
+    for streams in idle.values {
+      streams.forEach(DeflaterPool.destroy)
+    }
+  }
+
+  /// Compresses `data` in one pass, or returns nil if zlib fails
+  func compress(_ data: Data, encoding: ContentEncoding) -> Data? {
+    guard let stream = checkOut(encoding) else {
+      return nil
+    }
+
+    var input = data
+    var output = Data(count: Int(deflateBound(stream, uLong(data.count))))
+    let outputCapacity = output.count
+
+    let status: Int32 = input.withUnsafeMutableBytes { (inputBytes: UnsafeMutablePointer<Bytef>) in
+      output.withUnsafeMutableBytes { (outputBytes: UnsafeMutablePointer<Bytef>) in
+        stream.pointee.next_in = inputBytes
+        stream.pointee.avail_in = uInt(data.count)
+        stream.pointee.next_out = outputBytes
+        stream.pointee.avail_out = uInt(outputCapacity)
+        return deflate(stream, Z_FINISH)
+      }
+    }
+    output.count = Int(stream.pointee.total_out)
+    checkIn(stream, encoding: encoding)
+
+    guard status == Z_STREAM_END else {
+      Log.error("Failed to compress response, zlib status \(status).")
+      return nil
+    }
+    return output
+  }
+
+  private func checkOut(_ encoding: ContentEncoding) -> UnsafeMutablePointer<z_stream>? {
+    if let stream = queue.sync(execute: { idle[encoding]?.popLast() }) {
+      return stream
+    }
+
+    let stream = UnsafeMutablePointer<z_stream>.allocate(capacity: 1)
+    stream.initialize(to: z_stream())
+    let status = deflateInit2_(stream, level, Z_DEFLATED, encoding.windowBits, 8, Z_DEFAULT_STRATEGY,
+                               ZLIB_VERSION, Int32(MemoryLayout<z_stream>.size))
+    guard status == Z_OK else {
+      Log.error("Failed to initialize zlib, status \(status).")
+      stream.deinitialize(count: 1)
+      stream.deallocate(capacity: 1)
+      return nil
+    }
+    return stream
+  }
+
+  private func checkIn(_ stream: UnsafeMutablePointer<z_stream>, encoding: ContentEncoding) {
+    guard deflateReset(stream) == Z_OK else {
+      DeflaterPool.destroy(stream)
+      return
+    }
+
+    let pooled: Bool = queue.sync {
+      guard idle[encoding, default: []].count < capacity else {
+        return false
+      }
+      idle[encoding, default: []].append(stream)
+      return true
+    }
+    if !pooled {
+      DeflaterPool.destroy(stream)
+    }
+  }
+
+  private static func destroy(_ stream: UnsafeMutablePointer<z_stream>) {
+    deflateEnd(stream)
+    stream.deinitialize(count: 1)
+    stream.deallocate(capacity: 1)
+  }
+}
+
+/**
+ Compresses JSON responses above a size threshold with the coding negotiated
+ from `Accept-Encoding`.
+
+ The body is replaced as it is written out, after every handler has run.
+ Entity tags get the coding appended, since the compressed body is a
+ different representation from the plain one.
+ */
+final class ResponseCompressionMiddleware: RouterMiddleware {
+
+  private let threshold: Int
+  private let pool: DeflaterPool
+
+  /**
+   - parameter threshold: smallest body compressed, in bytes
+   - parameter level:     zlib compression level, 1 (fastest) to 9 (smallest)
+   */
+  init(threshold: Int, level: Int) {
+    self.threshold = threshold
+    self.pool = DeflaterPool(level: level)
+  }
+
+  func handle(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
+    let encoding = ContentEncoding.negotiate(request.headers["Accept-Encoding"])
+    let threshold = self.threshold
+    let pool = self.pool
+
+    var previousFilter: WrittenDataFilter = { $0 }
+    previousFilter = response.setWrittenDataFilter { data in
+      let body = previousFilter(data)
+      guard response.headers["Content-Encoding"] == nil,
+        let contentType = response.headers["Content-Type"], contentType.contains("json") else {
+          return body
+      }
+      response.headers.append("Vary", value: "Accept-Encoding")
+
+      guard let encoding = encoding, body.count >= threshold,
+        let compressed = pool.compress(body, encoding: encoding), compressed.count < body.count else {
+          return body
+      }
+
+      response.headers["Content-Encoding"] = encoding.rawValue
+      if let etag = response.headers["ETag"] {
+        response.headers["ETag"] = ResponseCompressionMiddleware.etag(etag, encodedWith: encoding)
+      }
+      return compressed
+    }
+    next()
+  }
+
+  /// Entity tag of the representation of `etag` compressed with `encoding`
+  static func etag(_ etag: String, encodedWith encoding: ContentEncoding) -> String {
+    guard etag.hasSuffix("\"") else {
+      return etag
+    }
+    return String(etag.dropLast()) + "-" + encoding.rawValue + "\""
+  }
+
+  /// Entity tag of the uncompressed representation a possibly compressed tag belongs to
+  static func identityETag(_ etag: String) -> String {
+    for encoding in [ContentEncoding.gzip, .deflate] {
+      let suffix = "-" + encoding.rawValue + "\""
+      if etag.hasSuffix(suffix) {
+        return String(etag.dropLast(suffix.count)) + "\""
+      }
+    }
+    return etag
+  }
+}
+
+/**
+ Serves gzip files stored next to the static web assets, `app.js.gz` for
+ `app.js`, to clients that accept gzip. The files are produced ahead of time
+ by `Cloud-Scripts/compress_web_assets.sh`; one older than its asset is
+ ignored, so an asset edited without recompressing is served plain. Only
+ paths under the entries the asset directory held at startup are looked up,
+ so API requests pass through without touching the file system.
+ */
+final class PrecompressedFileServer: RouterMiddleware {
+
+  private let path: String
+  private let maxAge: Int
+
+  /// Names of the files and directories at the top of the asset directory
+  private let topLevelEntries: Set<String>
+
+  /**
+   - parameter path:   directory holding the assets
+   - parameter maxAge: value of the Cache-Control max-age directive for assets other than HTML, in seconds
+   */
+  init(path: String, maxAge: Int) {
+    self.path = path.hasSuffix("/") ? String(path.dropLast()) : path
+    self.maxAge = maxAge
+    topLevelEntries = Set((try? FileManager.default.contentsOfDirectory(atPath: self.path)) ?? [])
+  }
+
+  func handle(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
+    guard request.method == .get,
+      ContentEncoding.negotiate(request.headers["Accept-Encoding"]) == .gzip,
+      var urlPath = request.parsedURL.path?.removingPercentEncoding,
+      !urlPath.components(separatedBy: "/").contains("..") else {
+        next()
+        return
+    }
+
+    let segments = urlPath.split(separator: "/", omittingEmptySubsequences: true)
+    if let first = segments.first, !topLevelEntries.contains(String(first)) {
+      next()
+      return
+    }
+
+    if urlPath.hasSuffix("/") {
+      urlPath += "index.html"
+    }
+    let filePath = path + urlPath
+    let compressedPath = filePath + ".gz"
+
+    guard let modified = freshModificationDate(of: compressedPath, comparedTo: filePath),
+      let data = FileManager.default.contents(atPath: compressedPath) else {
+        next()
+        return
+    }
+
+    // Lets clients revalidate, which they always do for HTML
+    let lastModified = PrecompressedFileServer.httpDateFormatter.string(from: modified)
+    response.headers["Last-Modified"] = lastModified
+    response.headers["Cache-Control"] = PrecompressedFileServer.cacheControl(forFile: filePath, maxAge: maxAge)
+    response.headers.append("Vary", value: "Accept-Encoding")
+    if request.headers["If-Modified-Since"] == lastModified {
+      try response.status(.notModified).end()
+      return
+    }
+
+    response.headers["Content-Type"] = ContentType.sharedInstance.getContentType(forFileName: filePath)
+    response.headers["Content-Encoding"] = ContentEncoding.gzip.rawValue
+    response.status(.OK).send(data: data)
+    try response.end()
+  }
+
+  /// Modification date of the compressed file, if it exists and is at least as recent as the original
+  private func freshModificationDate(of compressedPath: String, comparedTo filePath: String) -> Date? {
+    let fileManager = FileManager.default
+    guard let original = try? fileManager.attributesOfItem(atPath: filePath),
+      let compressed = try? fileManager.attributesOfItem(atPath: compressedPath),
+      let originalDate = original[.modificationDate] as? Date,
+      let compressedDate = compressed[.modificationDate] as? Date else {
+        return nil
+    }
+    return compressedDate >= originalDate ? compressedDate : nil
+  }
+
+  /// IMF-fixdate, the format of HTTP date headers
+  private static let httpDateFormatter: DateFormatter = {
+    let formatter = DateFormatter()
+    formatter.locale = Locale(identifier: "en_US_POSIX")
+    formatter.timeZone = TimeZone(identifier: "GMT")
+    formatter.dateFormat = "EEE, dd MMM yyyy HH:mm:ss 'GMT'"
+    return formatter
+  }()
+
+  /// HTML pages are not fingerprinted, so clients revalidate them rather than keep a stale shell
+  static func cacheControl(forFile filePath: String, maxAge: Int) -> String {
+    return filePath.hasSuffix(".html") ? "no-cache" : "public, max-age=\(maxAge)"
+  }
+}
+
+/**
+ Replaces the max-age the static file server gives every file with `no-cache`
+ for HTML pages, as `PrecompressedFileServer` does for its own responses.
+ */
+final class HTMLRevalidationMiddleware: RouterMiddleware {
+
+  func handle(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
+    var previousOnEnd: LifecycleHandler = {}
+    previousOnEnd = response.setOnEndInvoked {
+      if response.headers["Cache-Control"] != nil,
+        response.headers["Content-Type"]?.hasPrefix("text/html") == true {
+        response.headers["Cache-Control"] = "no-cache"
+      }
+      previousOnEnd()
+    }
+    next()
+  }
+}
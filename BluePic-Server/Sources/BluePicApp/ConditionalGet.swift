@@ -0,0 +1,94 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Kitura
+
+/**
+ Answers conditional GET requests from the database update sequence.
+
+ Every response of the routes this guards is derived from the database, so
+ while the sequence is unchanged so is the response at a given URL. The
+ ETag is a digest of the sequence; a request whose `If-None-Match` carries
+ it gets a 304 before any handler, and so any database query, runs. When the
+ sequence is not known the request passes through without an ETag. The server's
+ own writes withhold the sequence until the feed has delivered them; writes by
+ other clients, such as the processing sequence, are only reflected once the
+ feed delivers them, normally within one long poll round trip.
+ */
+final class ConditionalGetMiddleware: RouterMiddleware {
+
+  private let currentSequence: () -> String?
+
+  /// - parameter currentSequence: the database update sequence, or nil when it may be stale
+  init(currentSequence: @escaping () -> String?) {
+    self.currentSequence = currentSequence
+  }
+
+  func handle(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
+    guard let sequence = currentSequence() else {
+      next()
+      return
+    }
+
+    let etag = ConditionalGetMiddleware.etag(forSequence: sequence)
+    response.headers["ETag"] = etag
+
+    // Echo the tag the client holds, which names the compressed representation if it got one
+    if let ifNoneMatch = request.headers["If-None-Match"],
+      let matched = ConditionalGetMiddleware.match(ifNoneMatch, etag: etag) {
+      response.headers["ETag"] = matched
+      try response.status(.notModified).end()
+      return
+    }
+
+    // Only successful responses are tied to the sequence
+    var previousOnEnd: LifecycleHandler = {}
+    previousOnEnd = response.setOnEndInvoked {
+      if response.statusCode != .OK {
+        response.headers["ETag"] = nil
+      }
+      previousOnEnd()
+    }
+    next()
+  }
+
+  /// Strong entity tag for a database update sequence
+  static func etag(forSequence sequence: String) -> String {
+    // 64-bit FNV-1a, since CouchDB 2.x sequences run to hundreds of characters
+    var hash: UInt64 = 0xcbf29ce484222325
+    for byte in sequence.utf8 {
+      hash ^= UInt64(byte)
+      hash = hash &* 0x100000001b3
+    }
+    return "\"" + String(hash, radix: 16) + "\""
+  }
+
+  /// The tag of an If-None-Match header that matches the entity tag, using weak comparison
+  static func match(_ ifNoneMatch: String, etag: String) -> String? {
+    for candidate in ifNoneMatch.split(separator: ",") {
+      let candidate = String(candidate).trimmingCharacters(in: .whitespaces)
+      if candidate == "*" {
+        return etag
+      }
+      let opaqueTag = candidate.hasPrefix("W/") ? String(candidate.dropFirst(2)) : candidate
+      if ResponseCompressionMiddleware.identityETag(opaqueTag) == etag {
+        return opaqueTag
+      }
+    }
+    return nil
+  }
+}
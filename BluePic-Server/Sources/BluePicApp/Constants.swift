@@ -31,10 +31,13 @@ enum BluePicError: Error {
 
 /// Enum identifying Cloudant Views
 enum View: String {
-  case images           = "images"
-  case images_by_id     = "images_by_id"
-  case images_by_tag    = "images_by_tags"
-  case images_per_user  = "images_per_user"
-  case tags             = "tags"
-  case users            = "users"
+  case images                 = "images"
+  case images_by_id           = "images_by_id"
+  case images_by_tag          = "images_by_tags"
+  case images_per_user        = "images_per_user"
+  case tags                   = "tags"
+  case users                  = "users"
+  case image_docs             = "image_docs"
+  case image_docs_by_tag      = "image_docs_by_tags"
+  case images_by_content_hash = "images_by_content_hash"
 }
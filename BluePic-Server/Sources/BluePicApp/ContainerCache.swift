@@ -0,0 +1,82 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+
+/**
+ Cache of per-user blob store containers that are known to exist and to be
+ configured for public access.
+
+ Lookups the blob store answered with "not found" are remembered for a short
+ while too, so a burst of uploads for a user without a container fails fast.
+ Lookups that failed for any other reason, such as an outage, are not. Entries are
+ dropped whenever an operation on the container fails, and the next request
+ goes back to the blob store.
+ */
+final class ContainerCache {
+
+  enum Lookup {
+    case found(BlobContainer)
+    case missing
+    case unknown
+  }
+
+  private enum Entry {
+    case found(BlobContainer)
+    case missing(until: Date)
+  }
+
+  private let cache: LRUCache<String, Entry>
+  private let negativeTTL: TimeInterval
+
+  /**
+   - parameter capacity:    number of containers to remember; 0 disables the cache
+   - parameter negativeTTL: how long a container that was not found is remembered, in seconds
+   */
+  init(capacity: Int, negativeTTL: TimeInterval) {
+    cache = LRUCache(capacity: capacity)
+    self.negativeTTL = negativeTTL
+  }
+
+  var stats: CacheStats {
+    return cache.stats
+  }
+
+  func lookup(_ name: String) -> Lookup {
+    switch cache.value(forKey: name) {
+    case .some(.found(let container)):
+      return .found(container)
+    case .some(.missing(let until)) where until > Date():
+      return .missing
+    default:
+      return .unknown
+    }
+  }
+
+  /// Remembers a container that exists and has been configured
+  func store(_ container: BlobContainer, named name: String) {
+    cache.setValue(.found(container), forKey: name)
+  }
+
+  /// Remembers that the blob store has no container of that name
+  func storeMissing(_ name: String) {
+    cache.setValue(.missing(until: Date().addingTimeInterval(negativeTTL)), forKey: name)
+  }
+
+  func invalidate(_ name: String) {
+    cache.removeValue(forKey: name)
+  }
+}
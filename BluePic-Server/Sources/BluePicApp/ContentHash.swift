@@ -0,0 +1,90 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import CouchDB
+import Cryptor
+import LoggerAPI
+
+/**
+ SHA-256 of an image binary, fed the binary in as many pieces as it arrives in,
+ so a streamed upload is hashed one segment at a time.
+ */
+final class ContentHasher {
+
+  private let digest = Digest(using: .sha256)
+
+  /// Adds the next piece of the binary
+  func update(_ data: Data) {
+    _ = digest.update(data: data)
+  }
+
+  /// Hex encoded hash of every piece added; nothing may be added afterwards
+  func finalize() -> String {
+    return CryptoUtils.hexString(from: digest.final())
+  }
+
+  /// Hex encoded hash of a binary held in memory
+  static func hash(_ data: Data) -> String {
+    let hasher = ContentHasher()
+    hasher.update(data)
+    return hasher.finalize()
+  }
+}
+
+extension ServerController {
+
+  /**
+   Finds the most recent image whose binary has the given hash, so an upload of the
+   same photo can reuse its stored binary and tags. Calls back with nil when there is
+   none, when deduplication is off, or when the lookup fails.
+
+   - parameter contentHash: Hex encoded SHA-256 of the uploaded binary
+   - parameter callback: Callback receiving the matching image, without its user
+   */
+  func findImage(withContentHash contentHash: String, callback: @escaping (Image?) -> Void) {
+    guard settings.uploadDeduplicationEnabled, !contentHash.isEmpty else {
+      callback(nil)
+      return
+    }
+
+    queryView(View.images_by_content_hash, params: ServerController.contentHashQuery(contentHash),
+              type: UnjoinedImage.self, database: database) { result, error in
+      if let error = error {
+        Log.warning("Could not look up images by content hash: \(error)")
+      }
+      // Never reuse the binary and tags of an image that merely sorts next to the hash
+      callback(result?.items.first.flatMap { $0.image.contentHash == contentHash ? $0.image : nil })
+    }
+  }
+
+  /**
+   Query for the most recent row of the content hash view under one hash. Both ends
+   of the range are two element keys: a one element key is sent as a bare string,
+   which collates before every array key and so would let the range run on into
+   the keys of lower hashes.
+   */
+  static func contentHashQuery(_ contentHash: String) -> [Database.QueryParameters] {
+    let anyHash = contentHash as Database.KeyType
+    return [
+      .includeDocs(true),
+      .descending(true),
+      .limit(1),
+      .startKey([anyHash, NSObject()]),
+      .endKey([anyHash, "" as Database.KeyType])
+    ]
+  }
+}
@@ -0,0 +1,216 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+import Kitura
+import LoggerAPI
+import KituraContracts
+
+/**
+ Rejects requests whose body is larger than a limit, or whose size is not declared,
+ before a Codable route decodes the body. Kitura has read the body by then, but the
+ decoded images, each holding its binary, are never built.
+ */
+final class BodySizeLimitMiddleware: RouterMiddleware {
+
+  private let maxSize: Int
+
+  /// - parameter maxSize: largest body accepted, in bytes
+  init(maxSize: Int) {
+    self.maxSize = maxSize
+  }
+
+  func handle(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
+    guard let length = request.headers["Content-Length"].flatMap({ Int($0) }) else {
+      try response.status(.lengthRequired).end()
+      return
+    }
+    guard length <= maxSize else {
+      try response.status(.requestTooLong).end()
+      return
+    }
+    next()
+  }
+}
+
+extension ServerController {
+
+  /**
+   Route for storing many images in one request, such as when importing an archive.
+
+   The binaries are stored with at most `batchUploadConcurrency` uploads running at
+   once, the documents of the images stored are written with a single bulk request,
+   and the images created are queued for processing together. Each image succeeds or
+   fails on its own; the response reports every outcome in request order, and the
+   binary of an image whose document could not be written is deleted again. Bodies over
+   `maxBatchUploadSize` bytes are turned away before they are decoded.
+   */
+  func postImages(images: [Image], respondWith: @escaping ([ImageBatchResult]?, RequestError?) -> Void) {
+    let started = Date()
+    guard !images.isEmpty, images.count <= settings.maxBatchSize else {
+      Log.error("Image batches must hold between 1 and \(settings.maxBatchSize) images, not \(images.count).")
+      respondWith(nil, .badRequest)
+      return
+    }
+
+    storeImages(images) { storeErrors in
+      var results = [ImageBatchResult?](repeating: nil, count: images.count)
+      var documents = [Data]()
+      var prepared = [(index: Int, image: Image)]()
+
+      for (index, image) in images.enumerated() {
+        if let error = storeErrors[index] {
+          results[index] = ImageBatchResult(index: index, success: false, image: nil, error: error)
+          continue
+        }
+
+        var image = image
+        image.url = self.generateUrl(forContainer: image.userId, forImage: image.fileName)
+        image.image = nil
+        do {
+          documents.append(try self.encoder.encode(image))
+          prepared.append((index, image))
+        } catch {
+          Log.error("\(error)")
+          results[index] = ImageBatchResult(index: index, success: false, image: nil, error: "Image could not be encoded")
+        }
+      }
+
+      let respond = {
+        respondWith(results.enumerated().map { entry in
+          entry.element ?? ImageBatchResult(index: entry.offset, success: false, image: nil, error: "Image was not stored")
+        }, nil)
+      }
+
+      guard !documents.isEmpty else {
+        respond()
+        return
+      }
+
+      self.database.bulkCreate(documents: documents) { writes, error in
+        guard let writes = writes, writes.count == prepared.count, error == nil else {
+          Log.error("Failed to write a batch of \(documents.count) image documents: \(error.map { "\($0)" } ?? "")")
+          self.discardBinaries(of: prepared.map { $0.image })
+          respond()
+          return
+        }
+
+        // Conditional GETs must not be answered from before this write
+        self.changesFeed.markStale()
+
+        var created = [String]()
+        var createdDocuments = [Data?]()
+        var unwritten = [Image]()
+        for (entry, write) in zip(prepared, writes) {
+          guard let revision = write.rev, write.error == nil else {
+            let reason = write.reason ?? write.error ?? "Image document could not be written"
+            results[entry.index] = ImageBatchResult(index: entry.index, success: false, image: nil, error: reason)
+            unwritten.append(entry.image)
+            continue
+          }
+
+          var image = entry.image
+          image.rev = revision
+          results[entry.index] = ImageBatchResult(index: entry.index, success: true, image: image, error: nil)
+          created.append(image.id)
+          createdDocuments.append(self.processingDocument(for: image))
+
+          let traceId = self.traces.startTrace(imageId: image.id)
+          self.traces.record("postImages", traceId: traceId, start: started)
+        }
+
+        self.discardBinaries(of: unwritten)
+        self.processImages(withIds: created, documents: createdDocuments)
+        respond()
+      }
+    }
+  }
+
+  /// Deletes the stored binaries of images whose documents could not be written, so no image points at them
+  private func discardBinaries(of images: [Image]) {
+    for image in images {
+      // Blob store calls block, so they stay off the thread answering the request
+      DispatchQueue.global().async {
+        self.retrieveContainer(named: image.userId) { container in
+          container?.deleteObject(name: image.fileName) { error in
+            if let error = error {
+              Log.warning("Could not delete the binary of unwritten image '\(image.fileName)': \(error)")
+            }
+          }
+        }
+      }
+    }
+  }
+
+  /**
+   Stores the binaries of a batch of images with a bounded number of uploads at once.
+
+   - parameter images:     images carrying their binaries
+   - parameter completion: called with the error of each image in order, nil for those stored
+   */
+  private func storeImages(_ images: [Image], completion: @escaping ([String?]) -> Void) {
+    let queue = DispatchQueue(label: "imageBatchQueue")
+    var errors = [String?](repeating: nil, count: images.count)
+    var started = 0
+    var finished = 0
+
+    // Must be called on `queue`
+    func storeNext() {
+      guard started < images.count else {
+        return
+      }
+      let index = started
+      started += 1
+
+      let finish = { (error: String?) -> Void in
+        queue.async {
+          errors[index] = error
+          finished += 1
+          if finished == images.count {
+            completion(errors)
+          } else {
+            storeNext()
+          }
+        }
+      }
+
+      let image = images[index]
+      guard image.image != nil, !image.fileName.isEmpty, !image.fileName.contains("/") else {
+        finish("Image must have a file name and image data")
+        return
+      }
+
+      // Only the bookkeeping runs on `queue`; an upload blocks its thread for as long as it takes
+      DispatchQueue.global().async {
+        do {
+          try self.store(image: image) { success in
+            finish(success ? nil : "Image could not be stored")
+          }
+        } catch {
+          Log.error("\(error)")
+          finish("Image could not be stored")
+        }
+      }
+    }
+
+    queue.async {
+      for _ in 0..<min(self.settings.batchUploadConcurrency, images.count) {
+        storeNext()
+      }
+    }
+  }
+}
@@ -0,0 +1,89 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+
+/**
+ In-process cache of decoded image documents, joined with their user.
+
+ The cache is kept coherent by the database changes feed: a change to an image
+ drops that image, a change to a user drops every image embedding that user.
+ Every invalidation bumps a generation number, and a value read from the
+ database is only stored if no invalidation happened while it was being read.
+ */
+final class ImageCache {
+
+  private let cache: LRUCache<String, Image>
+  private let queue = DispatchQueue(label: "imageCacheQueue")
+  private var generation = 0
+
+  init(capacity: Int) {
+    cache = LRUCache(capacity: capacity)
+  }
+
+  var isEnabled: Bool {
+    return cache.capacity > 0
+  }
+
+  var stats: CacheStats {
+    return cache.stats
+  }
+
+  func image(withId id: String) -> Image? {
+    return isEnabled ? cache.value(forKey: id) : nil
+  }
+
+  /// Token to take before reading an image from the database, and to hand back to `store`
+  func fillToken() -> Int {
+    return queue.sync { generation }
+  }
+
+  /// Caches an image read from the database, unless it may have changed since `token` was taken
+  func store(_ image: Image, token: Int) {
+    queue.sync {
+      if generation == token {
+        cache.setValue(image, forKey: image.id)
+      }
+    }
+  }
+
+  /**
+   Drops the image with the given id, or every image of the user with that id.
+
+   Finding a user's images scans the whole cache, so it is only done for a user
+   document, or when the type of the changed document is not known, as for a
+   deletion or a feed followed without documents.
+
+   - parameter documentType: `type` field of the changed document, if known
+   */
+  func invalidate(id: String, documentType: String? = nil) {
+    queue.sync {
+      generation += 1
+      if cache.removeValue(forKey: id) == nil && documentType != "image" {
+        cache.removeValues { $0.userId == id }
+      }
+    }
+  }
+
+  /// Drops every cached image
+  func removeAll() {
+    queue.sync {
+      generation += 1
+      cache.removeAll()
+    }
+  }
+}
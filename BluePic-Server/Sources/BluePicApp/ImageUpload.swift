@@ -0,0 +1,289 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Kitura
+import LoggerAPI
+
+/// Enum identifying why a streamed upload did not complete
+enum UploadError: Error {
+  case emptyBody
+  case tooLarge(Int)
+  case readFailed(Error)
+  case storeFailed(String)
+}
+
+/**
+ Copies a request body into the blob store one segment at a time.
+
+ Object storage receives the body in segments and this class only copies one
+ segment at a time, but Kitura-net has already buffered the whole request body
+ before the route runs, so the server still holds the entire photo in memory.
+
+ Bodies that fit in a single segment are stored as a plain object. Larger bodies
+ are stored as numbered segment objects under `<name>/` followed by a dynamic
+ large object manifest at `<name>`, which the blob store serves as the
+ concatenation of the segments, so the object URL is the same either way.
+ The body is hashed as it is read, so its content hash is known once it is stored.
+ */
+final class StreamedObjectUpload {
+
+  private let request: RouterRequest
+  private let container: BlobContainer
+  private let containerCache: ContainerCache
+  private let name: String
+  private let segmentSize: Int
+  private let maxSize: Int
+
+  private var storedSegments = [String]()
+  private var totalSize = 0
+  private var reachedEnd = false
+  private var completion: ((UploadError?) -> Void)?
+  private let hasher = ContentHasher()
+
+  /// Hex encoded SHA-256 of the body, set once it has been stored
+  private(set) var contentHash: String?
+
+  init(request: RouterRequest, container: BlobContainer, containerCache: ContainerCache,
+       name: String, segmentSize: Int, maxSize: Int) {
+    self.request = request
+    self.container = container
+    self.containerCache = containerCache
+    self.name = name
+    self.segmentSize = segmentSize
+    self.maxSize = maxSize
+  }
+
+  /// Starts copying the body; `completion` is called once with nil on success
+  func start(completion: @escaping (UploadError?) -> Void) {
+    self.completion = completion
+    storeNextSegment()
+  }
+
+  private func storeNextSegment() {
+    let segment: Data
+    do {
+      segment = try readSegment()
+    } catch let error as UploadError {
+      return fail(error)
+    } catch {
+      return fail(.readFailed(error))
+    }
+
+    let isFirst = storedSegments.isEmpty
+    if segment.isEmpty {
+      return isFirst ? fail(.emptyBody) : storeManifest()
+    }
+
+    // Whole body fits in one segment, store it as is
+    if isFirst && reachedEnd {
+      return store(segment, as: name) { self.finish(nil) }
+    }
+
+    let segmentName = name + "/" + String(format: "%08d", storedSegments.count)
+    store(segment, as: segmentName) {
+      self.storedSegments.append(segmentName)
+      self.reachedEnd ? self.storeManifest() : self.storeNextSegment()
+    }
+  }
+
+  /// Reads from the request until a segment is full or the body ends
+  private func readSegment() throws -> Data {
+    var segment = Data()
+    while !reachedEnd && segment.count < segmentSize {
+      if try request.read(into: &segment) == 0 {
+        reachedEnd = true
+      }
+    }
+
+    totalSize += segment.count
+    if totalSize > maxSize {
+      throw UploadError.tooLarge(maxSize)
+    }
+    hasher.update(segment)
+    return segment
+  }
+
+  private func storeManifest() {
+    let manifest = ["X-Object-Manifest": "\(container.name)/\(name)/"]
+    container.storeObject(name: name, data: Data(), metadata: manifest) { error in
+      if let error = error {
+        Log.error("\(error)")
+        self.fail(.storeFailed(self.name))
+      } else {
+        self.finish(nil)
+      }
+    }
+  }
+
+  private func store(_ data: Data, as objectName: String, then: @escaping () -> Void) {
+    container.storeObject(name: objectName, data: data, metadata: [:]) { error in
+      if let error = error {
+        Log.error("\(error)")
+        self.fail(.storeFailed(objectName))
+      } else {
+        then()
+      }
+    }
+  }
+
+  /// Removes any segments already stored, then reports the failure
+  private func fail(_ error: UploadError) {
+    Log.error("Upload of '\(name)' failed: \(error)")
+    if case .storeFailed = error {
+      containerCache.invalidate(container.name)
+    }
+    deleteSegments()
+    finish(error)
+  }
+
+  /// Removes the stored object and its segments, once it turned out to duplicate another
+  func discard() {
+    container.deleteObject(name: name) { error in
+      if error != nil {
+        Log.warning("Could not delete duplicate object '\(self.name)'.")
+      }
+    }
+    deleteSegments()
+  }
+
+  private func deleteSegments() {
+    for segmentName in storedSegments {
+      container.deleteObject(name: segmentName) { error in
+        if error != nil {
+          Log.warning("Could not delete orphaned segment '\(segmentName)'.")
+        }
+      }
+    }
+    storedSegments.removeAll()
+  }
+
+  private func finish(_ error: UploadError?) {
+    if error == nil {
+      contentHash = hasher.finalize()
+    }
+    let completion = self.completion
+    self.completion = nil
+    completion?(error)
+  }
+}
+
+extension ServerController {
+
+  /**
+   Route for uploading an image as the raw request body.
+
+   Image properties are passed as query parameters: `userId`, `fileName`, `width`
+   and `height` are required, while `caption`, `deviceId` and `locationName` with
+   `latitude` and `longitude` are optional. The body is sent to the user's
+   container in segments, so no single object storage request grows with the
+   photo. Kitura still buffers the whole body, but unlike the JSON route the
+   binary is never base64 decoded. A photo uploaded before is only known once
+   stored, so its copy is then deleted and the earlier binary and tags are
+   used instead.
+   */
+  func postImageBinary(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
+    let started = Date()
+    let params = request.queryParameters
+
+    guard let userId = params["userId"],
+      let fileName = params["fileName"], !fileName.isEmpty, !fileName.contains("/"),
+      let width = params["width"].flatMap({ Double($0) }),
+      let height = params["height"].flatMap({ Double($0) }) else {
+        response.status(.badRequest)
+        next()
+        return
+    }
+
+    if let length = request.headers["Content-Length"].flatMap({ Int($0) }), length > settings.maxUploadSize {
+      response.status(.requestTooLong)
+      next()
+      return
+    }
+
+    var location: Location?
+    if let name = params["locationName"],
+      let latitude = params["latitude"].flatMap({ Double($0) }),
+      let longitude = params["longitude"].flatMap({ Double($0) }) {
+      location = Location(name: name, latitude: latitude, longitude: longitude, weather: nil)
+    }
+
+    var image = Image(id: UUID().uuidString,
+                      rev: nil,
+                      fileName: fileName,
+                      caption: StringUtils.decodeWhiteSpace(inString: params["caption"] ?? ""),
+                      contentType: request.headers["Content-Type"] ?? "image/png",
+                      url: nil,
+                      width: width,
+                      height: height,
+                      tags: [],
+                      uploadedTs: StringUtils.currentTimestamp(),
+                      userId: userId,
+                      deviceId: params["deviceId"],
+                      location: location,
+                      user: nil,
+                      image: nil,
+                      contentHash: nil)
+
+    retrieveContainer(named: userId) { container in
+      guard let container = container else {
+        response.status(.internalServerError)
+        next()
+        return
+      }
+
+      let upload = StreamedObjectUpload(request: request,
+                                        container: container,
+                                        containerCache: self.containerCache,
+                                        name: fileName,
+                                        segmentSize: self.settings.uploadSegmentSize,
+                                        maxSize: self.settings.maxUploadSize)
+      upload.start { error in
+        switch error {
+        case .some(.tooLarge):
+          response.status(.requestTooLong)
+          next()
+        case .some(.emptyBody):
+          response.status(.badRequest)
+          next()
+        case .some:
+          response.status(.internalServerError)
+          next()
+        case .none:
+          image.contentHash = upload.contentHash
+          self.findImage(withContentHash: upload.contentHash ?? "") { original in
+            let url = self.generateUrl(forContainer: userId, forImage: fileName)
+            if let original = original, let originalUrl = original.url, originalUrl != url {
+              Log.verbose("Image '\(fileName)' duplicates image '\(original.id)'.")
+              upload.discard()
+            }
+
+            self.createImageRecord(image, duplicateOf: original, uploadStep: "uploadImage",
+                                   uploadStarted: started) { image, error in
+              if let image = image, error == nil {
+                response.headers[TraceRecorder.traceIdHeader] = self.traces.traceId(forImage: image.id)
+                response.status(.OK).send(json: image)
+              } else {
+                response.status(.internalServerError)
+              }
+              next()
+            }
+          }
+        }
+      }
+    }
+  }
+}
@@ -15,11 +15,27 @@
  **/
 
 import Foundation
-import SwiftyJSON
 
 protocol JSONConvertible: Codable {
 
   var rev: String? { get set }
 
-  static func convert(document: JSON, hasDocs: Bool, decoder: JSONDecoder) throws -> [Self]
+  /**
+   Decodes the next object from the rows of a view response, consuming every row the object spans.
+
+   - parameter rows:    rows container positioned at the first row of the object
+   - parameter hasDocs: whether the rows carry an `include_docs` document
+
+   - returns: the decoded object, or nil if its rows were incomplete
+   */
+  static func decode(rowsFrom rows: inout UnkeyedDecodingContainer, hasDocs: Bool) throws -> Self?
+
+  /// Number of view rows emitted for each object
+  static func rowsPerObject(hasDocs: Bool) -> Int
+}
+
+extension JSONConvertible {
+  static func rowsPerObject(hasDocs: Bool) -> Int {
+    return 1
+  }
 }
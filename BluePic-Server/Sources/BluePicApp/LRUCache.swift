@@ -0,0 +1,170 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+
+/// Snapshot of the counters kept by a cache
+public struct CacheStats {
+  public let count: Int
+  public let hits: Int
+  public let misses: Int
+  public let evictions: Int
+}
+
+/**
+ Thread safe, bounded least-recently-used cache.
+
+ Entries live in a dictionary for lookup and in an intrusive doubly linked
+ list for recency, so lookups, insertions and evictions are all O(1).
+ */
+final class LRUCache<Key: Hashable, Value> {
+
+  private final class Node {
+    let key: Key
+    var value: Value
+    var prev: Node?
+    var next: Node?
+
+    init(key: Key, value: Value) {
+      self.key = key
+      self.value = value
+    }
+  }
+
+  let capacity: Int
+
+  private let queue = DispatchQueue(label: "lruCacheQueue")
+  private var nodes = [Key: Node]()
+  private var head: Node?
+  private var tail: Node?
+
+  private var hits = 0
+  private var misses = 0
+  private var evictions = 0
+
+  init(capacity: Int) {
+    self.capacity = max(0, capacity)
+  }
+
+  /// Returns the cached value for a key, marking it as most recently used
+  func value(forKey key: Key) -> Value? {
+    return queue.sync {
+      guard let node = nodes[key] else {
+        misses += 1
+        return nil
+      }
+      hits += 1
+      moveToFront(node)
+      return node.value
+    }
+  }
+
+  /// Inserts or replaces a value, evicting the least recently used entry when full
+  func setValue(_ value: Value, forKey key: Key) {
+    guard capacity > 0 else {
+      return
+    }
+
+    queue.sync {
+      if let node = nodes[key] {
+        node.value = value
+        moveToFront(node)
+        return
+      }
+
+      if nodes.count >= capacity, let last = tail {
+        unlink(last)
+        nodes[last.key] = nil
+        evictions += 1
+      }
+
+      let node = Node(key: key, value: value)
+      nodes[key] = node
+      insertAtFront(node)
+    }
+  }
+
+  /// Removes a single entry, returning its value if it was cached
+  @discardableResult
+  func removeValue(forKey key: Key) -> Value? {
+    return queue.sync {
+      guard let node = nodes.removeValue(forKey: key) else {
+        return nil
+      }
+      unlink(node)
+      return node.value
+    }
+  }
+
+  /// Removes every entry whose value matches the predicate
+  func removeValues(where shouldRemove: (Value) -> Bool) {
+    queue.sync {
+      for node in nodes.values where shouldRemove(node.value) {
+        unlink(node)
+        nodes[node.key] = nil
+      }
+    }
+  }
+
+  /// Removes every entry
+  func removeAll() {
+    queue.sync {
+      nodes.removeAll()
+      head = nil
+      tail = nil
+    }
+  }
+
+  var stats: CacheStats {
+    return queue.sync {
+      CacheStats(count: nodes.count, hits: hits, misses: misses, evictions: evictions)
+    }
+  }
+
+  private func moveToFront(_ node: Node) {
+    guard head !== node else {
+      return
+    }
+    unlink(node)
+    insertAtFront(node)
+  }
+
+  private func insertAtFront(_ node: Node) {
+    node.prev = nil
+    node.next = head
+    head?.prev = node
+    head = node
+    if tail == nil {
+      tail = node
+    }
+  }
+
+  private func unlink(_ node: Node) {
+    if let prev = node.prev {
+      prev.next = node.next
+    } else if head === node {
+      head = node.next
+    }
+    if let next = node.next {
+      next.prev = node.prev
+    } else if tail === node {
+      tail = node.prev
+    }
+    node.prev = nil
+    node.next = nil
+  }
+}
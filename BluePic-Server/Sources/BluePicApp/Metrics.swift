@@ -0,0 +1,349 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+import Kitura
+import CAtomics
+
+/**
+ Latency histogram with fixed buckets.
+
+ Every bucket count and the running sum is a word updated with a relaxed
+ atomic add, so recording never takes a lock or blocks another request.
+ */
+final class Histogram {
+
+  /// Upper bounds in seconds, spanning a cache hit to a slow Cloud Functions invocation
+  static let defaultBuckets: [Double] = [0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10]
+
+  struct Snapshot {
+
+    /// Observations at or below each bucket bound, then the total
+    let cumulativeCounts: [UInt64]
+
+    /// Sum of the observations, in seconds
+    let sum: Double
+  }
+
+  let buckets: [Double]
+
+  // One count per bucket, one for observations above every bucket, then the sum in microseconds
+  private let words: UnsafeMutablePointer<UInt64>
+  private let wordCount: Int
+
+  init(buckets: [Double] = Histogram.defaultBuckets) {
+    self.buckets = buckets.sorted()
+    wordCount = buckets.count + 2
+    words = UnsafeMutablePointer<UInt64>.allocate(capacity: wordCount)
+    words.initialize(to: 0, count: wordCount)
+  }
+
+  deinit {
+    words.deinitialize(count: wordCount)
+    words.deallocate(capacity: wordCount)
+  }
+
+  func observe(_ seconds: Double) {
+    var index = 0
+    while index < buckets.count && seconds > buckets[index] {
+      index += 1
+    }
+    catomics_add_u64(words + index, 1)
+    catomics_add_u64(words + buckets.count + 1, UInt64(max(0, seconds) * 1_000_000))
+  }
+
+  var snapshot: Snapshot {
+    var cumulativeCounts = [UInt64]()
+    cumulativeCounts.reserveCapacity(buckets.count + 1)
+    var total: UInt64 = 0
+    for index in 0...buckets.count {
+      total += catomics_load_u64(words + index)
+      cumulativeCounts.append(total)
+    }
+    return Snapshot(cumulativeCounts: cumulativeCounts,
+                    sum: Double(catomics_load_u64(words + buckets.count + 1)) / 1_000_000)
+  }
+}
+
+/// Value that goes up and down, updated with relaxed atomic adds
+final class Gauge {
+
+  private let word: UnsafeMutablePointer<Int64>
+
+  init() {
+    word = UnsafeMutablePointer<Int64>.allocate(capacity: 1)
+    word.initialize(to: 0)
+  }
+
+  deinit {
+    word.deinitialize(count: 1)
+    word.deallocate(capacity: 1)
+  }
+
+  func add(_ delta: Int64) {
+    catomics_add_i64(word, delta)
+  }
+
+  var value: Int64 {
+    return catomics_load_i64(word)
+  }
+}
+
+/// Latency and concurrency of one kind of operation, such as a route or a view query
+final class OperationMetrics {
+
+  let latency = Histogram()
+  let inFlight = Gauge()
+
+  /// Marks an operation started, returning the token to hand to `finish`
+  func start() -> UInt64 {
+    inFlight.add(1)
+    return DispatchTime.now().uptimeNanoseconds
+  }
+
+  func finish(_ started: UInt64) {
+    inFlight.add(-1)
+    let elapsed = DispatchTime.now().uptimeNanoseconds &- started
+    latency.observe(Double(elapsed) / 1_000_000_000)
+  }
+}
+
+/**
+ Metrics of the server, rendered in the Prometheus text format.
+
+ Series are created while the server is set up and handed to the code they
+ measure, so the registry lock is never taken on a request.
+ */
+final class MetricsRegistry {
+
+  enum MetricType: String {
+    case counter
+    case gauge
+  }
+
+  /// Values read from elsewhere when scraped, such as cache statistics
+  typealias Collect = () -> [(labels: [String: String], value: Double)]
+
+  private enum Family {
+    case route
+    case dependency
+  }
+
+  private struct Series {
+    let labels: String
+    let metrics: OperationMetrics
+  }
+
+  private struct Collector {
+    let name: String
+    let type: MetricType
+    let help: String
+    let collect: Collect
+  }
+
+  private struct NamedHistogram {
+    let name: String
+    let help: String
+    let histogram: Histogram
+  }
+
+  private let queue = DispatchQueue(label: "metricsRegistryQueue")
+  private var series = [Family: [String: Series]]()
+  private var collectors = [Collector]()
+  private var histograms = [NamedHistogram]()
+
+  /// Metrics of requests to a route; `path` is the route pattern, not the requested path
+  func route(method: String, path: String) -> OperationMetrics {
+    return lookup(.route, labels: ["method": method, "route": path])
+  }
+
+  /// Metrics of calls to a service the server depends on
+  func dependency(_ name: String, operation: String) -> OperationMetrics {
+    return lookup(.dependency, labels: ["dependency": name, "operation": operation])
+  }
+
+  /// Adds a family whose samples are read when scraped
+  func addCollector(name: String, type: MetricType, help: String, collect: @escaping Collect) {
+    queue.sync {
+      collectors.append(Collector(name: name, type: type, help: help, collect: collect))
+    }
+  }
+
+  /// Adds a histogram family of a single series, for latencies that are neither requests nor dependency calls
+  func histogram(name: String, help: String, buckets: [Double] = Histogram.defaultBuckets) -> Histogram {
+    let histogram = Histogram(buckets: buckets)
+    queue.sync {
+      histograms.append(NamedHistogram(name: name, help: help, histogram: histogram))
+    }
+    return histogram
+  }
+
+  /// All metrics in the Prometheus text exposition format
+  func render() -> String {
+    let (series, collectors, histograms) = queue.sync { (self.series, self.collectors, self.histograms) }
+
+    var text = ""
+    MetricsRegistry.render(series[.route] ?? [:], into: &text,
+                           latencyName: "bluepic_http_request_duration_seconds",
+                           latencyHelp: "Time from receiving a request to ending its response.",
+                           inFlightName: "bluepic_http_requests_in_flight",
+                           inFlightHelp: "Requests being handled.")
+    MetricsRegistry.render(series[.dependency] ?? [:], into: &text,
+                           latencyName: "bluepic_dependency_duration_seconds",
+                           latencyHelp: "Time taken by calls to services the server depends on.",
+                           inFlightName: "bluepic_dependency_calls_in_flight",
+                           inFlightHelp: "Calls to services the server depends on that have not completed.")
+
+    for entry in histograms {
+      text += "# HELP \(entry.name) \(entry.help)\n# TYPE \(entry.name) histogram\n"
+      MetricsRegistry.render(entry.histogram, name: entry.name, labels: "", into: &text)
+    }
+
+    for collector in collectors {
+      text += "# HELP \(collector.name) \(collector.help)\n# TYPE \(collector.name) \(collector.type.rawValue)\n"
+      for sample in collector.collect() {
+        text += "\(collector.name)\(MetricsRegistry.labelSet(sample.labels)) \(MetricsRegistry.format(sample.value))\n"
+      }
+    }
+    return text
+  }
+
+  private func lookup(_ family: Family, labels: [String: String]) -> OperationMetrics {
+    let rendered = MetricsRegistry.labelSet(labels)
+    return queue.sync {
+      if let existing = series[family]?[rendered] {
+        return existing.metrics
+      }
+      let metrics = OperationMetrics()
+      series[family, default: [:]][rendered] = Series(labels: rendered, metrics: metrics)
+      return metrics
+    }
+  }
+
+  private static func render(_ table: [String: Series], into text: inout String,
+                             latencyName: String, latencyHelp: String,
+                             inFlightName: String, inFlightHelp: String) {
+    let series = table.values.sorted { $0.labels < $1.labels }
+
+    text += "# HELP \(latencyName) \(latencyHelp)\n# TYPE \(latencyName) histogram\n"
+    for entry in series {
+      render(entry.metrics.latency, name: latencyName, labels: entry.labels, into: &text)
+    }
+
+    text += "# HELP \(inFlightName) \(inFlightHelp)\n# TYPE \(inFlightName) gauge\n"
+    for entry in series {
+      text += "\(inFlightName)\(entry.labels) \(entry.metrics.inFlight.value)\n"
+    }
+  }
+
+  /// Bucket, sum and count samples of one histogram series
+  private static func render(_ histogram: Histogram, name: String, labels: String, into text: inout String) {
+    let snapshot = histogram.snapshot
+    // Insert the bucket bound after the series labels
+    let prefix = labels.isEmpty ? "{" : String(labels.dropLast()) + ","
+    for (index, count) in snapshot.cumulativeCounts.enumerated() {
+      let bound = index < histogram.buckets.count ? format(histogram.buckets[index]) : "+Inf"
+      text += "\(name)_bucket\(prefix)le=\"\(bound)\"} \(count)\n"
+    }
+    text += "\(name)_sum\(labels) \(format(snapshot.sum))\n"
+    text += "\(name)_count\(labels) \(snapshot.cumulativeCounts.last ?? 0)\n"
+  }
+
+  private static func labelSet(_ labels: [String: String]) -> String {
+    guard !labels.isEmpty else {
+      return ""
+    }
+    let pairs = labels.sorted { $0.key < $1.key }.map { label -> String in
+      let value = label.value
+        .replacingOccurrences(of: "\\", with: "\\\\")
+        .replacingOccurrences(of: "\"", with: "\\\"")
+        .replacingOccurrences(of: "\n", with: "\\n")
+      return "\(label.key)=\"\(value)\""
+    }
+    return "{" + pairs.joined(separator: ",") + "}"
+  }
+
+  private static func format(_ value: Double) -> String {
+    if value == value.rounded() && abs(value) < 1e15 {
+      return String(Int64(value))
+    }
+    return String(value)
+  }
+}
+
+/**
+ Records the latency of every request under the route pattern it matched.
+
+ Requests are matched against the patterns the server registers, so label
+ values stay bounded however many distinct ids clients ask for; anything
+ else, such as the web assets, is recorded under the route "other".
+ */
+final class RouteMetricsMiddleware: RouterMiddleware {
+
+  private struct Route {
+    let method: RouterMethod
+    let segments: [String]
+    let metrics: OperationMetrics
+  }
+
+  private let routes: [Route]
+  private let unmatched: OperationMetrics
+
+  /// - parameter routes: method and pattern of each route, in the order the router tries them
+  init(registry: MetricsRegistry, routes: [(method: RouterMethod, path: String)]) {
+    self.routes = routes.map { route in
+      Route(method: route.method,
+            segments: RouteMetricsMiddleware.segments(of: route.path),
+            metrics: registry.route(method: route.method.rawValue, path: route.path))
+    }
+    unmatched = registry.route(method: "", path: "other")
+  }
+
+  func handle(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
+    let metrics = self.metrics(method: request.method, path: request.parsedURL.path ?? "")
+    let started = metrics.start()
+
+    var finished = false
+    var previousOnEnd: LifecycleHandler = {}
+    previousOnEnd = response.setOnEndInvoked {
+      if !finished {
+        finished = true
+        metrics.finish(started)
+      }
+      previousOnEnd()
+    }
+    next()
+  }
+
+  private func metrics(method: RouterMethod, path: String) -> OperationMetrics {
+    let segments = RouteMetricsMiddleware.segments(of: path)
+    let route = routes.first { route in
+      guard route.method == method, route.segments.count == segments.count else {
+        return false
+      }
+      for (pattern, segment) in zip(route.segments, segments) where !pattern.hasPrefix(":") && pattern != segment {
+        return false
+      }
+      return true
+    }
+    return route?.metrics ?? unmatched
+  }
+
+  private static func segments(of path: String) -> [String] {
+    return path.split(separator: "/").map(String.init)
+  }
+}
@@ -15,7 +15,6 @@
  **/
 
 import Foundation
-import SwiftyJSON
 
 struct Image {
     var id: String
@@ -26,13 +25,14 @@ struct Image {
     var url: String?
     let width: Double
     let height: Double
-    let tags: [Tag]
+    var tags: [Tag]
     let uploadedTs: String
     let userId: String
     let deviceId: String?
     let location: Location?
     var user: User?
     var image: Data?
+    var contentHash: String?
 }
 
 extension Image: Encodable {
@@ -52,6 +52,7 @@ extension Image: Encodable {
         try container.encodeIfPresent(deviceId, forKey: .deviceId)
         try container.encodeIfPresent(location, forKey: .location)
         try container.encodeIfPresent(user, forKey: .user)
+        try container.encodeIfPresent(contentHash, forKey: .contentHash)
         try container.encode("image", forKey: .type)
     }
 }
@@ -74,6 +75,7 @@ extension Image: Decodable {
     case location
     case user
     case image
+    case contentHash
     case type
   }
 
@@ -100,20 +102,32 @@ extension Image: Decodable {
     location = try values.decodeIfPresent(Location.self, forKey: .location)
     user = try values.decodeIfPresent(User.self, forKey: .user)
     image = try values.decodeIfPresent(Data.self, forKey: .image)
+    contentHash = try values.decodeIfPresent(String.self, forKey: .contentHash)
   }
 }
 
 extension Image: JSONConvertible {
-  static func convert(document: JSON, hasDocs: Bool = true, decoder: JSONDecoder) throws -> [Image] {
-    return try !hasDocs ? document.toData().map { try decoder.decode(Image.self, from: $0) }
-                          :
-                          document.toDataWithDocs().reduce([]) { acc, current in
-                            var acc = acc
-                            let user = try decoder.decode(User.self, from: current.0)
-                            var image = try decoder.decode(Image.self, from: current.1)
-                            image.user = user
-                            acc.append(image)
-                            return acc
-                        }
+  /// With docs, each image spans a user row followed by the image row (descending key order),
+  /// and the two are joined here as the rows are read.
+  static func decode(rowsFrom rows: inout UnkeyedDecodingContainer, hasDocs: Bool) throws -> Image? {
+    guard hasDocs else {
+      return try rows.decode(ValueRow<Image>.self).value
+    }
+
+    let userRow = try rows.decode(DocRow<User>.self)
+    guard !rows.isAtEnd else {
+      return nil
+    }
+    let imageRow = try rows.decode(DocRow<Image>.self)
+
+    guard let user = userRow.doc, var image = imageRow.doc else {
+      return nil
+    }
+    image.user = user
+    return image
+  }
+
+  static func rowsPerObject(hasDocs: Bool) -> Int {
+    return hasDocs ? 2 : 1
   }
 }
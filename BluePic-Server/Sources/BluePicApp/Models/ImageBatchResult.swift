@@ -0,0 +1,32 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+
+/// Outcome of one image of a batch upload
+struct ImageBatchResult: Codable {
+
+  /// Position of the image in the request
+  let index: Int
+
+  let success: Bool
+
+  /// The created image document, when it succeeded
+  let image: Image?
+
+  /// Why the image was not stored, when it failed
+  let error: String?
+}
@@ -15,7 +15,6 @@
  **/
 
 import Foundation
-import SwiftyJSON
 
 struct Tag: Codable {
     let label: String
@@ -29,7 +28,7 @@ struct PopularTag: Codable {
 }
 
 extension PopularTag: JSONConvertible {
-    static func convert(document: JSON, hasDocs: Bool = false, decoder: JSONDecoder) throws -> [PopularTag] {
-        return try decoder.decode([PopularTag].self, from: document["rows"].rawData())
+    static func decode(rowsFrom rows: inout UnkeyedDecodingContainer, hasDocs: Bool) throws -> PopularTag? {
+        return try rows.decode(PopularTag.self)
     }
 }
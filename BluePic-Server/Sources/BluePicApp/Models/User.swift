@@ -15,7 +15,6 @@
  **/
 
 import Foundation
-import SwiftyJSON
 
 struct User {
   var id: String
@@ -56,7 +55,7 @@ extension User: Codable {
 }
 
 extension User: JSONConvertible {
-    static func convert(document: JSON, hasDocs: Bool = false, decoder: JSONDecoder) throws -> [User] {
-    return try document.toData().map { try decoder.decode(User.self, from: $0) }
+  static func decode(rowsFrom rows: inout UnkeyedDecodingContainer, hasDocs: Bool) throws -> User? {
+    return try rows.decode(ValueRow<User>.self).value
   }
 }
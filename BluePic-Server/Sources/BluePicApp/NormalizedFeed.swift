@@ -0,0 +1,158 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import CouchDB
+import Kitura
+import LoggerAPI
+
+/**
+ Shape of the image list routes, chosen with the `shape` query parameter.
+
+ The embedded shape is a JSON array of images that each carry their user.
+ The normalized shape is an object whose `images` only reference their user
+ by `userId` and whose `users` map holds each of those users once.
+ */
+enum FeedShape: String {
+  case embedded
+  case normalized
+
+  /// Reads the `shape` query parameter, returning nil if it names no shape
+  init?(request: RouterRequest) {
+    guard let shape = request.queryParameters["shape"] else {
+      self = .embedded
+      return
+    }
+    self.init(rawValue: shape)
+  }
+}
+
+/// Image read from a view that emits a single row per image, without its user joined in
+struct UnjoinedImage: JSONConvertible {
+  var image: Image
+
+  var rev: String? {
+    get { return image.rev }
+    set { image.rev = newValue }
+  }
+
+  init(from decoder: Decoder) throws {
+    image = try Image(from: decoder)
+  }
+
+  func encode(to encoder: Encoder) throws {
+    try image.encode(to: encoder)
+  }
+
+  static func decode(rowsFrom rows: inout UnkeyedDecodingContainer, hasDocs: Bool) throws -> UnjoinedImage? {
+    guard hasDocs else {
+      return try rows.decode(ValueRow<UnjoinedImage>.self).value
+    }
+    return try rows.decode(DocRow<UnjoinedImage>.self).doc
+  }
+}
+
+extension ServerController {
+
+  /**
+   * Streams one page of images in the normalized shape. The images are encoded as
+   * their rows are read, then the distinct users they reference are read with a
+   * single query and encoded as the `users` map. The body is only sent once both
+   * succeeded, so a failure is answered with a 500 and no body.
+   *
+   * - parameter view: View emitting a single row per image
+   * - parameter params: Database.QueryParameters, excluding start key and limit
+   * - parameter startKey: Start key of the first page, if any
+   * - parameter page: Page size and cursor requested by the client
+   * - parameter database: Database backend
+   * - parameter response: RouterResponse to write to
+   * - parameter next: Next handler in the route chain
+   */
+  func streamNormalizedPage(_ view: View,
+                            params: [Database.QueryParameters] = [],
+                            startKey: [Database.KeyType]? = nil,
+                            page: PageRequest,
+                            database: DatabaseBackend,
+                            response: RouterResponse,
+                            next: @escaping () -> Void) {
+
+    let fail = { (error: Error) -> Void in
+      Log.error("\(error)")
+      response.status(.internalServerError)
+      next()
+    }
+
+    let writer = JSONArrayWriter(encoder: encoder)
+    var userIds = [String]()
+    var seenUserIds = Set<String>()
+
+    let type = UnjoinedImage.self
+    streamView(view, params: pageParams(params, startKey: startKey, page: page, type: type), limit: page.limit,
+               type: type, database: database, onItem: { item in
+      if seenUserIds.insert(item.image.userId).inserted {
+        userIds.append(item.image.userId)
+      }
+      try writer.write(item.image)
+    }) { nextCursor, error in
+      if let error = error {
+        fail(error)
+        return
+      }
+      var body = Data("{\"images\":".utf8)
+      body.append(writer.close())
+
+      self.readUsers(withIds: userIds, database: database) { users, error in
+        do {
+          guard let users = users, error == nil else {
+            throw error ?? BluePicLocalizedError.readDocumentFailed
+          }
+
+          var usersById = [String: User]()
+          for user in users {
+            usersById[user.id] = user
+          }
+          body.append(contentsOf: ",\"users\":".utf8)
+          body.append(try self.encoder.encode(usersById))
+          body.append(contentsOf: "}".utf8)
+        } catch {
+          fail(error)
+          return
+        }
+
+        if let cursor = nextCursor?.encoded() {
+          response.headers[kNextCursorHeader] = cursor
+        }
+        response.headers["Content-Type"] = "application/json"
+        response.status(.OK).send(data: body)
+        next()
+      }
+    }
+  }
+
+  /// Reads the given users with a single query of the users view
+  private func readUsers(withIds ids: [String], database: DatabaseBackend,
+                         callback: @escaping ([User]?, Error?) -> Void) {
+    guard !ids.isEmpty else {
+      callback([], nil)
+      return
+    }
+
+    let params: [Database.QueryParameters] = [.keys(ids.map { $0 as Database.KeyType })]
+    queryView(View.users, params: params, type: User.self, database: database) { result, error in
+      callback(result?.items, error)
+    }
+  }
+}
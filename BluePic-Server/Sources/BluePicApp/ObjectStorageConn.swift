@@ -20,67 +20,110 @@ import LoggerAPI
 import Dispatch
 import CloudEnvironment
 
-public struct ObjectStorageConn {
-  let connectQueue = DispatchQueue(label: "connectQueue")
+/**
+ Hands out an authenticated ObjectStorage instance without blocking the caller.
+
+ All state lives on a serial queue. Callers that arrive while the auth token is
+ being obtained wait for that single refresh instead of starting their own, and
+ the token is refreshed ahead of its expiry so requests rarely wait at all.
+ */
+public final class ObjectStorageConn {
+
+  /// How long an auth token is reused for
+  static let tokenLifetime: TimeInterval = 50 * 60
+
+  /// How long before the end of its lifetime a token is proactively refreshed
+  static let refreshMargin: TimeInterval = 5 * 60
+
+  /// Delay before retrying a failed proactive refresh
+  static let retryDelay: TimeInterval = 30
+
   let objStorage: ObjectStorage
   let connProps: ObjectStorageCredentials
-  private var authenticated: Bool = false
-  // FIXME: Accessing Date object more than once will cause seg fault, related to https://bugs.swift.org/browse/SR-2462
-  private var lastAuthenticatedTs: Date?
+
+  private let queue = DispatchQueue(label: "objectStorageConnQueue")
+  private var authenticatedAt: Date?
+  private var refreshing = false
+  /// Bumped by every finished refresh, so timers set by an earlier one do not fire
+  private var refreshGeneration = 0
+  private var waiters = [(ObjectStorage?) -> Void]()
 
   init(credentials: ObjectStorageCredentials) {
     connProps = credentials
     objStorage = ObjectStorage(projectId: connProps.projectID)
   }
 
-  mutating func getObjectStorage(completionHandler: @escaping (_ objStorage: ObjectStorage?) -> Void) {
-    Log.verbose("Starting task in serialized block (getting ObjectStorage instance)...")
-    connectQueue.sync {
-        self.connect(completionHandler: completionHandler)
-    }
-    Log.verbose("Completed task in serialized block.")
-    let param: ObjectStorage? = (authenticated) ? objStorage : nil
-    completionHandler(param)
-  }
+  /**
+   Provides an authenticated ObjectStorage instance, or nil if authentication failed.
 
-  private mutating func connect(completionHandler: (_ objStorage: ObjectStorage?) -> Void) {
-    Log.verbose("Determining if we have an ObjectStorage instance ready to use...")
-    if authenticated, let lastAuthenticatedTs = lastAuthenticatedTs {
-      // Check when was the last time we got an auth token
-      // If it's been less than 50 mins, then reuse auth token.
-      // This logic is just a stopgap solution to avoid requesting a new
-      // authToken for every ObjectStorage request.
-      // The ObjectStorage SDK will contain logic for handling expired authToken
-      let timeDiff = lastAuthenticatedTs.timeIntervalSinceNow
-      let minsDiff = Int(fabs(timeDiff / 60))
-      if minsDiff < 50 {
+   - parameter completionHandler: called on a global queue once a valid token is available
+   */
+  func getObjectStorage(completionHandler: @escaping (_ objStorage: ObjectStorage?) -> Void) {
+    queue.async {
+      if self.hasValidToken {
         Log.verbose("Reusing existing Object Storage auth token...")
+        DispatchQueue.global().async { completionHandler(self.objStorage) }
         return
       }
+
+      self.waiters.append(completionHandler)
+      self.refresh()
     }
+  }
 
-    // Network call should be synchronous since we need to know the result before proceeding.
-    let semaphore = DispatchSemaphore(value: 0)
-    var copy = self
-    Log.verbose("Making network call synchronous...")
-    objStorage.connect(userId: connProps.userID, password: connProps.password, region: ObjectStorage.REGION_DALLAS) { error in
-      if let error = error {
-        let errorMsg = "Could not connect to Object Storage."
-        Log.error("\(errorMsg) Error was: '\(error)'.")
-        copy.authenticated = false
-      } else {
-        Log.verbose("Successfully obtained authentication token for Object Storage.")
-        copy.authenticated = true
-        copy.lastAuthenticatedTs = Date()
-      }
-      Log.verbose("Signaling semaphore...")
-      semaphore.signal()
+  /// Must be called on `queue`
+  private var hasValidToken: Bool {
+    guard let authenticatedAt = authenticatedAt else {
+      return false
+    }
+    return Date().timeIntervalSince(authenticatedAt) < ObjectStorageConn.tokenLifetime
+  }
 
+  /// Starts a token refresh unless one is already in flight. Must be called on `queue`.
+  private func refresh() {
+    guard !refreshing else {
+      return
     }
+    refreshing = true
+
+    Log.verbose("Obtaining Object Storage auth token...")
+    objStorage.connect(userId: connProps.userID, password: connProps.password, region: ObjectStorage.REGION_DALLAS) { error in
+      self.queue.async {
+        self.refreshing = false
+        self.refreshGeneration += 1
+
+        let objStorage: ObjectStorage?
+        if let error = error {
+          Log.error("Could not connect to Object Storage. Error was: '\(error)'.")
+          objStorage = nil
+          // Keep retrying once a token has been obtained, even after it expires, so requests need not wait
+          if self.authenticatedAt != nil {
+            self.scheduleRefresh(after: ObjectStorageConn.retryDelay)
+          }
+        } else {
+          Log.verbose("Successfully obtained authentication token for Object Storage.")
+          self.authenticatedAt = Date()
+          objStorage = self.objStorage
+          self.scheduleRefresh(after: ObjectStorageConn.tokenLifetime - ObjectStorageConn.refreshMargin)
+        }
 
-    _ = semaphore.wait(timeout: DispatchTime.distantFuture)
-    self = copy
-    Log.verbose("Continuing execution after synchronous network call...")
+        let waiters = self.waiters
+        self.waiters.removeAll()
+        DispatchQueue.global().async {
+          waiters.forEach { $0(objStorage) }
+        }
+      }
+    }
   }
 
+  /// Refreshes after `delay` unless another refresh finishes first. Must be called on `queue`.
+  private func scheduleRefresh(after delay: TimeInterval) {
+    let generation = refreshGeneration
+    queue.asyncAfter(deadline: .now() + delay) {
+      guard generation == self.refreshGeneration else {
+        return
+      }
+      self.refresh()
+    }
+  }
 }
@@ -0,0 +1,147 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import CouchDB
+import Kitura
+
+/// Header carrying the cursor for the next page of a list route
+let kNextCursorHeader = "X-Next-Cursor"
+
+/**
+ Opaque keyset cursor pointing at the first view row of the next page.
+
+ The cursor is the row's view key plus its document id, so resuming a page
+ is a `startkey`/`startkey_docid` lookup in the view index and costs the same
+ regardless of how deep into the result set the client is.
+ */
+struct PageCursor {
+  let startKey: [Any]
+  let startKeyDocId: String?
+
+  init(startKey: [Any], startKeyDocId: String?) {
+    self.startKey = startKey
+    self.startKeyDocId = startKeyDocId
+  }
+
+  /// Decodes a cursor previously produced by `encoded()`
+  init?(encoded: String) {
+    var base64 = encoded.replacingOccurrences(of: "-", with: "+")
+                        .replacingOccurrences(of: "_", with: "/")
+    let padding = base64.count % 4
+    if padding > 0 {
+      base64 += String(repeating: "=", count: 4 - padding)
+    }
+
+    guard let data = Data(base64Encoded: base64),
+      let object = try? JSONSerialization.jsonObject(with: data, options: []),
+      let dict = object as? [String: Any],
+      let key = dict["k"] as? [Any], !key.isEmpty,
+      key.flatMap(PageCursor.keyElement).count == key.count else {
+        return nil
+    }
+
+    self.init(startKey: key, startKeyDocId: dict["d"] as? String)
+  }
+
+  /// URL safe, unpadded base64 representation of the cursor
+  func encoded() -> String? {
+    var dict: [String: Any] = ["k": startKey]
+    if let startKeyDocId = startKeyDocId {
+      dict["d"] = startKeyDocId
+    }
+
+    guard let data = try? JSONSerialization.data(withJSONObject: dict, options: []) else {
+      return nil
+    }
+
+    return data.base64EncodedString()
+      .replacingOccurrences(of: "+", with: "-")
+      .replacingOccurrences(of: "/", with: "_")
+      .replacingOccurrences(of: "=", with: "")
+  }
+
+  /// View key converted to the key type expected by the CouchDB client
+  var databaseKey: [Database.KeyType] {
+    return startKey.flatMap(PageCursor.keyElement)
+  }
+
+  /// Whether the view key starts with the given strings, i.e. stays within one user's or tag's rows
+  func hasKeyPrefix(_ prefix: [String]) -> Bool {
+    guard prefix.count <= startKey.count else {
+      return false
+    }
+    return !zip(prefix, startKey).contains { expected, element in (element as? String) != expected }
+  }
+
+  /// Key element as the CouchDB client expects it, or nil if it is not a string or number
+  private static func keyElement(_ element: Any) -> Database.KeyType? {
+    switch element {
+    case let string as String: return string as Database.KeyType
+    case let number as NSNumber: return number
+    case let int as Int: return NSNumber(value: int)
+    case let double as Double: return NSNumber(value: double)
+    default: return nil
+    }
+  }
+}
+
+/// Page size and starting point requested by a client for a list route
+struct PageRequest {
+  let limit: Int
+  let cursor: PageCursor?
+
+  init(limit: Int, cursor: PageCursor? = nil) {
+    self.limit = limit
+    self.cursor = cursor
+  }
+
+  /**
+   Reads the `limit` and `cursor` query parameters of a request.
+
+   - parameter request:  incoming request
+   - parameter settings: server settings providing default and maximum page sizes
+   - parameter keyPrefix: leading view key elements every row of the route has, such
+     as the user id or tag; a cursor pointing outside of them is rejected
+
+   - returns: the page request, or nil if either parameter is malformed
+   */
+  init?(request: RouterRequest, settings: ServerSettings, keyPrefix: [String] = []) {
+    var limit = settings.defaultPageSize
+    if let limitParam = request.queryParameters["limit"] {
+      guard let requested = Int(limitParam), requested > 0 else {
+        return nil
+      }
+      limit = min(requested, settings.maxPageSize)
+    }
+
+    var cursor: PageCursor?
+    if let cursorParam = request.queryParameters["cursor"] {
+      guard let decoded = PageCursor(encoded: cursorParam), decoded.hasKeyPrefix(keyPrefix) else {
+        return nil
+      }
+      cursor = decoded
+    }
+
+    self.init(limit: limit, cursor: cursor)
+  }
+}
+
+/// One page of a list route along with the cursor for the following page
+struct Page<T> {
+  let items: [T]
+  let nextCursor: PageCursor?
+}
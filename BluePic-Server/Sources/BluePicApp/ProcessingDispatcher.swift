@@ -0,0 +1,211 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+import LoggerAPI
+
+/// Snapshot of the counters kept by the processing dispatcher
+public struct ProcessingStats {
+
+  /// Image ids waiting for an invocation slot
+  public let queueDepth: Int
+
+  /// Invocations currently outstanding
+  public let inFlight: Int
+
+  /// Image ids waiting out a retry delay
+  public let retrying: Int
+
+  public let completed: Int
+  public let failed: Int
+  public let dropped: Int
+}
+
+/**
+ Hands image ids to the image processing sequence with a bounded number of
+ invocations outstanding at once.
+
+ Ids that arrive while every slot is busy wait in a FIFO queue. When batching
+ is enabled, a free slot takes up to `batchSize` waiting ids in one invocation.
+ Failed invocations are retried with exponential backoff, and ids are dropped
+ once they run out of attempts or the queue is full.
+ */
+final class ProcessingDispatcher {
+
+  /// Sends one invocation for the given ids, along with the documents known for them, and reports whether it was accepted
+  typealias Invoker = (_ imageIds: [String], _ documents: [Data?], _ completion: @escaping (Bool) -> Void) -> Void
+
+  private struct Job {
+    let imageId: String
+
+    /// Image document as created, sent so the sequence need not read it back
+    let document: Data?
+
+    let enqueuedAt: Date
+    var attempts: Int
+  }
+
+  private let maxInFlight: Int
+  private let batchSize: Int
+  private let queueCapacity: Int
+  private let maxRetries: Int
+  private let retryDelay: TimeInterval
+  private let maxRetryDelay: TimeInterval
+  private let invoke: Invoker
+
+  private let queue = DispatchQueue(label: "processingDispatcherQueue")
+  private var pending = [Job]()
+  private var pendingHead = 0
+  private var inFlight = 0
+  private var retrying = 0
+
+  private var completed = 0
+  private var failed = 0
+  private var dropped = 0
+
+  /// Time from enqueue to a successful invocation, in seconds
+  private let latency: Histogram?
+
+  /**
+   - parameter maxInFlight:   number of invocations outstanding at once
+   - parameter batchSize:     largest number of ids sent in one invocation; 1 disables batching
+   - parameter queueCapacity: number of ids that may wait for a slot
+   - parameter maxRetries:    number of times a failed id is retried
+   - parameter retryDelay:    delay before the first retry, doubled for every later one, in seconds
+   - parameter maxRetryDelay: longest delay between retries, in seconds
+   - parameter latency:       histogram recording the time from enqueue to a successful invocation
+   - parameter invoke:        sends one invocation
+   */
+  init(maxInFlight: Int,
+       batchSize: Int = 1,
+       queueCapacity: Int = 10000,
+       maxRetries: Int = 5,
+       retryDelay: TimeInterval = 1,
+       maxRetryDelay: TimeInterval = 60,
+       latency: Histogram? = nil,
+       invoke: @escaping Invoker) {
+    self.maxInFlight = max(1, maxInFlight)
+    self.batchSize = max(1, batchSize)
+    self.queueCapacity = max(1, queueCapacity)
+    self.maxRetries = max(0, maxRetries)
+    self.retryDelay = max(0, retryDelay)
+    self.maxRetryDelay = max(self.retryDelay, maxRetryDelay)
+    self.latency = latency
+    self.invoke = invoke
+  }
+
+  var stats: ProcessingStats {
+    return queue.sync {
+      ProcessingStats(queueDepth: pending.count - pendingHead,
+                      inFlight: inFlight,
+                      retrying: retrying,
+                      completed: completed,
+                      failed: failed,
+                      dropped: dropped)
+    }
+  }
+
+  /// Queues an image for processing and returns immediately
+  func enqueue(imageId: String, document: Data? = nil) {
+    queue.async {
+      guard self.pending.count - self.pendingHead < self.queueCapacity else {
+        self.dropped += 1
+        Log.error("Processing queue is full, dropping image '\(imageId)'.")
+        return
+      }
+      self.pending.append(Job(imageId: imageId, document: document, enqueuedAt: Date(), attempts: 0))
+      self.drain()
+    }
+  }
+
+  /**
+   Queues images stored together and returns immediately. They are sent in invocations of
+   up to the batch size like any others, so one failed invocation only retries its own ids.
+
+   - parameter imageIds:  ids of the images
+   - parameter documents: documents of the images, in the same order; any missing are read back by the sequence
+   */
+  func enqueue(imageIds: [String], documents: [Data?] = []) {
+    queue.async {
+      let room = max(0, self.queueCapacity - (self.pending.count - self.pendingHead))
+      if imageIds.count > room {
+        self.dropped += imageIds.count - room
+        Log.error("Processing queue is full, dropping \(imageIds.count - room) of \(imageIds.count) images.")
+      }
+
+      let now = Date()
+      for (index, imageId) in imageIds.prefix(room).enumerated() {
+        let document = index < documents.count ? documents[index] : nil
+        self.pending.append(Job(imageId: imageId, document: document, enqueuedAt: now, attempts: 0))
+      }
+      self.drain()
+    }
+  }
+
+  /// Starts invocations while slots are free. Must be called on `queue`.
+  private func drain() {
+    while inFlight < maxInFlight && pendingHead < pending.count {
+      let end = min(pendingHead + batchSize, pending.count)
+      let batch = Array(pending[pendingHead..<end])
+      pendingHead = end
+      inFlight += 1
+
+      invoke(batch.map { $0.imageId }, batch.map { $0.document }) { success in
+        self.queue.async {
+          self.inFlight -= 1
+          self.finish(batch, success: success)
+          self.drain()
+        }
+      }
+    }
+
+    // Compact the queue once the consumed prefix dominates it
+    if pendingHead > 0 && pendingHead * 2 >= pending.count {
+      pending.removeFirst(pendingHead)
+      pendingHead = 0
+    }
+  }
+
+  /// Must be called on `queue`
+  private func finish(_ batch: [Job], success: Bool) {
+    guard !success else {
+      let now = Date()
+      for job in batch {
+        latency?.observe(now.timeIntervalSince(job.enqueuedAt))
+      }
+      completed += batch.count
+      return
+    }
+
+    for var job in batch {
+      guard job.attempts < maxRetries else {
+        failed += 1
+        Log.error("Giving up on processing image '\(job.imageId)' after \(job.attempts + 1) attempts.")
+        continue
+      }
+
+      let delay = min(maxRetryDelay, retryDelay * pow(2, Double(job.attempts)))
+      job.attempts += 1
+      retrying += 1
+      queue.asyncAfter(deadline: .now() + delay) {
+        self.retrying -= 1
+        self.pending.append(job)
+        self.drain()
+      }
+    }
+  }
+}
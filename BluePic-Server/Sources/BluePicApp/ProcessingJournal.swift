@@ -0,0 +1,182 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+import LoggerAPI
+
+/**
+ Append-only journal of image processing jobs that have not yet been handed
+ to Cloud Functions.
+
+ A job is recorded as `+<imageId>` once its image document exists and as
+ `-<imageId>` once an invocation for it was accepted, so whatever is left
+ pending after a restart is exactly the set of jobs to replay. The file is
+ rewritten with only the pending jobs at startup and whenever finished
+ entries come to dominate it.
+
+ Pending jobs are synced to disk off the caller's thread. Jobs recorded while
+ a sync is running share the next one, so concurrent uploads wait for one
+ flush together rather than one after another.
+ */
+final class ProcessingJournal {
+
+  private static let minCompactionSize = 1000
+
+  private let path: String
+  private let queue = DispatchQueue(label: "processingJournalQueue")
+  private var handle: FileHandle?
+
+  /// Pending image ids, mapped to the order they were recorded in
+  private var pending = [String: Int]()
+  private var sequence = 0
+  private var lineCount = 0
+
+  /// Pending entries not yet written, and the callbacks waiting for them to be synced
+  private var unflushed = ""
+  private var onFlushed = [() -> Void]()
+  private var flushScheduled = false
+
+  /**
+   Opens the journal, creating it if needed, and loads the jobs left pending
+   by a previous run.
+
+   - parameter path: location of the journal file
+   */
+  init(path: String) throws {
+    self.path = path
+
+    if let contents = try? String(contentsOfFile: path, encoding: .utf8) {
+      var lines = contents.components(separatedBy: "\n")
+      // The last line is either empty or was cut short by a crash
+      lines.removeLast()
+      for line in lines where line.count > 1 {
+        let imageId = String(line.dropFirst())
+        switch line.first {
+        case .some("+"):
+          pending[imageId] = sequence
+          sequence += 1
+        case .some("-"):
+          pending[imageId] = nil
+        default:
+          Log.warning("Skipping malformed processing journal entry '\(line)'.")
+        }
+      }
+    }
+
+    try queue.sync { try compact() }
+  }
+
+  /// Image ids left pending, oldest first
+  var pendingImageIds: [String] {
+    return queue.sync {
+      pending.sorted { $0.value < $1.value }.map { $0.key }
+    }
+  }
+
+  /// Records a job and calls `durable` once it is on disk, when it may be handed to the dispatcher
+  func recordPending(imageId: String, durable: @escaping () -> Void) {
+    recordPending(imageIds: [imageId], durable: durable)
+  }
+
+  /**
+   Records several jobs and returns immediately.
+
+   - parameter durable: called on the journal's queue once the jobs have been synced to disk
+   */
+  func recordPending(imageIds: [String], durable: @escaping () -> Void) {
+    queue.async {
+      for imageId in imageIds {
+        self.pending[imageId] = self.sequence
+        self.sequence += 1
+        self.unflushed += "+" + imageId + "\n"
+      }
+      self.onFlushed.append(durable)
+
+      // Everything recorded before the flush runs is synced with it
+      guard !self.flushScheduled else {
+        return
+      }
+      self.flushScheduled = true
+      self.queue.async { self.flush() }
+    }
+  }
+
+  /// Records that invocations for these images were accepted
+  func recordDone(imageIds: [String]) {
+    queue.async {
+      var lines = ""
+      for imageId in imageIds where self.pending.removeValue(forKey: imageId) != nil {
+        lines += "-" + imageId + "\n"
+      }
+      guard !lines.isEmpty else {
+        return
+      }
+      // Losing a completion only causes a duplicate invocation, so skip the flush
+      self.append(lines, sync: false)
+
+      if self.lineCount > max(ProcessingJournal.minCompactionSize, 4 * self.pending.count) {
+        self.flush()
+        do {
+          try self.compact()
+        } catch {
+          Log.error("Failed to compact processing journal: \(error)")
+        }
+      }
+    }
+  }
+
+  /// Writes and syncs the pending entries recorded since the last flush, then acknowledges them. Must be called on `queue`.
+  private func flush() {
+    flushScheduled = false
+    let callbacks = onFlushed
+    onFlushed.removeAll()
+    if !unflushed.isEmpty {
+      append(unflushed, sync: true)
+      unflushed = ""
+    }
+    callbacks.forEach { $0() }
+  }
+
+  /// Must be called on `queue`
+  private func append(_ lines: String, sync: Bool) {
+    guard let handle = handle, let data = lines.data(using: .utf8) else {
+      Log.error("Processing journal is not open, jobs will not survive a restart.")
+      return
+    }
+    handle.write(data)
+    if sync {
+      handle.synchronizeFile()
+    }
+    lineCount += lines.reduce(0) { $1 == "\n" ? $0 + 1 : $0 }
+  }
+
+  /// Replaces the journal with one holding only the pending jobs. Must be called on `queue`.
+  private func compact() throws {
+    handle?.closeFile()
+    handle = nil
+
+    let lines = pending.sorted { $0.value < $1.value }.map { "+" + $0.key + "\n" }
+    try lines.joined().data(using: .utf8)?.write(to: URL(fileURLWithPath: path), options: .atomic)
+
+    guard let handle = FileHandle(forWritingAtPath: path) else {
+      throw BluePicError.IO("Failed to open processing journal at '\(path)'.")
+    }
+    handle.seekToEndOfFile()
+    self.handle = handle
+    lineCount = lines.count
+  }
+}
@@ -0,0 +1,135 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+import LoggerAPI
+
+/**
+ Merges "image processed" notifications that arrive close together.
+
+ The first image processed after a flush opens an aggregation window that
+ all devices share, and every image processed before the window closes
+ joins its device's notification, so an image waits anywhere from nothing to
+ a whole window. A device with a single image is sent that image as the
+ payload, so the client can open it. Devices with several images get a
+ summary without a payload, which is identical for all of them, so they
+ share a single target.
+ */
+final class PushCoalescer {
+
+  static let singleImageAlert = "Your image was processed; check it out!"
+  static let multipleImagesAlert = "Your images were processed; check them out!"
+
+  /// Largest number of devices addressed by one notification
+  static let maxTargetDevices = 500
+
+  private let notifier: Notifier
+  private let window: TimeInterval
+  private let encoder = JSONEncoder()
+  private let queue = DispatchQueue(label: "pushCoalescerQueue")
+
+  private struct Entry {
+    let image: Image
+
+    /// Called once the notification carrying the image has been sent
+    let sent: (() -> Void)?
+  }
+
+  /// Images processed per device in the current window, in arrival order
+  private var pending = [String: [Entry]]()
+  private var flushScheduled = false
+
+  /**
+   - parameter notifier: delivers the notifications
+   - parameter window:   how long notifications are held back for merging, in seconds
+   */
+  init(notifier: Notifier, window: TimeInterval) {
+    self.notifier = notifier
+    self.window = window
+  }
+
+  /**
+   Queues a notification that `image` was processed for the device that uploaded it.
+
+   - parameter sent: called once the notification has been handed to the notifier's service, whether or not it succeeded
+   */
+  func add(_ image: Image, deviceId: String, sent: (() -> Void)? = nil) {
+    queue.async {
+      self.pending[deviceId, default: []].append(Entry(image: image, sent: sent))
+
+      guard !self.flushScheduled else {
+        return
+      }
+      self.flushScheduled = true
+      self.queue.asyncAfter(deadline: .now() + self.window) {
+        self.flush()
+      }
+    }
+  }
+
+  /// Sends everything collected in the window. Must be called on `queue`.
+  private func flush() {
+    let batch = pending
+    pending.removeAll()
+    flushScheduled = false
+
+    var summaryDevices = [String]()
+    for (deviceId, entries) in batch {
+      if entries.count == 1, let entry = entries.first {
+        send(singleImageNotification(entry.image, deviceId: deviceId), sent: entries.flatMap { $0.sent })
+      } else {
+        summaryDevices.append(deviceId)
+      }
+    }
+
+    var start = summaryDevices.startIndex
+    while start < summaryDevices.endIndex {
+      let end = min(start + PushCoalescer.maxTargetDevices, summaryDevices.endIndex)
+      let deviceIds = Array(summaryDevices[start..<end])
+      let sent = deviceIds.flatMap { batch[$0] ?? [] }.flatMap { $0.sent }
+      send(summaryNotification(deviceIds: deviceIds), sent: sent)
+      start = end
+    }
+  }
+
+  private func singleImageNotification(_ image: Image, deviceId: String) -> PushMessage {
+    var payload: [String: Any]?
+    do {
+      let data = try encoder.encode(image)
+      payload = try JSONSerialization.jsonObject(with: data, options: .mutableContainers) as? [String: Any]
+    } catch {
+      Log.error("\(error)")
+    }
+
+    return PushMessage(alert: PushCoalescer.singleImageAlert, category: "imageProcessed", payload: payload,
+                       deviceIds: [deviceId])
+  }
+
+  private func summaryNotification(deviceIds: [String]) -> PushMessage {
+    return PushMessage(alert: PushCoalescer.multipleImagesAlert, category: "imageProcessed", payload: nil,
+                       deviceIds: deviceIds)
+  }
+
+  private func send(_ message: PushMessage, sent: [() -> Void]) {
+    notifier.send(message) { error in
+      if let error = error {
+        Log.error("Failed to send push notification: \(error)")
+      }
+      sent.forEach { $0() }
+    }
+  }
+}
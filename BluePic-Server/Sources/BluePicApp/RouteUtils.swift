@@ -18,8 +18,6 @@ import Foundation
 import CouchDB
 import Kitura
 import LoggerAPI
-import SwiftyJSON
-import BluemixObjectStorage
 import Dispatch
 import KituraContracts
 import SwiftyRequest
@@ -28,24 +26,115 @@ import SwiftyRequest
 extension ServerController {
 
   /**
-   This method kicks off asynchronously a Cloud Functions sequence and returns immediately.
+   This method queues an image for the Cloud Functions sequence and returns immediately.
+   The job is journaled first and only handed to the dispatcher once the journal has
+   synced it, so it is replayed if the server stops before it is accepted.
    This method should not wait for the outcome of the CloudFunctions sequence/actions.
    Once the CloudFunctions sequence completes execution, the sequence should invoke the
    '/push' endpoint to generate a push notification for the iOS client.
 
    - parameter imageId: The image ID of the JSON image document in Cloudant.
+   - parameter document: The image document as created, if known, so the sequence need not read it back.
 
    */
-  func processImage(withId imageId: String) {
+  func processImage(withId imageId: String, document: Data? = nil) {
     Log.verbose("imageId: \(imageId)")
+    guard cloudFunctionsProps != nil else {
+      return
+    }
+    guard let journal = processingJournal else {
+      processingDispatcher.enqueue(imageId: imageId, document: document)
+      return
+    }
+    journal.recordPending(imageId: imageId) {
+      self.processingDispatcher.enqueue(imageId: imageId, document: document)
+    }
+  }
+
+  /**
+   Kicks off the processing of images stored together, which are sent to the
+   Cloud Functions sequence in invocations of up to `processingBatchSize` images.
+
+   - parameter imageIds: The image IDs of the JSON image documents in Cloudant.
+   - parameter documents: The image documents as created, in the same order, if known.
+   */
+  func processImages(withIds imageIds: [String], documents: [Data?] = []) {
+    guard cloudFunctionsProps != nil, !imageIds.isEmpty else {
+      return
+    }
+    guard let journal = processingJournal else {
+      processingDispatcher.enqueue(imageIds: imageIds, documents: documents)
+      return
+    }
+    journal.recordPending(imageIds: imageIds) {
+      self.processingDispatcher.enqueue(imageIds: imageIds, documents: documents)
+    }
+  }
+
+  /**
+   The document of a newly created image to send with its processing invocation, or nil
+   when documents are not sent. The journal only keeps ids, so images replayed after a
+   restart are read back by the sequence instead.
+
+   - parameter image: Image as created, with its revision
+   */
+  func processingDocument(for image: Image) -> Data? {
+    guard settings.processingSendsDocuments, cloudFunctionsProps != nil else {
+      return nil
+    }
+    do {
+      return try encoder.encode(image)
+    } catch {
+      Log.error("\(error)")
+      return nil
+    }
+  }
+
+  /**
+   Invokes the Cloud Functions sequence for one or more images. A single image is sent
+   as `imageId` and its `document`, several as `imageIds` and `documents`, with null
+   for any document not known.
+
+   - parameter imageIds:   The image IDs of the JSON image documents in Cloudant.
+   - parameter documents:  The image documents known, in the same order as the ids.
+   - parameter completion: Called with whether Cloud Functions accepted the invocation.
+   */
+  func invokeProcessing(imageIds: [String], documents: [Data?] = [], completion: @escaping (Bool) -> Void) {
+    guard let cloudFunctionsProps = cloudFunctionsProps else {
+      completion(false)
+      return
+    }
 
     let headers = [
       "Content-Type": "application/json",
       "Authorization": "Basic \(cloudFunctionsProps.authToken)"
     ]
 
-    guard let requestBody = try? JSON(["imageId": imageId]).rawData() else {
+    // Images stored before a restart have lost their trace, so they start a new one
+    let traceIds = imageIds.map { traces.traceId(forImage: $0) ?? traces.startTrace(imageId: $0) }
+    let documentObjects = imageIds.indices.map { index -> Any in
+      guard index < documents.count, let document = documents[index],
+        let object = try? JSONSerialization.jsonObject(with: document) else {
+          return NSNull()
+      }
+      return object
+    }
+
+    var body: [String: Any]
+    if imageIds.count == 1 {
+      body = ["imageId": imageIds[0], "traceId": traceIds[0]]
+      if !(documentObjects[0] is NSNull) {
+        body["document"] = documentObjects[0]
+      }
+    } else {
+      body = ["imageIds": imageIds, "traceIds": traceIds]
+      if documentObjects.contains(where: { !($0 is NSNull) }) {
+        body["documents"] = documentObjects
+      }
+    }
+    guard let requestBody = try? JSONSerialization.data(withJSONObject: body) else {
       Log.error("Failed to create JSON string with imageId.")
+      completion(false)
       return
     }
 
@@ -55,17 +144,26 @@ extension ServerController {
     req.headerParameters = headers
     req.messageBody = requestBody
 
-    // Kitura does not yet execute certain functionality asynchronously,
-    // hence the need for this block.
-    DispatchQueue.global().async {
-      req.responseData { response in
-        switch response.result {
-          case .success(let body):
-            let jsonResponse = JSON(data: body)
-            Log.debug("CloudFunctions response: \(jsonResponse)")
-          case .failure(let err):
-            Log.error("Error response from CloudFunctions: \(String(describing: err))")
-        }
+    let started = cloudFunctionsMetrics.start()
+    let invoked = Date()
+    req.responseData { response in
+      self.cloudFunctionsMetrics.finish(started)
+      for traceId in traceIds {
+        self.traces.record("invokeProcessing", traceId: traceId, start: invoked)
+      }
+      switch response.result {
+        case .success(let body):
+          let status = response.response?.statusCode ?? 0
+          guard 200..<300 ~= status else {
+            Log.error("CloudFunctions responded with status \(status): \(String(data: body, encoding: .utf8) ?? "")")
+            completion(false)
+            return
+          }
+          Log.debug("CloudFunctions response: \(String(data: body, encoding: .utf8) ?? "")")
+          completion(true)
+        case .failure(let err):
+          Log.error("Error response from CloudFunctions: \(String(describing: err))")
+          completion(false)
       }
     }
   }
@@ -73,11 +171,17 @@ extension ServerController {
   /**
    * Gets a specific image document from the Cloudant database.
    *
-   * - parameter database: Database instance
+   * - parameter database: Database backend
    * - parameter imageId:  String id of the image document to retrieve.
    * - parameter callback: Callback to use within async method.
    */
-  func readImage(database: Database, imageId: String, callback: @escaping (Image?, RequestError?) -> Void) {
+  func readImage(database: DatabaseBackend, imageId: String, callback: @escaping (Image?, RequestError?) -> Void) {
+    if let image = imageCache.image(withId: imageId) {
+      callback(image, nil)
+      return
+    }
+
+    let cacheToken = imageCache.fillToken()
     let anyImageId = imageId as Database.KeyType
     let queryParams: [Database.QueryParameters] = [
       .includeDocs(true),
@@ -89,6 +193,7 @@ extension ServerController {
         callback(nil, .notFound)
         return
       }
+      self.imageCache.store(image, token: cacheToken)
       callback(image, nil)
     }
   }
@@ -98,39 +203,96 @@ extension ServerController {
    *
    * - parameter params: Database.QueryParameters
    * - parameter types: Type of the object being returned
-   * - parameter database: Database instance
+   * - parameter database: Database backend
    * - parameter callback: Callback to use within async method.
    */
   func readByView<T: JSONConvertible>(_ view: View,
                                       params: [Database.QueryParameters] = [],
                                       type: T.Type,
-                                      database: Database,
+                                      database: DatabaseBackend,
                                       callback: @escaping ([T]?, RequestError?) -> Void) {
 
     var queryParams: [Database.QueryParameters] = [.descending(true)]
     queryParams.append(contentsOf: params)
 
-    let exists = params.contains {
-      switch $0 {
-      case .includeDocs(let x): return x == true
-      default: return false
+    queryView(view, params: queryParams, type: type, database: database) { result, error in
+      guard let result = result, error == nil else {
+        Log.error("\(error ?? BluePicLocalizedError.readDocumentFailed)")
+        callback(nil, .internalServerError)
+        return
       }
+
+      callback(result.items, nil)
     }
+  }
 
-    database.queryByView(view.rawValue, ofDesign: "main_design", usingParameters: queryParams) { document, error in
-      do {
-        guard error == nil, let document = document else {
-          throw BluePicLocalizedError.readDocumentFailed
-        }
+  /**
+   * Query parameters for reading one page of a view using keyset pagination. One extra
+   * object is requested so the key of the first row of the next page can be handed back
+   * as the cursor.
+   *
+   * - parameter params: Database.QueryParameters, excluding start key and limit
+   * - parameter startKey: Start key of the first page, if any
+   * - parameter page: Page size and cursor requested by the client
+   * - parameter type: Type of the object being returned
+   */
+  func pageParams<T: JSONConvertible>(_ params: [Database.QueryParameters],
+                                      startKey: [Database.KeyType]?,
+                                      page: PageRequest,
+                                      type: T.Type) -> [Database.QueryParameters] {
 
-        let objects: [T] = try T.convert(document: document, hasDocs: exists, decoder: self.decoder)
+    let rowsPerObject = T.rowsPerObject(hasDocs: params.includesDocs)
 
-        callback(objects, nil)
+    var queryParams: [Database.QueryParameters] = [.descending(true), .limit((page.limit + 1) * rowsPerObject)]
+    queryParams.append(contentsOf: params)
 
-      } catch {
-        Log.error("\(error)")
-        callback(nil, .internalServerError)
+    if let cursor = page.cursor {
+      queryParams.append(.startKey(cursor.databaseKey))
+      if let docId = cursor.startKeyDocId {
+        queryParams.append(.startKeyDocID(docId))
       }
+    } else if let startKey = startKey {
+      queryParams.append(.startKey(startKey))
+    }
+
+    return queryParams
+  }
+
+  /**
+   * Creates the database record for an image whose binary has been stored,
+   * then kicks off its processing and starts its trace.
+   *
+   * - parameter image: Image whose binary is in the user's container
+   * - parameter original: Earlier image with the same binary, whose URL and tags are reused
+   * - parameter uploadStep: Name of the upload route, the first span of the trace
+   * - parameter uploadStarted: When the upload request arrived
+   * - parameter respondWith: Callback receiving the created record
+   */
+  func createImageRecord(_ image: Image, duplicateOf original: Image? = nil, uploadStep: String, uploadStarted: Date,
+                         respondWith: @escaping (Image?, RequestError?) -> Void) {
+    var image = image
+    if let original = original, let url = original.url {
+      // Processing sees the tags and only adds the weather at this image's location
+      image.url = url
+      image.tags = original.tags
+    } else {
+      image.url = generateUrl(forContainer: image.userId, forImage: image.fileName)
+    }
+    image.image = nil
+
+    createObject(object: image, database: database) { image, error in
+      guard let image = image, error == nil else {
+        respondWith(nil, .internalServerError)
+        return
+      }
+
+      // The trace of the image's processing starts with its upload
+      let traceId = self.traces.startTrace(imageId: image.id)
+      self.traces.record(uploadStep, traceId: traceId, start: uploadStarted)
+
+      // Contine processing of image (async request for CloudFunctions)
+      self.processImage(withId: image.id, document: self.processingDocument(for: image))
+      respondWith(image, nil)
     }
   }
 
@@ -138,15 +300,14 @@ extension ServerController {
    * Database Create Query Builder. Adds the object to the db and updates in revision number
    *
    * - parameter object: JSONConvertible/Codable object
-   * - parameter database: Database instance
+   * - parameter database: Database backend
    * - parameter callback: Callback to use within async method.
    */
-  func createObject<T: JSONConvertible>(object: T, database: Database, callback: @escaping (T?, RequestError?) -> Void) {
+  func createObject<T: JSONConvertible>(object: T, database: DatabaseBackend, callback: @escaping (T?, RequestError?) -> Void) {
     do {
       let data = try self.encoder.encode(object)
-      let json = SwiftyJSON.JSON(data: data)
 
-      database.create(json) { _, revision, _, error in
+      database.create(document: data) { revision, error in
 
         guard error == nil, let revision = revision else {
           Log.error("Failed to add user to the system of records.")
@@ -154,6 +315,9 @@ extension ServerController {
           return
         }
 
+        // Conditional GETs must not be answered from before this write
+        self.changesFeed.markStale()
+
         var object = object
         object.rev = revision
 
@@ -173,57 +337,30 @@ extension ServerController {
    - returns: URL as a String
    */
   func generateUrl(forContainer containerName: String, forImage imageName: String) -> String {
-    //let url = "http://\(database.connProperties.host):\(database.connProperties.port)/\(database.name)/\(imageId)/\(attachmentName)"
-    //let url = "\(config.appEnv.url)/images/\(imageId)/\(attachmentName)"
-    let baseURL = "https://dal.objectstorage.open.softlayer.com/v1/AUTH_\(objStorageConnProps.projectID)"
-    let url = "\(baseURL)/\(containerName)/\(imageName)"
-    return url
+    return blobStore.url(forObject: imageName, inContainer: containerName)
   }
 
   /**
-   Method that actually creates a container with the Object Storage service.
+   Method that creates a container, configured for public access, in the blob store.
 
    - parameter name: name of the container to create
    - parameter completionHandler: callback to use on success or failure
    */
   func createContainer(withName name: String, completionHandler: @escaping (_ success: Bool) -> Void) {
-    // Cofigure container for public access and web hosting
-    let configureContainer = { (container: ObjectStorageContainer) -> Void in
-      let metadata: Dictionary = [
-        "X-Container-Meta-Web-Listings": "true",
-        "X-Container-Read": ".r:*,.rlistings"
-      ]
-      container.updateMetadata(metadata: metadata) { error in
-        if error != nil {
-          Log.error("Could not configure container named '\(name)' for public access and web hosting.")
-          completionHandler(false)
-        } else {
-          Log.verbose("Configured successfully container named '\(name)' for public access and web hosting.")
-          completionHandler(true)
-        }
-      }
+    // Skip the round-trips for containers already created and configured
+    if case .found = containerCache.lookup(name) {
+      completionHandler(true)
+      return
     }
 
-    // Create container
-    let createContainer = { (objStorage: ObjectStorage?) -> Void in
-      guard let objStorage = objStorage  else {
-        Log.verbose("Created successfully container named '\(name)'.")
+    blobStore.createContainer(named: name) { container in
+      guard let container = container else {
         completionHandler(false)
         return
       }
-
-      objStorage.createContainer(name: name) { error, container in
-        if let container = container, error == nil {
-          configureContainer(container)
-        } else {
-          Log.error("Could not create container named '\(name)'.")
-          completionHandler(false)
-        }
-      }
+      self.containerCache.store(container, named: name)
+      completionHandler(true)
     }
-
-    // Create, and configure container
-    objectStorageConn.getObjectStorage(completionHandler: createContainer)
   }
 
   /**
@@ -241,11 +378,12 @@ extension ServerController {
       return
     }
 
-    let storeImage = { (container: ObjectStorageContainer) -> Void in
-      container.storeObject(name: image.fileName, data: imageData) { error, _ in
+    let storeImage = { (container: BlobContainer) -> Void in
+      container.storeObject(name: image.fileName, data: imageData, metadata: [:]) { error in
         if let error = error {
           Log.error("\(error)")
           Log.error("Could not save image named '\(image.fileName)' in container.")
+          self.containerCache.invalidate(image.userId)
           completionHandler(false)
         } else {
           Log.verbose("Stored successfully image '\(image.fileName)' in container.")
@@ -254,25 +392,43 @@ extension ServerController {
       }
     }
 
-    // Get reference to container
-    let retrieveContainer = { (objStorage: ObjectStorage?) -> Void in
-      guard let objStorage = objStorage else {
+    retrieveContainer(named: image.userId) { container in
+      guard let container = container else {
         completionHandler(false)
         return
       }
+      storeImage(container)
+    }
+  }
 
-      Log.debug("retrieving container: \(image.userId)")
-      objStorage.retrieveContainer(name: image.userId) { error, container in
-        if let container = container, error == nil {
-          storeImage(container)
-        } else {
-          Log.error("Could not find container named '\(image.fileName)'.")
-          completionHandler(false)
-        }
-      }
+  /**
+   Method to get a reference to an existing container, served from the container
+   cache when possible.
+
+   - parameter name:              name of the container
+   - parameter completionHandler: callback receiving the container, or nil on failure
+   */
+  func retrieveContainer(named name: String, completionHandler: @escaping (BlobContainer?) -> Void) {
+    switch containerCache.lookup(name) {
+    case .found(let container):
+      completionHandler(container)
+      return
+    case .missing:
+      Log.verbose("Container named '\(name)' recently not found.")
+      completionHandler(nil)
+      return
+    case .unknown:
+      break
     }
 
-    // Create, and configure container
-    objectStorageConn.getObjectStorage(completionHandler: retrieveContainer)
+    blobStore.retrieveContainer(named: name) { container, error in
+      if let container = container {
+        self.containerCache.store(container, named: name)
+      } else if case .some(BlobStoreError.containerNotFound) = error {
+        // Only a definite "not found" is remembered; an outage is retried on the next request
+        self.containerCache.storeMissing(name)
+      }
+      completionHandler(container)
+    }
   }
 }
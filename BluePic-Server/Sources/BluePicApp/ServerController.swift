@@ -21,7 +21,6 @@ import CouchDB
 import LoggerAPI
 import SwiftyJSON
 import BluemixAppID
-import BluemixPushNotifications
 import Credentials
 import Configuration
 import CredentialsFacebook
@@ -42,12 +41,26 @@ public class ServerController {
 
   public let router = Router()
 
-  let database: Database
-
-  let cloudFunctionsProps: CloudFunctionsCredentials
-  var objectStorageConn: ObjectStorageConn
-  let pushNotificationsClient: PushNotifications
-  let objStorageConnProps: ObjectStorageCredentials
+  let database: DatabaseBackend
+  let blobStore: BlobStore
+  let notifier: Notifier
+
+  /// The blob store when it is held in memory, whose objects the server serves itself
+  let servedBlobStore: InMemoryBlobStore?
+
+  /// Nil when Cloud Functions is not configured, in which case images are not processed
+  let cloudFunctionsProps: CloudFunctionsCredentials?
+  let containerCache: ContainerCache
+  let pushCoalescer: PushCoalescer
+  let settings: ServerSettings
+  let imageCache: ImageCache
+  let tagCounts = TagCountTable()
+  let changesFeed: ChangesFeed
+  let processingJournal: ProcessingJournal?
+  private(set) var processingDispatcher: ProcessingDispatcher!
+  let metrics = MetricsRegistry()
+  let cloudFunctionsMetrics: OperationMetrics
+  let traces: TraceRecorder
 
   // Instance constants
   let cloudEnv: CloudEnv = CloudEnv()
@@ -69,6 +82,9 @@ public class ServerController {
   let kUsersPath = "/users"
   let kImagesPath = "/images"
   let kPushPath = "/push/images"
+  let kBlobsPath = "/blobs"
+  let kMetricsPath = "/metrics"
+  let kTracesPath = "/traces"
 
   public var port: Int {
     return cloudEnv.port
@@ -76,33 +92,73 @@ public class ServerController {
 
   public init() throws {
 
-    guard let couchDBCredentials = cloudEnv.getCloudantCredentials(name: "cloudant-credentials"),
-      let objStoreCredentials = cloudEnv.getObjectStorageCredentials(name: "object-storage-credentials"),
-      // let appIdCredentials = cloudEnv.getAppIDCredentials(name: "app-id-credentials"),
-      let pushCredentials = cloudEnv.getPushSDKCredentials(name: "app-push-credentials"),
-      let cloudFunctionsCredentials = cloudEnv.getCloudFunctionsCredentials(name: "cloud-functions-credentials") else {
-
-        throw BluePicError.IO("Failed to obtain appropriate credentials.")
+    // let appIdCredentials = cloudEnv.getAppIDCredentials(name: "app-id-credentials")
+    settings = ServerSettings(cloudEnv: cloudEnv)
+
+    // Instantiate Objects, recording the latency of every call to them
+    let cloud = (database: settings.databaseBackend == .cloud,
+                 blobStore: settings.blobStoreBackend == .cloud,
+                 notifier: settings.notifierBackend == .cloud)
+    database = try InstrumentedDatabase(ServerController.makeDatabase(settings: settings, cloudEnv: cloudEnv),
+                                        dependency: cloud.database ? "cloudant" : "memory_database",
+                                        registry: metrics)
+    let blobBackend = try ServerController.makeBlobStore(settings: settings, cloudEnv: cloudEnv)
+    servedBlobStore = blobBackend as? InMemoryBlobStore
+    blobStore = InstrumentedBlobStore(blobBackend,
+                                      dependency: cloud.blobStore ? "object_storage" : "memory_blob_store",
+                                      registry: metrics)
+    notifier = try InstrumentedNotifier(ServerController.makeNotifier(settings: settings, cloudEnv: cloudEnv),
+                                        dependency: cloud.notifier ? "push_notifications" : "memory_notifier",
+                                        registry: metrics)
+    cloudFunctionsMetrics = metrics.dependency("cloud_functions", operation: "invoke")
+    traces = TraceRecorder(capacity: settings.traceCapacity)
+
+    if let cloudFunctionsCredentials = cloudEnv.getCloudFunctionsCredentials(name: "cloud-functions-credentials"),
+      !cloudFunctionsCredentials.hostName.isEmpty {
+      cloudFunctionsProps = cloudFunctionsCredentials
+    } else {
+      Log.warning("Cloud Functions is not configured; uploaded images will not be processed.")
+      cloudFunctionsProps = nil
     }
 
-    cloudFunctionsProps = cloudFunctionsCredentials
-    objStorageConnProps = objStoreCredentials
+    imageCache = ImageCache(capacity: settings.imageCacheCapacity)
+    changesFeed = ChangesFeed(database: database,
+                              timeout: settings.changesFeedTimeout,
+                              includeDocs: settings.tagCountsEnabled)
 
-    // Instantiate Objects
-    let couchDBConnProps = ConnectionProperties(host: couchDBCredentials.host,
-                                                port: Int16(couchDBCredentials.port),
-                                                secured: true,
-                                                username: couchDBCredentials.username,
-                                                password: couchDBCredentials.password)
+    containerCache = ContainerCache(capacity: settings.containerCacheCapacity,
+                                    negativeTTL: settings.containerNegativeTTL)
 
-    let dbClient = CouchDBClient(connectionProperties: couchDBConnProps)
-    database = dbClient.database("bluepic_db")
+    pushCoalescer = PushCoalescer(notifier: notifier, window: settings.pushCoalesceWindow)
 
-    objectStorageConn = ObjectStorageConn(credentials: objStoreCredentials)
+    if settings.processingJournalPath.isEmpty {
+      processingJournal = nil
+    } else {
+      do {
+        processingJournal = try ProcessingJournal(path: settings.processingJournalPath)
+      } catch {
+        Log.error("\(error)")
+        processingJournal = nil
+      }
+    }
 
-    pushNotificationsClient = PushNotifications(bluemixRegion: PushNotifications.Region.US_SOUTH,
-                                                bluemixAppGuid: pushCredentials.appGuid,
-                                                bluemixAppSecret: pushCredentials.appSecret)
+    // Retries back off for up to a minute each, so the buckets run well past the request latency ones
+    let processingLatency = metrics.histogram(name: "bluepic_processing_queue_duration_seconds",
+                                              help: "Time from queuing an image for processing to its invocation being accepted.",
+                                              buckets: [0.01, 0.05, 0.1, 0.5, 1, 2.5, 5, 10, 30, 60, 120, 300])
+    processingDispatcher = ProcessingDispatcher(maxInFlight: settings.processingMaxInFlight,
+                                                batchSize: settings.processingBatchSize,
+                                                queueCapacity: settings.processingQueueCapacity,
+                                                maxRetries: settings.processingMaxRetries,
+                                                retryDelay: settings.processingRetryDelay,
+                                                latency: processingLatency) { [unowned self] imageIds, documents, completion in
+      self.invokeProcessing(imageIds: imageIds, documents: documents) { success in
+        if success {
+          self.processingJournal?.recordDone(imageIds: imageIds)
+        }
+        completion(success)
+      }
+    }
     /*
     let options = [
       "clientId": appIdCredentials.clientId,
@@ -115,11 +171,179 @@ public class ServerController {
     webCredentialsPlugin = WebAppKituraCredentialsPlugin(options: options)
      */
 
-    router.all("/", middleware: StaticFileServer(path: "./BluePic-Web"))
+    // Registered first, so a request is timed through every other middleware
+    if settings.metricsEnabled {
+      router.all(middleware: RouteMetricsMiddleware(registry: metrics, routes: routePatterns))
+    }
+
+    if settings.compressionEnabled {
+      router.all(middleware: ResponseCompressionMiddleware(threshold: settings.compressionThreshold,
+                                                           level: settings.compressionLevel))
+    }
+
+    let webAssets = StaticFileServer.Options(cacheOptions: StaticFileServer.CacheOptions(maxAgeCacheControlHeader: settings.staticMaxAge))
+    router.all("/", middleware: PrecompressedFileServer(path: "./BluePic-Web", maxAge: settings.staticMaxAge))
+    router.all("/", middleware: HTMLRevalidationMiddleware())
+    router.all("/", middleware: StaticFileServer(path: "./BluePic-Web", options: webAssets))
 
     // setupAuth()
     // setupMiddleware()
     setupRoutes()
+    setupMetrics()
+    setupChangesFeed()
+    replayProcessingJournal()
+  }
+
+  /// Database selected by the settings, with the in-memory one loaded from the seed files
+  private static func makeDatabase(settings: ServerSettings, cloudEnv: CloudEnv) throws -> DatabaseBackend {
+    switch settings.databaseBackend {
+    case .memory:
+      let database = InMemoryDatabase()
+      for path in settings.databaseSeedFiles {
+        do {
+          try database.load(contentsOf: URL(fileURLWithPath: path))
+        } catch {
+          throw BluePicError.IO("Failed to load documents from '\(path)': \(error)")
+        }
+      }
+      return database
+
+    case .cloud:
+      guard let couchDBCredentials = cloudEnv.getCloudantCredentials(name: "cloudant-credentials") else {
+        throw BluePicError.IO("Failed to obtain Cloudant credentials.")
+      }
+      let couchDBConnProps = ConnectionProperties(host: couchDBCredentials.host,
+                                                  port: Int16(couchDBCredentials.port),
+                                                  secured: settings.databaseSecured,
+                                                  username: couchDBCredentials.username,
+                                                  password: couchDBCredentials.password)
+
+      let dbClient = CouchDBClient(connectionProperties: couchDBConnProps)
+      return CouchDBBackend(database: dbClient.database("bluepic_db"))
+    }
+  }
+
+  /// Blob store selected by the settings
+  private static func makeBlobStore(settings: ServerSettings, cloudEnv: CloudEnv) throws -> BlobStore {
+    switch settings.blobStoreBackend {
+    case .memory:
+      return InMemoryBlobStore(baseURL: cloudEnv.url)
+
+    case .cloud:
+      guard let objStoreCredentials = cloudEnv.getObjectStorageCredentials(name: "object-storage-credentials") else {
+        throw BluePicError.IO("Failed to obtain Object Storage credentials.")
+      }
+      return ObjectStorageBlobStore(credentials: objStoreCredentials)
+    }
+  }
+
+  /// Notifier selected by the settings
+  private static func makeNotifier(settings: ServerSettings, cloudEnv: CloudEnv) throws -> Notifier {
+    switch settings.notifierBackend {
+    case .memory:
+      return InMemoryNotifier()
+
+    case .cloud:
+      guard let pushCredentials = cloudEnv.getPushSDKCredentials(name: "app-push-credentials") else {
+        throw BluePicError.IO("Failed to obtain Push Notifications credentials.")
+      }
+      return PushNotificationsNotifier(credentials: pushCredentials)
+    }
+  }
+
+  /// Publishes the cache and image processing statistics alongside the latencies
+  private func setupMetrics() {
+    metrics.addCollector(name: "bluepic_cache_entries", type: .gauge,
+                         help: "Entries held by each cache.") { [imageCache, containerCache] in
+      [(["cache": "image"], Double(imageCache.stats.count)),
+       (["cache": "container"], Double(containerCache.stats.count))]
+    }
+    metrics.addCollector(name: "bluepic_cache_lookups_total", type: .counter,
+                         help: "Cache lookups by result.") { [imageCache, containerCache] in
+      let image = imageCache.stats
+      let container = containerCache.stats
+      return [(["cache": "image", "result": "hit"], Double(image.hits)),
+              (["cache": "image", "result": "miss"], Double(image.misses)),
+              (["cache": "container", "result": "hit"], Double(container.hits)),
+              (["cache": "container", "result": "miss"], Double(container.misses))]
+    }
+    metrics.addCollector(name: "bluepic_cache_evictions_total", type: .counter,
+                         help: "Entries evicted from each cache.") { [imageCache, containerCache] in
+      [(["cache": "image"], Double(imageCache.stats.evictions)),
+       (["cache": "container"], Double(containerCache.stats.evictions))]
+    }
+
+    metrics.addCollector(name: "bluepic_processing_jobs", type: .gauge,
+                         help: "Image processing jobs by state.") { [weak self] in
+      guard let stats = self?.processingDispatcher.stats else {
+        return []
+      }
+      return [(["state": "queued"], Double(stats.queueDepth)),
+              (["state": "in_flight"], Double(stats.inFlight)),
+              (["state": "retrying"], Double(stats.retrying))]
+    }
+    metrics.addCollector(name: "bluepic_processing_jobs_finished_total", type: .counter,
+                         help: "Image processing jobs by outcome.") { [weak self] in
+      guard let stats = self?.processingDispatcher.stats else {
+        return []
+      }
+      return [(["outcome": "completed"], Double(stats.completed)),
+              (["outcome": "failed"], Double(stats.failed)),
+              (["outcome": "dropped"], Double(stats.dropped))]
+    }
+  }
+
+  /// Hands jobs that were not processed before the last shutdown back to the dispatcher
+  private func replayProcessingJournal() {
+    guard let imageIds = processingJournal?.pendingImageIds, !imageIds.isEmpty else {
+      return
+    }
+    Log.info("Replaying \(imageIds.count) unfinished image processing jobs.")
+    imageIds.forEach { processingDispatcher.enqueue(imageId: $0) }
+  }
+
+  private func setupChangesFeed() {
+    if imageCache.isEnabled {
+      changesFeed.subscribe(onChange: { [imageCache] change in
+        imageCache.invalidate(id: change.id, documentType: change.doc?.type)
+      }, onReset: { [imageCache] in
+        imageCache.removeAll()
+      })
+    }
+
+    if settings.tagCountsEnabled {
+      changesFeed.subscribe(onChange: { [tagCounts] change in
+        if change.deleted {
+          tagCounts.update(imageId: change.id, labels: [])
+        } else if let doc = change.doc, doc.type == "image" {
+          tagCounts.update(imageId: change.id, labels: doc.tagLabels)
+        }
+      }, onReset: { [weak self] in
+        // The feed already follows from a sequence, so changes made while seeding are not lost
+        if let generation = self?.tagCounts.reset() {
+          self?.seedTagCounts(generation: generation)
+        }
+      })
+    }
+
+    guard imageCache.isEnabled || settings.tagCountsEnabled || settings.conditionalGetEnabled else {
+      return
+    }
+    // Tag counts are seeded when the feed first resets, once it knows the sequence it follows from
+    changesFeed.start()
+  }
+
+  /// Loads the per-image tags from the tags view into the in-memory tag counts
+  private func seedTagCounts(generation: Int) {
+    let params: [Database.QueryParameters] = [.reduce(false)]
+    readByView(View.tags, params: params, type: TagAssignment.self, database: database) { assignments, error in
+      guard let assignments = assignments, error == nil else {
+        Log.error("Failed to seed tag counts; popular tags will be read from the tags view.")
+        return
+      }
+      self.tagCounts.seed(with: assignments, generation: generation)
+      Log.verbose("Seeded tag counts from \(assignments.count) image tags.")
+    }
   }
 
   private func setupAuth() {
@@ -169,17 +393,63 @@ public class ServerController {
   private func setupRoutes() {
     Log.verbose("Defining routes for server...")
 
+    if settings.conditionalGetEnabled {
+      let conditionalGet = ConditionalGetMiddleware { [changesFeed] in changesFeed.currentSequence }
+      router.get(kImagesPath, middleware: conditionalGet)
+      router.get(kTagsPath, middleware: conditionalGet)
+      router.get(kUsersPath, middleware: conditionalGet)
+    }
+
     router.get(kPingPath, handler: ping)
     router.get(kUsersPath + "/:userId/images", handler: getImagesForUser)
     router.get(kImagesPath, handler: getImage)
     router.get(kImagesPath, handler: getImages)
-    router.get(kImagesPath + "/tag", handler: getImagesByTag)
+    router.get(kImagesPath + "/tag/:tag", handler: getImagesByTag)
     router.post(kImagesPath, handler: postImage)
+    router.post(kImagesPath + "/upload", handler: postImageBinary)
+    router.post(kImagesPath + "/batch", middleware: BodySizeLimitMiddleware(maxSize: settings.maxBatchUploadSize))
+    router.post(kImagesPath + "/batch", handler: postImages)
     router.get(kTagsPath, handler: getTags)
     router.get(kUsersPath, handler: getUsers)
     router.get(kUsersPath, handler: getUser)
     router.post(kUsersPath, handler: postUser)
     router.post(kPushPath + "/:imageId", handler: sendPushNotification)
+
+    if servedBlobStore != nil {
+      router.get(kBlobsPath + "/:container/:object", handler: getBlob)
+    }
+
+    if settings.metricsEnabled {
+      router.get(kMetricsPath, handler: getMetrics)
+    }
+
+    if traces.isEnabled {
+      router.get(kTracesPath, handler: getTraces)
+      router.get(kTracesPath + "/:traceId", handler: getTraces)
+    }
+  }
+
+  /// Method and pattern of each route, most specific first, which request latencies are recorded under
+  private var routePatterns: [(method: RouterMethod, path: String)] {
+    return [
+      (.get, kPingPath),
+      (.get, kUsersPath + "/:userId/images"),
+      (.get, kImagesPath + "/tag/:tag"),
+      (.get, kImagesPath + "/:id"),
+      (.get, kImagesPath),
+      (.post, kImagesPath + "/upload"),
+      (.post, kImagesPath + "/batch"),
+      (.post, kImagesPath),
+      (.get, kTagsPath),
+      (.get, kUsersPath + "/:id"),
+      (.get, kUsersPath),
+      (.post, kUsersPath),
+      (.post, kPushPath + "/:imageId"),
+      (.get, kBlobsPath + "/:container/:object"),
+      (.get, kMetricsPath),
+      (.get, kTracesPath + "/:traceId"),
+      (.get, kTracesPath)
+    ]
   }
 }
 
@@ -199,7 +469,31 @@ extension ServerController: ServerProtocol {
     next()
   }
 
-  /// Route for getting all image documents for a given user.
+  /// Route serving the metrics in the Prometheus text format
+  func getMetrics(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
+    response.headers["Content-Type"] = "text/plain; version=0.0.4; charset=utf-8"
+    response.status(.OK).send(metrics.render())
+    next()
+  }
+
+  /**
+   Route serving image processing traces as Chrome trace event JSON, which
+   chrome://tracing and Perfetto open. `/traces/:traceId` serves one trace,
+   looked up by trace id or image id; `/traces` serves every retained trace.
+   */
+  func getTraces(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
+    guard let trace = traces.chromeTrace(id: request.parameters["traceId"]) else {
+      response.status(.notFound)
+      next()
+      return
+    }
+
+    response.headers["Content-Type"] = "application/json"
+    response.status(.OK).send(data: trace)
+    next()
+  }
+
+  /// Route for getting a page of image documents for a given user.
   func getImagesForUser(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
     guard let userId = request.parameters["userId"] else {
       response.error = BluePicLocalizedError.missingUserId
@@ -207,22 +501,98 @@ extension ServerController: ServerProtocol {
       return
     }
 
+    guard let page = PageRequest(request: request, settings: settings, keyPrefix: [userId]),
+      let shape = FeedShape(request: request) else {
+      response.status(.badRequest)
+      next()
+      return
+    }
+
     let anyUserId = userId as Database.KeyType
     let queryParams: [Database.QueryParameters] = [
-      .endKey([anyUserId, "0" as Database.KeyType]),
-      .startKey([anyUserId, NSObject()])
+      .endKey([anyUserId, "0" as Database.KeyType])
     ]
-    self.readByView(View.images_per_user, params: queryParams, type: Image.self, database: database) { images, error in
-      guard let images = images, error == nil else {
-        Log.error("\(error ?? .notFound)")
-        return
-      }
+    switch shape {
+    case .embedded:
+      streamPageByView(View.images_per_user, params: queryParams, startKey: [anyUserId, NSObject()], page: page,
+                       type: Image.self, database: database, response: response, next: next)
+    case .normalized:
+      streamNormalizedPage(View.images_per_user, params: queryParams, startKey: [anyUserId, NSObject()], page: page,
+                           database: database, response: response, next: next)
+    }
+  }
 
-      response.status(.OK).send(json: images)
+  /// Route for getting a page of all images
+  func getImages(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
+    guard let page = PageRequest(request: request, settings: settings),
+      let shape = FeedShape(request: request) else {
+      response.status(.badRequest)
       next()
+      return
+    }
+
+    let params: [Database.QueryParameters] = [.includeDocs(true)]
+    switch shape {
+    case .embedded:
+      streamPageByView(View.images, params: params, page: page, type: Image.self, database: database,
+                       response: response, next: next)
+    case .normalized:
+      streamNormalizedPage(View.image_docs, params: params, page: page, database: database,
+                           response: response, next: next)
     }
   }
 
+  /// Route for getting a page of images with a specific tag
+  func getImagesByTag(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
+    guard let tagParam = request.parameters["tag"] else {
+      response.status(.badRequest)
+      next()
+      return
+    }
+
+    let tag = StringUtils.decodeWhiteSpace(inString: tagParam)
+    guard let page = PageRequest(request: request, settings: settings, keyPrefix: [tag]),
+      let shape = FeedShape(request: request) else {
+      response.status(.badRequest)
+      next()
+      return
+    }
+
+    let anyTag = tag as Database.KeyType
+    let zeroKey = "0" as Database.KeyType
+
+    switch shape {
+    case .embedded:
+      let queryParams: [Database.QueryParameters] = [
+        .includeDocs(true),
+        .reduce(false),
+        .endKey([anyTag, zeroKey, zeroKey, NSNumber(integerLiteral: 0)])
+      ]
+      streamPageByView(View.images_by_tag, params: queryParams, startKey: [anyTag, NSObject()], page: page,
+                       type: Image.self, database: database, response: response, next: next)
+    case .normalized:
+      let queryParams: [Database.QueryParameters] = [
+        .includeDocs(true),
+        .endKey([anyTag, zeroKey])
+      ]
+      streamNormalizedPage(View.image_docs_by_tag, params: queryParams, startKey: [anyTag, NSObject()], page: page,
+                           database: database, response: response, next: next)
+    }
+  }
+
+  /// Route for getting a page of user documents.
+  func getUsers(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
+    guard let page = PageRequest(request: request, settings: settings) else {
+      response.status(.badRequest)
+      next()
+      return
+    }
+
+    let params: [Database.QueryParameters] = [ .includeDocs(false) ]
+    streamPageByView(View.users, params: params, page: page, type: User.self, database: database,
+                     response: response, next: next)
+  }
+
   ///                ///
   /// Codable Routes ///
   ///                ///
@@ -230,6 +600,11 @@ extension ServerController: ServerProtocol {
   /// Route for getting the most popular tags
   func getTags(respondWith: @escaping ([String]?, RequestError?) -> Void) {
 
+    if tagCounts.isSeeded {
+      respondWith(tagCounts.top(settings.popularTagCount).map { $0.key }, nil)
+      return
+    }
+
     let params: [Database.QueryParameters] = [.group(true), .groupLevel(1)]
 
     readByView(View.tags, params: params, type: PopularTag.self, database: database) { tags, error in
@@ -241,8 +616,8 @@ extension ServerController: ServerProtocol {
       // Sort tags in descending order
       tags = tags.sorted { $0.value > $1.value }
 
-      // Slice tags array (max number of items is 10)
-      if tags.count > 10 { tags = Array(tags[0...9]) }
+      // Slice tags array
+      if tags.count > self.settings.popularTagCount { tags = Array(tags.prefix(self.settings.popularTagCount)) }
 
       respondWith(tags.map { $0.key }, nil)
     }
@@ -253,55 +628,45 @@ extension ServerController: ServerProtocol {
     readImage(database: database, imageId: id, callback: respondWith)
   }
 
-  /// Route for getting all images
-  func getImages(respondWith: @escaping ([Image]?, RequestError?) -> Void) {
-    let params: [Database.QueryParameters] = [.includeDocs(true)]
-    readByView(View.images, params: params, type: Image.self, database: database, callback: respondWith)
-  }
-
-  /// Route for getting images with a specific tag
-  func getImagesByTag(tag: String, respondWith: @escaping ([Image]?, RequestError?) -> Void) {
-    let tag = StringUtils.decodeWhiteSpace(inString: tag)
-    let anyTag = tag as Database.KeyType
-    let zeroKey = "0" as Database.KeyType
-    let queryParams: [Database.QueryParameters] = [
-      .includeDocs(true),
-      .reduce(false),
-      .endKey([anyTag, zeroKey, zeroKey, NSNumber(integerLiteral: 0)]),
-      .startKey([anyTag, NSObject()])
-    ]
-    readByView(View.images_by_tag, params: queryParams, type: Image.self, database: database, callback: respondWith)
-  }
-
   /// Route for creating a new image
   func postImage(image: Image, respondWith: @escaping (Image?, RequestError?) -> Void) {
-    do {
-      let completionHandler = { (success: Bool) -> Void in
-
-        guard success else {
-          Log.error("Failed to create image record in Cloudant database.")
-          respondWith(nil, .internalServerError)
-          return
-        }
+    let started = Date()
+    var image = image
+    image.contentHash = image.image.map(ContentHasher.hash)
 
-        var image = image
-        image.url = self.generateUrl(forContainer: image.userId, forImage: image.fileName)
+    let storeAndCreate = {
+      do {
+        let completionHandler = { (success: Bool) -> Void in
 
-        self.createObject(object: image, database: self.database) { image, error in
-          guard let image = image, error == nil else {
+          guard success else {
+            Log.error("Failed to create image record in Cloudant database.")
             respondWith(nil, .internalServerError)
             return
           }
 
-          self.processImage(withId: image.id)  // Contine processing of image (async request for CloudFunctions)
-          respondWith(image, nil)
+          self.createImageRecord(image, uploadStep: "postImage", uploadStarted: started, respondWith: respondWith)
         }
+        // Create container for user before creating image record in database
+        try self.store(image: image, completionHandler: completionHandler)
+      } catch {
+        Log.error("\(error)")
+        respondWith(nil, .internalServerError)
       }
-      // Create container for user before creating image record in database
-      try store(image: image, completionHandler: completionHandler)
-    } catch {
-      Log.error("\(error)")
-      respondWith(nil, .internalServerError)
+    }
+
+    // A photo uploaded before is neither stored nor classified again
+    guard let contentHash = image.contentHash else {
+      storeAndCreate()
+      return
+    }
+    findImage(withContentHash: contentHash) { original in
+      guard let original = original, original.url != nil else {
+        storeAndCreate()
+        return
+      }
+      Log.verbose("Image '\(image.fileName)' duplicates image '\(original.id)'.")
+      self.createImageRecord(image, duplicateOf: original, uploadStep: "postImage", uploadStarted: started,
+                             respondWith: respondWith)
     }
   }
 
@@ -320,12 +685,6 @@ extension ServerController: ServerProtocol {
     }
   }
 
-  /// Route for getting all user documents.
-  func getUsers(respondWith: @escaping ([User]?, RequestError?) -> Void) {
-    let params: [Database.QueryParameters] = [ .includeDocs(false) ]
-    readByView(View.users, params: params, type: User.self, database: database, callback: respondWith)
-  }
-
   /// Route for creating a new user
   func postUser(user: User, respondWith: @escaping (User?, RequestError?) -> Void) {
 
@@ -362,9 +721,18 @@ extension ServerController: ServerProtocol {
     createContainer(withName: user.id, completionHandler: completionHandler)
   }
 
-  /// Route for sending a push notification
+  /**
+   Route for sending a push notification once an image has been processed.
+
+   The route is not authenticated, so the device and the payload always come from the
+   stored image document. The processed document the sequence may post as the body is
+   only a hint: when its revision is newer than the cached one, the cached image is
+   dropped and read back. Notifications are merged per device by the push coalescer,
+   so this responds as soon as the image is queued.
+   */
   func sendPushNotification(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws {
 
+    let started = Date()
     guard let imageId = request.parameters["imageId"] else {
       response.status(.badRequest)
       response.send(NotificationStatus(status: false))
@@ -372,48 +740,47 @@ extension ServerController: ServerProtocol {
       return
     }
 
-    readImage(database: database, imageId: imageId) { image, error in
+    // The processing actions send their spans along with the trace id
+    let traceId = request.headers[TraceRecorder.traceIdHeader] ?? traces.traceId(forImage: imageId)
+    if let traceId = traceId, let spans = request.headers[TraceRecorder.spansHeader] {
       do {
-        guard let image = image, let deviceId = image.deviceId, error == nil else {
-          throw error ?? .internalServerError
-        }
-
-        let data = try self.encoder.encode(image)
-        let json = try JSONSerialization.jsonObject(with: data, options: .mutableContainers)
-
-        guard let dict = json as? [String: Any] else {
-          throw BluePicLocalizedError.getImagesFailed(imageId)
-        }
-
-        let apnsSettings = Notification.Settings.Apns(
-          badge: nil,
-          interactiveCategory: "imageProcessed",
-          iosActionKey: nil,
-          sound: nil,
-          type: ApnsType.DEFAULT,
-          payload: dict
-        )
-
-        let target = Notification.Target(deviceIds: [deviceId], userIds: nil, platforms: nil, tagNames: nil)
-        let message = Notification.Message(alert: "Your image was processed; check it out!", url: nil)
-        let notification = Notification(message: message, target: target, apnsSettings: apnsSettings, gcmSettings: nil)
-
-        self.pushNotificationsClient.send(notification: notification) { error in
-          if let error = error {
-            Log.error("\(error)")
-            response.status(.internalServerError)
-            response.send(NotificationStatus(status: false))
-          } else {
-            response.send(NotificationStatus(status: true))
-          }
-          next()
-        }
+        try traces.record(decoder.decode([TraceSpan].self, from: Data(spans.utf8)), traceId: traceId)
       } catch {
-        Log.error("\(error)")
+        Log.warning("Ignoring malformed trace spans for image \(imageId): \(error)")
+      }
+    }
+
+    let queueNotification = { (image: Image?, error: RequestError?) -> Void in
+      guard let image = image, let deviceId = image.deviceId, error == nil else {
+        Log.error("\(error ?? .internalServerError)")
         response.status(.internalServerError)
         response.send(NotificationStatus(status: false))
         next()
+        return
       }
+
+      var sent: (() -> Void)?
+      if let traceId = traceId {
+        let queued = Date()
+        sent = { self.traces.record("pushNotification", traceId: traceId, start: queued) }
+        self.traces.record("sendPushNotification", traceId: traceId, start: started)
+      }
+      self.pushCoalescer.add(image, deviceId: deviceId, sent: sent)
+      response.send(NotificationStatus(status: true))
+      next()
+    }
+
+    let postedRevision = (try? request.read(as: Image.self)).flatMap { $0.id == imageId ? $0.rev : nil }
+    readImage(database: database, imageId: imageId) { image, error in
+      guard let image = image, let revision = postedRevision, revision != image.rev else {
+        queueNotification(image, error)
+        return
+      }
+
+      // The cache still holds the image from before processing wrote it back
+      self.imageCache.invalidate(id: imageId, documentType: "image")
+      self.readImage(database: self.database, imageId: imageId, callback: queueNotification)
     }
   }
+
 }
@@ -25,13 +25,15 @@ protocol ServerProtocol {
 
   func ping(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws
   func getImagesForUser(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws
+  func getImages(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws
+  func getImagesByTag(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws
+  func getUsers(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws
   func sendPushNotification(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws
+  func postImageBinary(request: RouterRequest, response: RouterResponse, next: @escaping () -> Void) throws
 
   func getTags(respondWith: @escaping ([String]?, RequestError?) -> Void)
   func getImage(id: String, respondWith: @escaping (Image?, RequestError?) -> Void)
-  func getImages(respondWith: @escaping ([Image]?, RequestError?) -> Void)
   func postImage(image: Image, respondWith: @escaping (Image?, RequestError?) -> Void)
   func postUser(user: User, respondWith: @escaping (User?, RequestError?) -> Void)
-  func getUsers(respondWith: @escaping ([User]?, RequestError?) -> Void)
   func getUser(id: String, respondWith: @escaping (User?, RequestError?) -> Void)
 }
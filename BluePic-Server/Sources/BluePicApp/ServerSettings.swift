@@ -0,0 +1,184 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import CloudEnvironment
+
+/// Implementation behind one of the services the server depends on
+enum BackendKind: String {
+
+  /// The IBM Cloud service whose credentials are configured
+  case cloud
+
+  /// A stand-in kept in process memory, which starts empty on every launch
+  case memory
+}
+
+/// Tunable server settings, read from the "bluepic-settings" mapping.
+/// Every value falls back to a sensible default when absent.
+struct ServerSettings {
+
+  /// Number of items returned by list routes when no limit is requested
+  let defaultPageSize: Int
+
+  /// Largest page size a client may request
+  let maxPageSize: Int
+
+  /// Number of decoded images kept in memory; 0 disables the cache
+  let imageCacheCapacity: Int
+
+  /// Long poll timeout of the database changes feed, in milliseconds
+  let changesFeedTimeout: Int
+
+  /// Whether tag popularity is counted in memory instead of queried from the tags view
+  let tagCountsEnabled: Bool
+
+  /// Number of tags returned by the popular tags route
+  let popularTagCount: Int
+
+  /// Largest image body accepted by the binary upload route, in bytes
+  let maxUploadSize: Int
+
+  /// Size of the segments a binary upload is streamed to object storage in, in bytes
+  let uploadSegmentSize: Int
+
+  /// Number of user containers remembered as existing; 0 disables the cache
+  let containerCacheCapacity: Int
+
+  /// How long a missing container is remembered, in seconds
+  let containerNegativeTTL: TimeInterval
+
+  /// Number of image processing invocations outstanding at once
+  let processingMaxInFlight: Int
+
+  /// Largest number of images sent in one processing invocation; 1 disables batching
+  let processingBatchSize: Int
+
+  /// Number of images that may wait for a processing invocation
+  let processingQueueCapacity: Int
+
+  /// Number of times a failed processing invocation is retried
+  let processingMaxRetries: Int
+
+  /// Delay before the first processing retry, doubled for every later one, in seconds
+  let processingRetryDelay: TimeInterval
+
+  /// Journal of image processing jobs replayed at startup; empty disables it
+  let processingJournalPath: String
+
+  /// Whether new image documents are sent with their processing invocation, sparing the sequence a read
+  let processingSendsDocuments: Bool
+
+  /// How long "image processed" notifications are collected before each device's are merged and sent, in seconds
+  let pushCoalesceWindow: TimeInterval
+
+  /// Whether read routes send ETags and answer If-None-Match from the database update sequence
+  let conditionalGetEnabled: Bool
+
+  /// Whether JSON responses are compressed for clients that accept it
+  let compressionEnabled: Bool
+
+  /// Smallest JSON response that is compressed, in bytes
+  let compressionThreshold: Int
+
+  /// zlib compression level, 1 (fastest) to 9 (smallest)
+  let compressionLevel: Int
+
+  /// How long clients may cache the static web assets other than HTML pages, in seconds
+  let staticMaxAge: Int
+
+  /// Whether the database is reached over TLS
+  let databaseSecured: Bool
+
+  /// Where documents are stored
+  let databaseBackend: BackendKind
+
+  /// Where image binaries are stored
+  let blobStoreBackend: BackendKind
+
+  /// How push notifications are delivered
+  let notifierBackend: BackendKind
+
+  /// JSON files of documents loaded into the in-memory database at startup
+  let databaseSeedFiles: [String]
+
+  /// Whether request latencies are recorded per route and served with the other metrics at /metrics
+  let metricsEnabled: Bool
+
+  /// Number of image processing traces kept for /traces; zero turns tracing off
+  let traceCapacity: Int
+
+  /// Largest number of images accepted by one batch upload
+  let maxBatchSize: Int
+
+  /// Largest request body accepted by the batch upload route, in bytes
+  let maxBatchUploadSize: Int
+
+  /// Number of image binaries of a batch upload stored at once
+  let batchUploadConcurrency: Int
+
+  /// Whether an upload whose SHA-256 matches an earlier image reuses that image's binary and tags
+  let uploadDeduplicationEnabled: Bool
+
+  init(dictionary: [String: Any] = [:]) {
+    maxPageSize = max(1, dictionary["maxPageSize"] as? Int ?? 200)
+    defaultPageSize = min(maxPageSize, max(1, dictionary["defaultPageSize"] as? Int ?? 50))
+    imageCacheCapacity = max(0, dictionary["imageCacheCapacity"] as? Int ?? 10000)
+    changesFeedTimeout = max(1000, dictionary["changesFeedTimeout"] as? Int ?? 60000)
+    tagCountsEnabled = dictionary["tagCountsEnabled"] as? Bool ?? true
+    popularTagCount = max(1, dictionary["popularTagCount"] as? Int ?? 10)
+    maxUploadSize = max(1, dictionary["maxUploadSize"] as? Int ?? 20 * 1024 * 1024)
+    uploadSegmentSize = max(64 * 1024, dictionary["uploadSegmentSize"] as? Int ?? 1024 * 1024)
+    containerCacheCapacity = max(0, dictionary["containerCacheCapacity"] as? Int ?? 10000)
+    containerNegativeTTL = max(0, ServerSettings.interval(dictionary["containerNegativeTTL"]) ?? 30)
+    processingMaxInFlight = max(1, dictionary["processingMaxInFlight"] as? Int ?? 16)
+    processingBatchSize = max(1, dictionary["processingBatchSize"] as? Int ?? 1)
+    processingQueueCapacity = max(1, dictionary["processingQueueCapacity"] as? Int ?? 10000)
+    processingMaxRetries = max(0, dictionary["processingMaxRetries"] as? Int ?? 5)
+    processingRetryDelay = max(0, ServerSettings.interval(dictionary["processingRetryDelay"]) ?? 1)
+    processingJournalPath = dictionary["processingJournalPath"] as? String ?? "processing.journal"
+    processingSendsDocuments = dictionary["processingSendsDocuments"] as? Bool ?? true
+    pushCoalesceWindow = max(0, ServerSettings.interval(dictionary["pushCoalesceWindow"]) ?? 5)
+    conditionalGetEnabled = dictionary["conditionalGetEnabled"] as? Bool ?? true
+    compressionEnabled = dictionary["compressionEnabled"] as? Bool ?? true
+    compressionThreshold = max(0, dictionary["compressionThreshold"] as? Int ?? 1024)
+    compressionLevel = min(9, max(1, dictionary["compressionLevel"] as? Int ?? 6))
+    staticMaxAge = max(0, dictionary["staticMaxAge"] as? Int ?? 86400)
+    databaseSecured = dictionary["databaseSecured"] as? Bool ?? true
+    databaseBackend = BackendKind(rawValue: dictionary["databaseBackend"] as? String ?? "") ?? .cloud
+    blobStoreBackend = BackendKind(rawValue: dictionary["blobStoreBackend"] as? String ?? "") ?? .cloud
+    notifierBackend = BackendKind(rawValue: dictionary["notifierBackend"] as? String ?? "") ?? .cloud
+    databaseSeedFiles = dictionary["databaseSeedFiles"] as? [String] ?? []
+    metricsEnabled = dictionary["metricsEnabled"] as? Bool ?? true
+    traceCapacity = max(0, dictionary["traceCapacity"] as? Int ?? 1000)
+    maxBatchSize = max(1, dictionary["maxBatchSize"] as? Int ?? 100)
+    maxBatchUploadSize = max(1, dictionary["maxBatchUploadSize"] as? Int ?? 100 * 1024 * 1024)
+    batchUploadConcurrency = max(1, dictionary["batchUploadConcurrency"] as? Int ?? 8)
+    uploadDeduplicationEnabled = dictionary["uploadDeduplicationEnabled"] as? Bool ?? true
+  }
+
+  /// Reads a number of seconds that may have been given as an integer or a decimal
+  private static func interval(_ value: Any?) -> TimeInterval? {
+    if let seconds = value as? Double {
+      return seconds
+    }
+    return (value as? Int).map { TimeInterval($0) }
+  }
+
+  init(cloudEnv: CloudEnv) {
+    self.init(dictionary: cloudEnv.getDictionary(name: "bluepic-settings") ?? [:])
+  }
+}
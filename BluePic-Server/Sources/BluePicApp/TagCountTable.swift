@@ -0,0 +1,225 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+
+/// Binary heap ordered by `areInIncreasingOrder`, with the smallest element on top
+struct Heap<Element> {
+
+  private var elements = [Element]()
+  private let areInIncreasingOrder: (Element, Element) -> Bool
+
+  init(areInIncreasingOrder: @escaping (Element, Element) -> Bool) {
+    self.areInIncreasingOrder = areInIncreasingOrder
+  }
+
+  var count: Int {
+    return elements.count
+  }
+
+  var top: Element? {
+    return elements.first
+  }
+
+  mutating func push(_ element: Element) {
+    elements.append(element)
+    var child = elements.count - 1
+    while child > 0 {
+      let parent = (child - 1) / 2
+      guard areInIncreasingOrder(elements[child], elements[parent]) else {
+        break
+      }
+      elements.swapAt(child, parent)
+      child = parent
+    }
+  }
+
+  @discardableResult
+  mutating func pop() -> Element? {
+    guard !elements.isEmpty else {
+      return nil
+    }
+    elements.swapAt(0, elements.count - 1)
+    let popped = elements.removeLast()
+
+    var parent = 0
+    while true {
+      let left = 2 * parent + 1
+      let right = left + 1
+      var candidate = parent
+      if left < elements.count && areInIncreasingOrder(elements[left], elements[candidate]) {
+        candidate = left
+      }
+      if right < elements.count && areInIncreasingOrder(elements[right], elements[candidate]) {
+        candidate = right
+      }
+      if candidate == parent {
+        break
+      }
+      elements.swapAt(parent, candidate)
+      parent = candidate
+    }
+    return popped
+  }
+}
+
+/// One image/tag pair as emitted by the tags view without reduction
+struct TagAssignment {
+  let imageId: String
+  let label: String
+  var rev: String?
+}
+
+extension TagAssignment: JSONConvertible {
+
+  enum CodingKeys: String, CodingKey {
+    case imageId = "id"
+    case label = "key"
+    case rev
+  }
+
+  static func decode(rowsFrom rows: inout UnkeyedDecodingContainer, hasDocs: Bool) throws -> TagAssignment? {
+    return try rows.decode(TagAssignment.self)
+  }
+}
+
+/**
+ In-memory count of images per tag, seeded once from the tags view and then
+ kept up to date from the database changes feed.
+
+ The labels of every image are tracked so that a change can be applied as a
+ delta against what was previously counted for that image. The top tags are
+ selected with a bounded heap and memoized until the counts next change.
+ */
+final class TagCountTable {
+
+  private let queue = DispatchQueue(label: "tagCountTableQueue")
+  private var counts = [String: Int]()
+  private var labelsByImage = [String: [String]]()
+  private var topTags: [PopularTag]?
+  private var seeded = false
+
+  /// Bumped by every reset, so a seed read before it is not applied after it
+  private var generation = 0
+
+  /// Images the changes feed updated since the last reset, while the table is not yet seeded
+  private var changedBeforeSeed = Set<String>()
+
+  /// Whether the table has been seeded and can answer queries
+  var isSeeded: Bool {
+    return queue.sync { seeded }
+  }
+
+  /**
+   Seeds the table from the rows of the tags view, read after the reset that
+   returned `generation`. Images the changes feed updated in the meantime keep
+   what the feed reported, including having no labels, since the feed is at least
+   as recent as the view. A seed read before a later reset is dropped.
+   */
+  func seed(with assignments: [TagAssignment], generation: Int) {
+    var seedLabels = [String: [String]]()
+    for assignment in assignments {
+      seedLabels[assignment.imageId, default: []].append(assignment.label)
+    }
+
+    queue.sync {
+      guard generation == self.generation else {
+        return
+      }
+      for (imageId, labels) in seedLabels where !changedBeforeSeed.contains(imageId) {
+        apply(labels: labels, toImage: imageId)
+      }
+      changedBeforeSeed.removeAll()
+      seeded = true
+    }
+  }
+
+  /// Replaces the counted labels of an image; deleted images have no labels
+  func update(imageId: String, labels: [String]) {
+    queue.sync {
+      if !seeded {
+        changedBeforeSeed.insert(imageId)
+      }
+      apply(labels: labels, toImage: imageId)
+    }
+  }
+
+  /// Forgets every count, until the table is seeded again, and returns the generation to seed with
+  @discardableResult
+  func reset() -> Int {
+    return queue.sync {
+      counts.removeAll()
+      labelsByImage.removeAll()
+      changedBeforeSeed.removeAll()
+      topTags = nil
+      seeded = false
+      generation += 1
+      return generation
+    }
+  }
+
+  /// The `k` tags with the most images, most popular first
+  func top(_ k: Int) -> [PopularTag] {
+    return queue.sync {
+      if let topTags = topTags, topTags.count >= min(k, counts.count) {
+        return Array(topTags.prefix(k))
+      }
+
+      // Min-heap of the best k so far; ties are broken alphabetically
+      let isLessPopular = { (lhs: PopularTag, rhs: PopularTag) -> Bool in
+        lhs.value != rhs.value ? lhs.value < rhs.value : lhs.key > rhs.key
+      }
+      var heap = Heap<PopularTag>(areInIncreasingOrder: isLessPopular)
+      for (label, count) in counts {
+        let tag = PopularTag(key: label, value: count, rev: nil)
+        if heap.count < k {
+          heap.push(tag)
+        } else if let least = heap.top, isLessPopular(least, tag) {
+          heap.pop()
+          heap.push(tag)
+        }
+      }
+
+      var selected = [PopularTag]()
+      while let tag = heap.pop() {
+        selected.append(tag)
+      }
+      selected.reverse()
+
+      topTags = selected
+      return selected
+    }
+  }
+
+  private func apply(labels: [String], toImage imageId: String) {
+    let previous = labelsByImage[imageId] ?? []
+    guard previous != labels else {
+      return
+    }
+
+    for label in previous {
+      let count = (counts[label] ?? 0) - 1
+      counts[label] = count > 0 ? count : nil
+    }
+    for label in labels {
+      counts[label, default: 0] += 1
+    }
+
+    labelsByImage[imageId] = labels.isEmpty ? nil : labels
+    topTags = nil
+  }
+}
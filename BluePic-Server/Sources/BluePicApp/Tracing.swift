@@ -0,0 +1,196 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+import LoggerAPI
+
+/// Timed step of a trace, coded with the field names of a Chrome trace event
+struct TraceSpan: Codable {
+  let name: String
+
+  /// Component that performed the step, such as "server" or "cloudFunctions"
+  let category: String
+
+  /// Start in microseconds since 1970, so spans from other hosts line up
+  let start: Int64
+
+  /// Duration in microseconds
+  let duration: Int64
+
+  enum CodingKeys: String, CodingKey {
+    case name
+    case category = "cat"
+    case start = "ts"
+    case duration = "dur"
+  }
+
+  init(name: String, category: String, start: Date, end: Date = Date()) {
+    self.name = name
+    self.category = category
+    self.start = Int64(start.timeIntervalSince1970 * 1_000_000)
+    duration = max(0, Int64(end.timeIntervalSince(start) * 1_000_000))
+  }
+}
+
+/**
+ Keeps the spans of the most recent image processing traces.
+
+ A trace starts when an uploaded image is stored, and its id travels with the
+ image through the Cloud Functions invocation and back with the callback that
+ triggers the push notification. The actions report their spans with the
+ callback, so one trace covers the whole time from upload to push. Spans are
+ timed against each host's clock, so steps on different hosts may appear
+ shifted by the clock skew between them.
+ */
+final class TraceRecorder {
+
+  /// Header carrying a trace id on the callback from Cloud Functions
+  static let traceIdHeader = "X-BluePic-Trace-Id"
+
+  /// Header carrying the JSON array of spans recorded by the Cloud Functions actions
+  static let spansHeader = "X-BluePic-Trace-Spans"
+
+  private struct Trace {
+    let imageId: String
+    var spans: [TraceSpan]
+  }
+
+  /// Most spans kept for one trace
+  static let maxSpansPerTrace = 256
+
+  /// Number of traces kept; zero disables recording
+  let capacity: Int
+
+  private let queue = DispatchQueue(label: "traceRecorderQueue")
+  private var traces = [String: Trace]()
+  private var traceIdsByImage = [String: String]()
+
+  /// Trace ids, oldest first
+  private var order = [String]()
+
+  init(capacity: Int) {
+    self.capacity = max(0, capacity)
+  }
+
+  var isEnabled: Bool {
+    return capacity > 0
+  }
+
+  /// Starts the trace of an image, returning its id
+  func startTrace(imageId: String) -> String {
+    let traceId = UUID().uuidString.replacingOccurrences(of: "-", with: "").lowercased()
+    if isEnabled {
+      queue.sync {
+        add(Trace(imageId: imageId, spans: []), traceId: traceId)
+      }
+    }
+    return traceId
+  }
+
+  /// Id of the retained trace of an image
+  func traceId(forImage imageId: String) -> String? {
+    return queue.sync { traceIdsByImage[imageId] }
+  }
+
+  /**
+   Adds spans to a trace started by `startTrace(imageId:)`. Spans for a trace id
+   this server did not start, or which is no longer retained, are dropped, as are
+   spans past `maxSpansPerTrace`, since callers outside the server can send them.
+   */
+  func record(_ spans: [TraceSpan], traceId: String) {
+    guard isEnabled, !spans.isEmpty else {
+      return
+    }
+    queue.sync {
+      guard let count = traces[traceId]?.spans.count, count < TraceRecorder.maxSpansPerTrace else {
+        return
+      }
+      traces[traceId]?.spans.append(contentsOf: spans.prefix(TraceRecorder.maxSpansPerTrace - count))
+    }
+  }
+
+  /// Records a step of the server that started at `start` and has just ended
+  func record(_ name: String, traceId: String, start: Date) {
+    record([TraceSpan(name: name, category: "server", start: start)], traceId: traceId)
+  }
+
+  /**
+   Renders traces in the Chrome trace event format, each trace as a process
+   and each component as a thread of it.
+
+   - parameter id: trace id or image id of the trace to render; all retained traces when nil
+   - returns: the JSON document, or nil if the trace is not retained
+   */
+  func chromeTrace(id: String? = nil) -> Data? {
+    let selected: [(String, Trace)] = queue.sync {
+      let traceIds = id.map { [traceIdsByImage[$0] ?? $0] } ?? order
+      var selected = [(String, Trace)]()
+      for traceId in traceIds {
+        if let trace = traces[traceId] {
+          selected.append((traceId, trace))
+        }
+      }
+      return selected
+    }
+    guard id == nil || !selected.isEmpty else {
+      return nil
+    }
+
+    var events = [[String: Any]]()
+    for (index, entry) in selected.enumerated() {
+      let (traceId, trace) = entry
+      let pid = index + 1
+      let name = "trace \(traceId) (image \(trace.imageId))"
+      events.append(["name": "process_name", "ph": "M", "pid": pid, "args": ["name": name]])
+
+      var tids = [String: Int]()
+      for span in trace.spans.sorted(by: { $0.start < $1.start }) {
+        let tid: Int
+        if let known = tids[span.category] {
+          tid = known
+        } else {
+          tid = tids.count + 1
+          tids[span.category] = tid
+          events.append(["name": "thread_name", "ph": "M", "pid": pid, "tid": tid, "args": ["name": span.category]])
+        }
+        events.append(["name": span.name, "cat": span.category, "ph": "X",
+                       "ts": Int(span.start), "dur": Int(span.duration), "pid": pid, "tid": tid, "args": ["traceId": traceId]])
+      }
+    }
+
+    do {
+      return try JSONSerialization.data(withJSONObject: ["traceEvents": events, "displayTimeUnit": "ms"], options: [])
+    } catch {
+      Log.error("\(error)")
+      return nil
+    }
+  }
+
+  /// Adds a trace, dropping the oldest past capacity. Must be called on `queue`.
+  private func add(_ trace: Trace, traceId: String) {
+    traces[traceId] = trace
+    order.append(traceId)
+    traceIdsByImage[trace.imageId] = traceId
+
+    while order.count > capacity {
+      let evicted = order.removeFirst()
+      if let imageId = traces.removeValue(forKey: evicted)?.imageId, traceIdsByImage[imageId] == evicted {
+        traceIdsByImage[imageId] = nil
+      }
+    }
+  }
+}
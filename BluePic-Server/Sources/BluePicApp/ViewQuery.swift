@@ -0,0 +1,248 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import CouchDB
+import LoggerAPI
+
+/// Options applied while decoding the rows of a view response
+struct ViewDecodingOptions {
+
+  static let userInfoKey = CodingUserInfoKey(rawValue: "viewDecodingOptions")!
+
+  /// Whether rows carry an `include_docs` document
+  let hasDocs: Bool
+
+  /// Maximum number of objects to decode; the row that follows is kept as the next page cursor.
+  /// Objects whose rows decode to nothing, such as an image without its user, count toward it,
+  /// so a page that is short of them still ends with a cursor.
+  let limit: Int?
+}
+
+/// Single element of a view key
+enum ViewKeyElement: Decodable {
+  case string(String)
+  case int(Int)
+  case double(Double)
+  case object
+
+  init(from decoder: Decoder) throws {
+    let container = try decoder.singleValueContainer()
+    if let string = try? container.decode(String.self) {
+      self = .string(string)
+    } else if let int = try? container.decode(Int.self) {
+      self = .int(int)
+    } else if let double = try? container.decode(Double.self) {
+      self = .double(double)
+    } else {
+      self = .object
+    }
+  }
+
+  var value: Any {
+    switch self {
+    case .string(let string): return string
+    case .int(let int): return NSNumber(value: int)
+    case .double(let double): return NSNumber(value: double)
+    case .object: return [String: Any]()
+    }
+  }
+}
+
+/// Key and document id of a view row, used to resume a view query at that row
+struct ViewRowHead: Decodable {
+  let id: String?
+  let key: [ViewKeyElement]
+
+  enum CodingKeys: String, CodingKey {
+    case id
+    case key
+  }
+
+  init(from decoder: Decoder) throws {
+    let values = try decoder.container(keyedBy: CodingKeys.self)
+    id = try values.decodeIfPresent(String.self, forKey: .id)
+    if let key = try? values.decode([ViewKeyElement].self, forKey: .key) {
+      self.key = key
+    } else {
+      self.key = [try values.decode(ViewKeyElement.self, forKey: .key)]
+    }
+  }
+
+  var cursor: PageCursor {
+    return PageCursor(startKey: key.map { $0.value }, startKeyDocId: id)
+  }
+}
+
+/// View row whose object lives in the emitted value
+struct ValueRow<T: Decodable>: Decodable {
+  let value: T
+}
+
+/// View row whose object lives in the `include_docs` document; a missing document decodes as nil
+struct DocRow<T: Decodable>: Decodable {
+  let doc: T?
+
+  enum CodingKeys: String, CodingKey {
+    case doc
+  }
+
+  init(from decoder: Decoder) throws {
+    let values = try decoder.container(keyedBy: CodingKeys.self)
+    doc = try? values.decode(T.self, forKey: .doc)
+  }
+}
+
+/// Objects decoded from a view response in a single pass over its rows
+struct ViewResult<T: JSONConvertible>: Decodable {
+  let items: [T]
+  let nextCursor: PageCursor?
+
+  enum CodingKeys: String, CodingKey {
+    case rows
+  }
+
+  init(from decoder: Decoder) throws {
+    let options = decoder.userInfo[ViewDecodingOptions.userInfoKey] as? ViewDecodingOptions
+      ?? ViewDecodingOptions(hasDocs: false, limit: nil)
+
+    let values = try decoder.container(keyedBy: CodingKeys.self)
+    var rows = try values.nestedUnkeyedContainer(forKey: .rows)
+
+    var items = [T]()
+    var nextCursor: PageCursor?
+    var groups = 0
+    while !rows.isAtEnd {
+      if let limit = options.limit, groups >= limit {
+        nextCursor = try rows.decode(ViewRowHead.self).cursor
+        break
+      }
+      if let item = try T.decode(rowsFrom: &rows, hasDocs: options.hasDocs) {
+        items.append(item)
+      }
+      groups += 1
+    }
+
+    self.items = items
+    self.nextCursor = nextCursor
+  }
+}
+
+extension Database.QueryParameters {
+
+  /// Name and JSON encoded value of the parameter as expected by the CouchDB view API
+  var queryItem: (String, String)? {
+    switch self {
+    case .descending(let value): return ("descending", "\(value)")
+    case .includeDocs(let value): return ("include_docs", "\(value)")
+    case .group(let value): return ("group", "\(value)")
+    case .groupLevel(let value): return ("group_level", "\(value)")
+    case .reduce(let value): return ("reduce", "\(value)")
+    case .inclusiveEnd(let value): return ("inclusive_end", "\(value)")
+    case .limit(let value): return ("limit", "\(value)")
+    case .skip(let value): return ("skip", "\(value)")
+    case .startKey(let key): return ("startkey", Database.QueryParameters.encode(key: key))
+    case .endKey(let key): return ("endkey", Database.QueryParameters.encode(key: key))
+    case .keys(let keys): return ("keys", "[" + keys.map { Database.QueryParameters.encode(element: $0) }
+                                                   .joined(separator: ",") + "]")
+    case .startKeyDocID(let id): return ("startkey_docid", Database.QueryParameters.encode(element: id as Database.KeyType))
+    case .endKeyDocID(let id): return ("endkey_docid", Database.QueryParameters.encode(element: id as Database.KeyType))
+    default:
+      Log.warning("Unsupported view query parameter: \(self)")
+      return nil
+    }
+  }
+
+  /// Single element keys are sent as scalars, matching the CouchDB client
+  private static func encode(key: [Database.KeyType]) -> String {
+    if key.count == 1 {
+      return encode(element: key[0])
+    }
+    return "[" + key.map { encode(element: $0) }.joined(separator: ",") + "]"
+  }
+
+  private static func encode(element: Database.KeyType) -> String {
+    switch element {
+    case let string as String:
+      guard let data = try? JSONSerialization.data(withJSONObject: [string], options: []),
+        let array = String(data: data, encoding: .utf8) else {
+          return "\"\""
+      }
+      return String(array.dropFirst().dropLast())
+    case let number as NSNumber:
+      return "\(number)"
+    case let int as Int:
+      return "\(int)"
+    case let double as Double:
+      return "\(double)"
+    default:
+      return "{}"
+    }
+  }
+}
+
+extension ServerController {
+
+  /**
+   * Queries a view of the main design document and decodes the raw response bytes
+   * straight into model objects, without an intermediate JSON tree.
+   *
+   * - parameter view: View to query
+   * - parameter params: Database.QueryParameters
+   * - parameter limit: Maximum number of objects to read, skipped ones included, if paginating
+   * - parameter type: Type of the object being returned
+   * - parameter database: Database backend
+   * - parameter callback: Callback to use within async method.
+   */
+  func queryView<T: JSONConvertible>(_ view: View,
+                                     params: [Database.QueryParameters],
+                                     limit: Int? = nil,
+                                     type: T.Type,
+                                     database: DatabaseBackend,
+                                     callback: @escaping (ViewResult<T>?, Error?) -> Void) {
+
+    let options = ViewDecodingOptions(hasDocs: params.includesDocs, limit: limit)
+
+    database.queryView(view, params: params) { body, error in
+      do {
+        guard let body = body, error == nil else {
+          throw error ?? BluePicLocalizedError.readDocumentFailed
+        }
+
+        let data = try body.readAll()
+
+        let decoder = JSONDecoder()
+        decoder.userInfo[ViewDecodingOptions.userInfoKey] = options
+        callback(try decoder.decode(ViewResult<T>.self, from: data), nil)
+      } catch {
+        callback(nil, error)
+      }
+    }
+  }
+}
+
+extension Array where Element == Database.QueryParameters {
+
+  /// Whether the parameters ask for `include_docs`
+  var includesDocs: Bool {
+    return contains {
+      switch $0 {
+      case .includeDocs(let x): return x == true
+      default: return false
+      }
+    }
+  }
+}
@@ -0,0 +1,274 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import CouchDB
+import Kitura
+import LoggerAPI
+
+/**
+ Splits a CouchDB view response into its rows as bytes arrive.
+
+ CouchDB writes the header (`{"total_rows":..,"rows":[`), every row and the
+ closing `]}` on separate lines. When a response does not follow that layout
+ the splitter keeps the whole body so it can be decoded in one go instead.
+ */
+struct ViewRowSplitter {
+
+  private static let newline = UInt8(ascii: "\n")
+
+  private var pending = Data()
+  private var sawHeader = false
+  private var sawFooter = false
+
+  /// Whole response body, kept only when the response is not line delimited
+  private(set) var unsplitBody: Data?
+
+  /// Feeds a chunk of the response body, returning the rows it completed
+  mutating func append(_ chunk: Data) -> [Data] {
+    if unsplitBody != nil {
+      unsplitBody?.append(chunk)
+      return []
+    }
+
+    pending.append(chunk)
+
+    var rows = [Data]()
+    while let newlineIndex = pending.index(of: ViewRowSplitter.newline) {
+      let line = pending.subdata(in: pending.startIndex..<newlineIndex)
+      pending.removeSubrange(pending.startIndex...newlineIndex)
+      if let row = consume(line: line) {
+        rows.append(row)
+      }
+      if unsplitBody != nil {
+        unsplitBody?.append(pending)
+        pending = Data()
+        break
+      }
+    }
+    return rows
+  }
+
+  /// Flushes the final, unterminated line of the response
+  mutating func finish() -> [Data] {
+    guard unsplitBody == nil, !pending.isEmpty else {
+      return []
+    }
+    let line = pending
+    pending = Data()
+    return consume(line: line).map { [$0] } ?? []
+  }
+
+  private mutating func consume(line: Data) -> Data? {
+    guard let text = String(data: line, encoding: .utf8)?.trimmingCharacters(in: .whitespacesAndNewlines),
+      !text.isEmpty, !sawFooter else {
+        return nil
+    }
+
+    guard sawHeader else {
+      if text.hasSuffix("\"rows\":[") {
+        sawHeader = true
+      } else {
+        unsplitBody = line + Data([ViewRowSplitter.newline])
+      }
+      return nil
+    }
+
+    if text.hasPrefix("]") {
+      sawFooter = true
+      return nil
+    }
+
+    return (text.hasSuffix(",") ? String(text.dropLast()) : text).data(using: .utf8)
+  }
+}
+
+/// The view rows spanned by a single object, decoded together so multi-row joins still apply
+struct RowGroup<T: JSONConvertible>: Decodable {
+  let item: T?
+
+  init(from decoder: Decoder) throws {
+    let options = decoder.userInfo[ViewDecodingOptions.userInfoKey] as? ViewDecodingOptions
+    var rows = try decoder.unkeyedContainer()
+    item = try T.decode(rowsFrom: &rows, hasDocs: options?.hasDocs ?? false)
+  }
+}
+
+/**
+ Builds a JSON array one element at a time, so no decoded result set is held.
+
+ The array is only handed to the response once it is complete: Kitura buffers
+ the response body until it ends anyway, and holding it here lets a failure
+ partway through be answered with an error instead of a truncated array.
+ */
+final class JSONArrayWriter {
+
+  private let encoder: JSONEncoder
+  private var data = Data("[".utf8)
+  private var count = 0
+
+  init(encoder: JSONEncoder) {
+    self.encoder = encoder
+  }
+
+  func write<T: Encodable>(_ element: T) throws {
+    let encoded = try encoder.encode(element)
+    if count > 0 {
+      data.append(contentsOf: ",".utf8)
+    }
+    data.append(encoded)
+    count += 1
+  }
+
+  /// Closes the array and returns it
+  func close() -> Data {
+    data.append(contentsOf: "]".utf8)
+    return data
+  }
+}
+
+extension ServerController {
+
+  /**
+   * Queries a view and hands each object to `onItem` as soon as its rows have been read,
+   * so callers never hold the decoded result set.
+   *
+   * - parameter view: View to query
+   * - parameter params: Database.QueryParameters
+   * - parameter limit: Maximum number of objects to read, skipped ones included, if paginating
+   * - parameter type: Type of the object being returned
+   * - parameter database: Database backend
+   * - parameter onItem: Called for every decoded object, in view order
+   * - parameter completion: Called once with the next page cursor, or the error that ended the stream
+   */
+  func streamView<T: JSONConvertible>(_ view: View,
+                                      params: [Database.QueryParameters],
+                                      limit: Int? = nil,
+                                      type: T.Type,
+                                      database: DatabaseBackend,
+                                      onItem: @escaping (T) throws -> Void,
+                                      completion: @escaping (PageCursor?, Error?) -> Void) {
+
+    let options = ViewDecodingOptions(hasDocs: params.includesDocs, limit: limit)
+    let rowsPerObject = T.rowsPerObject(hasDocs: options.hasDocs)
+
+    database.queryView(view, params: params) { body, error in
+      do {
+        guard let body = body, error == nil else {
+          throw error ?? BluePicLocalizedError.readDocumentFailed
+        }
+
+        let decoder = JSONDecoder()
+        decoder.userInfo[ViewDecodingOptions.userInfoKey] = options
+
+        var splitter = ViewRowSplitter()
+        var group = [Data]()
+        var groups = 0
+        var nextCursor: PageCursor?
+
+        // Returns false once the page is full; groups that decode to nothing count toward it,
+        // since the query only fetched enough rows for `limit` groups and the cursor row
+        let handle = { (rows: [Data]) throws -> Bool in
+          for row in rows {
+            if let limit = limit, groups >= limit {
+              nextCursor = try decoder.decode(ViewRowHead.self, from: row).cursor
+              return false
+            }
+
+            group.append(row)
+            guard group.count == rowsPerObject else {
+              continue
+            }
+
+            var groupData = Data("[".utf8)
+            groupData.append(contentsOf: group.joined(separator: Data(",".utf8)))
+            groupData.append(contentsOf: "]".utf8)
+            group.removeAll(keepingCapacity: true)
+
+            if let item = try decoder.decode(RowGroup<T>.self, from: groupData).item {
+              try onItem(item)
+            }
+            groups += 1
+          }
+          return true
+        }
+
+        var chunk = Data()
+        var reading = true
+        while reading, try body.read(into: &chunk) > 0 {
+          reading = try handle(splitter.append(chunk))
+          chunk.removeAll(keepingCapacity: true)
+        }
+        if reading {
+          _ = try handle(splitter.finish())
+        }
+
+        if let body = splitter.unsplitBody {
+          let result = try decoder.decode(ViewResult<T>.self, from: body)
+          try result.items.forEach(onItem)
+          nextCursor = result.nextCursor
+        }
+
+        completion(nextCursor, nil)
+      } catch {
+        completion(nil, error)
+      }
+    }
+  }
+
+  /**
+   * Streams one page of a view into a JSON array response, advertising the next page
+   * cursor in a response header. A failure partway through is answered with a 500 and
+   * no body.
+   *
+   * - parameter view: View to query
+   * - parameter params: Database.QueryParameters, excluding start key and limit
+   * - parameter startKey: Start key of the first page, if any
+   * - parameter page: Page size and cursor requested by the client
+   * - parameter type: Type of the object being returned
+   * - parameter database: Database backend
+   * - parameter response: RouterResponse to write to
+   * - parameter next: Next handler in the route chain
+   */
+  func streamPageByView<T: JSONConvertible>(_ view: View,
+                                            params: [Database.QueryParameters] = [],
+                                            startKey: [Database.KeyType]? = nil,
+                                            page: PageRequest,
+                                            type: T.Type,
+                                            database: DatabaseBackend,
+                                            response: RouterResponse,
+                                            next: @escaping () -> Void) {
+
+    let writer = JSONArrayWriter(encoder: encoder)
+
+    streamView(view, params: pageParams(params, startKey: startKey, page: page, type: type), limit: page.limit,
+               type: type, database: database, onItem: { try writer.write($0) }) { nextCursor, error in
+      if let error = error {
+        Log.error("\(error)")
+        response.status(.internalServerError)
+        next()
+        return
+      }
+
+      if let cursor = nextCursor?.encoded() {
+        response.headers[kNextCursorHeader] = cursor
+      }
+      response.headers["Content-Type"] = "application/json"
+      response.status(.OK).send(data: writer.close())
+      next()
+    }
+  }
+}
@@ -0,0 +1,139 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+
+/// Deterministic pseudo-random numbers, so every run loads and requests the same data
+struct SeededGenerator {
+
+  private var state: UInt64
+
+  init(seed: UInt64) {
+    state = seed &+ 0x9e3779b97f4a7c15
+  }
+
+  /// splitmix64
+  mutating func next() -> UInt64 {
+    state = state &+ 0x9e3779b97f4a7c15
+    var z = state
+    z = (z ^ (z >> 30)) &* 0xbf58476d1ce4e5b9
+    z = (z ^ (z >> 27)) &* 0x94d049bb133111eb
+    return z ^ (z >> 31)
+  }
+
+  mutating func next(below bound: Int) -> Int {
+    return Int(next() % UInt64(bound))
+  }
+
+  mutating func element<T>(of array: [T]) -> T {
+    return array[next(below: array.count)]
+  }
+}
+
+/// Synthetic users and images shaped like the documents BluePic stores
+struct Corpus {
+
+  struct User {
+    let id: String
+    let doc: [String: Any]
+  }
+
+  struct Image {
+    let id: String
+    let userId: String
+    let uploadedTs: String
+    let tags: [String]
+    let doc: [String: Any]
+  }
+
+  static let vocabulary = [
+    "mountain", "flower", "nature", "bridge", "building", "city", "cloudy sky", "garden", "lake", "person",
+    "sky", "tree", "water", "road", "car", "beach", "sunset", "snow", "forest", "river",
+    "animal", "dog", "cat", "bird", "food", "street", "night", "architecture", "boat", "field"
+  ]
+
+  static let places: [(name: String, latitude: Double, longitude: Double)] = [
+    ("Austin, Texas", 30.27, -97.74),
+    ("Boston, Massachusetts", 42.36, -71.06),
+    ("Tucson, Arizona", 32.22, -110.97),
+    ("Raleigh, North Carolina", 35.78, -78.64),
+    ("San Francisco, California", 37.77, -122.42)
+  ]
+
+  let users: [User]
+  let images: [Image]
+
+  init(userCount: Int, imageCount: Int, seed: UInt64 = 42) {
+    var generator = SeededGenerator(seed: seed)
+
+    users = (0..<max(1, userCount)).map { index in
+      let id = String(10000 + index)
+      return User(id: id, doc: ["_id": id, "name": "Bench User \(index)", "type": "user"])
+    }
+
+    let formatter = DateFormatter()
+    formatter.locale = Locale(identifier: "en_US_POSIX")
+    formatter.timeZone = TimeZone(identifier: "UTC")
+    formatter.dateFormat = "yyyy-MM-dd'T'HH:mm:ss"
+    let start = formatter.date(from: "2017-01-01T00:00:00")!
+
+    var images = [Image]()
+    for index in 0..<max(1, imageCount) {
+      let id = String(100000 + index)
+      let user = generator.element(of: users)
+      let uploadedTs = formatter.string(from: start.addingTimeInterval(Double(index * 137)))
+
+      var labels = [String]()
+      while labels.count < 3 {
+        // Squaring skews the distribution so a few tags are popular
+        let pick = generator.next(below: Corpus.vocabulary.count)
+        let label = Corpus.vocabulary[pick * pick / Corpus.vocabulary.count]
+        if !labels.contains(label) {
+          labels.append(label)
+        }
+      }
+
+      let place = generator.element(of: Corpus.places)
+      let doc: [String: Any] = [
+        "_id": id,
+        "fileName": "photo\(index).png",
+        "caption": "Benchmark photo \(index)",
+        "contentType": "image/png",
+        "url": "http://127.0.0.1/\(user.id)/photo\(index).png",
+        "width": 600 + generator.next(below: 600),
+        "height": 400 + generator.next(below: 600),
+        "tags": labels.enumerated().map { ["label": $1, "confidence": 90 - 10 * $0] },
+        "location": [
+          "name": place.name,
+          "latitude": place.latitude,
+          "longitude": place.longitude,
+          "weather": ["description": "Sunny", "temperature": 70, "iconId": 32]
+        ],
+        "uploadedTs": uploadedTs,
+        "userId": user.id,
+        "deviceId": "device-\(user.id)",
+        "type": "image"
+      ]
+      images.append(Image(id: id, userId: user.id, uploadedTs: uploadedTs, tags: labels, doc: doc))
+    }
+    self.images = images
+  }
+
+  /// Every document, in the form accepted by `_bulk_docs`
+  var bulkDocs: [String: Any] {
+    return ["docs": users.map { $0.doc } + images.map { $0.doc }]
+  }
+}
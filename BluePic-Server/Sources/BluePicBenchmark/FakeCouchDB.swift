@@ -0,0 +1,102 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Kitura
+import BluePicApp
+
+/**
+ Stand-in for CouchDB, serving an in-memory database over the parts of the
+ CouchDB API the server calls: database info, document creation, bulk
+ writes, the long polled changes feed and the views of the main design
+ document.
+
+ Running the server against it exercises the same HTTP client and decoding
+ path as running against Cloudant.
+ */
+final class FakeCouchDB {
+
+  let router = Router()
+
+  private let databaseName: String
+  private let database: InMemoryDatabase
+
+  init(databaseName: String, database: InMemoryDatabase) {
+    self.databaseName = databaseName
+    self.database = database
+    setupRoutes()
+  }
+
+  private func setupRoutes() {
+    let path = "/" + databaseName
+
+    router.get(path) { _, response, next in
+      response.headers["Content-Type"] = "application/json"
+      response.send("{\"db_name\":\"\(self.databaseName)\",\"update_seq\":\(self.database.currentSequence)}")
+      next()
+    }
+
+    router.post(path) { request, response, next in
+      var body = Data()
+      while try request.read(into: &body) > 0 {}
+
+      response.headers["Content-Type"] = "application/json"
+      do {
+        let (id, rev) = try self.database.createDocument(body)
+        response.status(.created).send("{\"ok\":true,\"id\":\"\(id)\",\"rev\":\"\(rev)\"}")
+      } catch {
+        response.status(.conflict).send("{\"error\":\"conflict\",\"reason\":\"Document update conflict.\"}")
+      }
+      next()
+    }
+
+    router.post(path + "/_bulk_docs") { request, response, next in
+      var body = Data()
+      while try request.read(into: &body) > 0 {}
+
+      response.headers["Content-Type"] = "application/json"
+      do {
+        response.status(.created).send(data: try self.database.bulkDocsResponse(body))
+      } catch {
+        response.status(.badRequest).send("{\"error\":\"bad_request\",\"reason\":\"Request body must be a JSON object with docs.\"}")
+      }
+      next()
+    }
+
+    router.get(path + "/_changes") { request, response, next in
+      let parameters = request.queryParameters
+      self.database.waitForChanges(since: parameters["since"] ?? "0",
+                                   timeout: parameters["timeout"].flatMap { Int($0) } ?? 60000,
+                                   includeDocs: parameters["include_docs"] == "true") { data in
+        response.headers["Content-Type"] = "application/json"
+        response.send(data: data)
+        next()
+      }
+    }
+
+    router.get(path + "/_design/main_design/_view/:view") { request, response, next in
+      response.headers["Content-Type"] = "application/json"
+      do {
+        let body = try self.database.viewResponse(named: request.parameters["view"] ?? "",
+                                                  query: request.queryParameters)
+        response.send(data: body)
+      } catch {
+        response.status(.badRequest).send("{\"error\":\"query_parse_error\",\"reason\":\"Invalid view query.\"}")
+      }
+      next()
+    }
+  }
+}
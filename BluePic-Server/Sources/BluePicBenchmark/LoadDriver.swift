@@ -0,0 +1,175 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import Dispatch
+import KituraNet
+
+/// A route exercised by the benchmark, with the paths to request drawn from the corpus
+struct BenchmarkRoute {
+  let name: String
+  let method: String
+  let headers: [String: String]
+  let path: (inout SeededGenerator) -> String
+  let body: ((inout SeededGenerator) -> Data)?
+
+  init(name: String, method: String = "GET", headers: [String: String] = [:],
+       body: ((inout SeededGenerator) -> Data)? = nil,
+       path: @escaping (inout SeededGenerator) -> String) {
+    self.name = name
+    self.method = method
+    self.headers = headers
+    self.path = path
+    self.body = body
+  }
+}
+
+/// Throughput and latency measured for one route
+struct RouteResult: Encodable {
+
+  struct Latency: Encodable {
+    let p50: Double
+    let p95: Double
+    let p99: Double
+    let max: Double
+    let mean: Double
+  }
+
+  let name: String
+  let requests: Int
+  let errors: Int
+  let concurrency: Int
+  let durationSeconds: Double
+  let requestsPerSecond: Double
+
+  /// In milliseconds
+  let latencyMs: Latency
+}
+
+/**
+ Drives one route at a time with a fixed number of concurrent clients, each
+ issuing requests back to back on its own thread.
+ */
+struct LoadDriver {
+
+  let port: Int16
+  let concurrency: Int
+  let requests: Int
+  let warmup: Int
+
+  func run(_ route: BenchmarkRoute) -> RouteResult {
+    // Warm caches and connections before measuring
+    var warmupGenerator = SeededGenerator(seed: 0)
+    for _ in 0..<warmup {
+      _ = send(route, generator: &warmupGenerator)
+    }
+
+    let workers = max(1, concurrency)
+    let group = DispatchGroup()
+    let lock = NSLock()
+    var latencies = [Double]()
+    var errors = 0
+
+    let start = DispatchTime.now()
+    for worker in 0..<workers {
+      // Spread the requests evenly, with the remainder going to the first workers
+      let count = requests / workers + (worker < requests % workers ? 1 : 0)
+      group.enter()
+      let thread = Thread {
+        var generator = SeededGenerator(seed: UInt64(worker + 1))
+        var workerLatencies = [Double]()
+        workerLatencies.reserveCapacity(count)
+        var workerErrors = 0
+
+        for _ in 0..<count {
+          let requestStart = DispatchTime.now()
+          let succeeded = self.send(route, generator: &generator)
+          let elapsed = DispatchTime.now().uptimeNanoseconds - requestStart.uptimeNanoseconds
+          workerLatencies.append(Double(elapsed) / 1_000_000)
+          if !succeeded {
+            workerErrors += 1
+          }
+        }
+
+        lock.lock()
+        latencies.append(contentsOf: workerLatencies)
+        errors += workerErrors
+        lock.unlock()
+        group.leave()
+      }
+      thread.start()
+    }
+    group.wait()
+    let duration = Double(DispatchTime.now().uptimeNanoseconds - start.uptimeNanoseconds) / 1_000_000_000
+
+    latencies.sort()
+    let percentile = { (fraction: Double) -> Double in
+      guard !latencies.isEmpty else {
+        return 0
+      }
+      // Nearest rank
+      let rank = Int((fraction * Double(latencies.count)).rounded(.up))
+      return latencies[min(latencies.count - 1, max(0, rank - 1))]
+    }
+
+    return RouteResult(name: route.name,
+                       requests: latencies.count,
+                       errors: errors,
+                       concurrency: workers,
+                       durationSeconds: duration,
+                       requestsPerSecond: duration > 0 ? Double(latencies.count) / duration : 0,
+                       latencyMs: RouteResult.Latency(p50: percentile(0.50),
+                                                      p95: percentile(0.95),
+                                                      p99: percentile(0.99),
+                                                      max: latencies.last ?? 0,
+                                                      mean: latencies.isEmpty ? 0 : latencies.reduce(0, +) / Double(latencies.count)))
+  }
+
+  /// Issues one request and waits for the whole response, returning whether it succeeded
+  func send(_ route: BenchmarkRoute, generator: inout SeededGenerator) -> Bool {
+    let path = route.path(&generator)
+    let body = route.body?(&generator)
+
+    var headers = route.headers
+    if let body = body {
+      headers["Content-Length"] = String(body.count)
+    }
+
+    var succeeded = false
+    let request = HTTP.request([
+      .method(route.method),
+      .schema("http://"),
+      .hostname("127.0.0.1"),
+      .port(port),
+      .path(path),
+      .headers(headers)
+    ]) { response in
+      guard let response = response else {
+        return
+      }
+      var data = Data()
+      _ = try? response.readAllData(into: &data)
+      succeeded = (200..<400).contains(response.statusCode.rawValue)
+    }
+
+    if let body = body {
+      request.end(body)
+    } else {
+      request.end()
+    }
+    return succeeded
+  }
+}
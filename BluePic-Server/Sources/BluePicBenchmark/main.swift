@@ -0,0 +1,281 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+/**
+ Load benchmark for the BluePic-Server routes.
+
+ Starts the router in-process with in-memory storage loaded with a synthetic
+ corpus, drives each route with concurrent clients and prints requests per
+ second and latency percentiles as JSON. The database is either served over
+ HTTP by a CouchDB stand-in, which exercises the same client path as Cloudant,
+ or used in-process, which leaves only routing, encoding and handler overhead.
+
+   swift build -c release
+   .build/release/BluePicBenchmark --concurrency 16 --requests 2000 --output results.json
+
+ Options (defaults in brackets):
+   --concurrency N   concurrent clients per route [8]
+   --requests N      measured requests per route [1000]
+   --warmup N        unmeasured requests per route [50]
+   --images N        images in the corpus [5000]
+   --users N         users in the corpus [100]
+   --routes a,b      names of the routes to run [all]
+   --database KIND   couchdb for the HTTP stand-in, memory for in-process [couchdb]
+   --upload-size N   bytes in each uploaded image [65536]
+   --dedup           let uploads, which all carry the same bytes, reuse the first stored copy
+   --gzip            send Accept-Encoding: gzip
+   --server-port N   port of the server under test [8090]
+   --couchdb-port N  port of the CouchDB stand-in [5985]
+   --output PATH     write the JSON report to a file instead of stdout
+ */
+
+import Foundation
+import Kitura
+import KituraNet
+import LoggerAPI
+import HeliumLogger
+import BluePicApp
+
+struct Options {
+  var concurrency = 8
+  var requests = 1000
+  var warmup = 50
+  var images = 5000
+  var users = 100
+  var routes: [String]?
+  var database = "couchdb"
+  var uploadSize = 65536
+  var dedup = false
+  var gzip = false
+  var serverPort = 8090
+  var couchDBPort = 5985
+  var output: String?
+
+  init(arguments: [String]) {
+    var remaining = arguments.dropFirst().makeIterator()
+    while let argument = remaining.next() {
+      let value = { () -> String in
+        guard let value = remaining.next() else {
+          Options.fail("Missing value for \(argument)")
+        }
+        return value
+      }
+      let number = { () -> Int in
+        let text = value()
+        guard let number = Int(text), number >= 0 else {
+          Options.fail("Invalid value '\(text)' for \(argument)")
+        }
+        return number
+      }
+
+      switch argument {
+      case "--concurrency": concurrency = max(1, number())
+      case "--requests": requests = number()
+      case "--warmup": warmup = number()
+      case "--images": images = max(1, number())
+      case "--users": users = max(1, number())
+      case "--routes": routes = value().components(separatedBy: ",")
+      case "--database": database = value()
+      case "--upload-size": uploadSize = max(1, number())
+      case "--dedup": dedup = true
+      case "--gzip": gzip = true
+      case "--server-port": serverPort = number()
+      case "--couchdb-port": couchDBPort = number()
+      case "--output": output = value()
+      default: Options.fail("Unknown option \(argument)")
+      }
+    }
+
+    if database != "couchdb" && database != "memory" {
+      Options.fail("Unknown database \(database); expected couchdb or memory")
+    }
+  }
+
+  static func fail(_ message: String) -> Never {
+    FileHandle.standardError.write((message + "\n").data(using: .utf8)!)
+    exit(2)
+  }
+}
+
+struct Report: Encodable {
+  let corpus: [String: Int]
+  let database: String
+  let gzip: Bool
+  let routes: [RouteResult]
+}
+
+HeliumLogger.use(LoggerMessageType.warning)
+
+let options = Options(arguments: CommandLine.arguments)
+let corpus = Corpus(userCount: options.users, imageCount: options.images)
+
+// Both databases load the corpus from the same file
+let seedFile = NSTemporaryDirectory() + "bluepic-benchmark-\(ProcessInfo.processInfo.processIdentifier).json"
+do {
+  try JSONSerialization.data(withJSONObject: corpus.bulkDocs, options: []).write(to: URL(fileURLWithPath: seedFile))
+} catch {
+  Options.fail("Could not write the corpus: \(error)")
+}
+var settings: [String: Any] = [
+  "blobStoreBackend": "memory",
+  "notifierBackend": "memory",
+  "changesFeedTimeout": 1000,
+  "processingJournalPath": "",
+  "uploadDeduplicationEnabled": options.dedup
+]
+var environment = [String: [String: Any]]()
+
+var fakeCouchDB: FakeCouchDB?
+var couchDBServer: HTTPServer?
+if options.database == "memory" {
+  settings["databaseBackend"] = "memory"
+  settings["databaseSeedFiles"] = [seedFile]
+} else {
+  let database = InMemoryDatabase()
+  do {
+    try database.load(contentsOf: URL(fileURLWithPath: seedFile))
+    let stub = FakeCouchDB(databaseName: "bluepic_db", database: database)
+    let server = HTTP.createServer()
+    server.delegate = stub.router
+    try server.listen(on: options.couchDBPort)
+    fakeCouchDB = stub
+    couchDBServer = server
+  } catch {
+    Options.fail("Could not start the CouchDB stand-in: \(error)")
+  }
+
+  settings["databaseBackend"] = "cloud"
+  settings["databaseSecured"] = false
+  environment["BLUEPIC_CLOUDANT"] = [
+    "username": "bench", "password": "bench", "host": "127.0.0.1",
+    "port": options.couchDBPort, "url": "http://127.0.0.1:\(options.couchDBPort)"
+  ]
+}
+
+// Cloud Functions is left unconfigured, so uploaded images are not sent for processing
+environment["BLUEPIC_SETTINGS"] = settings
+for (name, value) in environment {
+  let data = try JSONSerialization.data(withJSONObject: value, options: [])
+  setenv(name, String(data: data, encoding: .utf8)!, 1)
+}
+
+let serverController: ServerController
+do {
+  serverController = try ServerController()
+} catch {
+  Options.fail("Could not create the server: \(error)")
+}
+
+let server = HTTP.createServer()
+server.delegate = serverController.router
+do {
+  try server.listen(on: options.serverPort)
+} catch {
+  Options.fail("Could not start the server: \(error)")
+}
+
+// Let the changes feed and tag counts come up before measuring
+Thread.sleep(forTimeInterval: 2)
+
+let imageIds = corpus.images.map { $0.id }
+let userIds = corpus.users.map { $0.id }
+let tags = Corpus.vocabulary.map { $0.addingPercentEncoding(withAllowedCharacters: .urlPathAllowed) ?? $0 }
+let headers = options.gzip ? ["Accept-Encoding": "gzip"] : [:]
+var jsonHeaders = headers
+jsonHeaders["Content-Type"] = "application/json"
+var imageHeaders = headers
+imageHeaders["Content-Type"] = "image/png"
+
+var uploadGenerator = SeededGenerator(seed: 7)
+let imageData = Data((0..<options.uploadSize).map { _ in UInt8(truncatingIfNeeded: uploadGenerator.next()) })
+let encodedImage = imageData.base64EncodedString()
+
+/// Body of the JSON upload route, for a random user
+func postImageBody(_ generator: inout SeededGenerator) -> Data {
+  let userId = generator.element(of: userIds)
+  let fileName = "bench\(generator.next(below: 1_000_000)).png"
+  let json = "{\"fileName\":\"\(fileName)\",\"caption\":\"Benchmark upload\",\"width\":600,\"height\":400,"
+    + "\"userId\":\"\(userId)\",\"image\":\"\(encodedImage)\"}"
+  return Data(json.utf8)
+}
+
+let allRoutes = [
+  BenchmarkRoute(name: "ping", headers: headers) { _ in "/ping" },
+  BenchmarkRoute(name: "images", headers: headers) { _ in "/images" },
+  BenchmarkRoute(name: "imagesNormalized", headers: headers) { _ in "/images?shape=normalized" },
+  BenchmarkRoute(name: "image", headers: headers) { "/images/" + $0.element(of: imageIds) },
+  BenchmarkRoute(name: "imagesByTag", headers: headers) { "/images/tag/" + $0.element(of: tags) },
+  BenchmarkRoute(name: "imagesForUser", headers: headers) { "/users/" + $0.element(of: userIds) + "/images" },
+  BenchmarkRoute(name: "tags", headers: headers) { _ in "/tags" },
+  BenchmarkRoute(name: "users", headers: headers) { _ in "/users" },
+  BenchmarkRoute(name: "user", headers: headers) { "/users/" + $0.element(of: userIds) },
+  BenchmarkRoute(name: "postImage", method: "POST", headers: jsonHeaders, body: postImageBody) { _ in "/images" },
+  BenchmarkRoute(name: "uploadImage", method: "POST", headers: imageHeaders, body: { _ in imageData }) { generator in
+    "/images/upload?userId=\(generator.element(of: userIds))&fileName=bench\(generator.next(below: 1_000_000)).png"
+      + "&width=600&height=400&caption=Benchmark%20upload"
+  }
+]
+
+let selectedRoutes = allRoutes.filter { options.routes?.contains($0.name) ?? true }
+if selectedRoutes.isEmpty {
+  Options.fail("No routes selected; known routes are " + allRoutes.map { $0.name }.joined(separator: ", "))
+}
+
+let driver = LoadDriver(port: Int16(options.serverPort),
+                        concurrency: options.concurrency,
+                        requests: options.requests,
+                        warmup: options.warmup)
+
+// Posting the users creates the containers their uploads are stored in
+for userId in userIds {
+  let body = Data("{\"_id\":\"\(userId)\",\"name\":\"Bench User\"}".utf8)
+  let route = BenchmarkRoute(name: "setup", method: "POST", headers: jsonHeaders, body: { _ in body }) { _ in "/users" }
+  var generator = SeededGenerator(seed: 0)
+  if !driver.send(route, generator: &generator) {
+    Options.fail("Could not create the container of user \(userId)")
+  }
+}
+
+var results = [RouteResult]()
+for route in selectedRoutes {
+  let result = driver.run(route)
+  let summary = route.name.padding(toLength: 14, withPad: " ", startingAt: 0)
+    + String(format: " %9.1f req/s  p50 %7.2f ms  p95 %7.2f ms  p99 %7.2f ms  errors %d\n",
+             result.requestsPerSecond, result.latencyMs.p50, result.latencyMs.p95,
+             result.latencyMs.p99, result.errors)
+  FileHandle.standardError.write(summary.data(using: .utf8)!)
+  results.append(result)
+}
+
+let report = Report(corpus: ["images": corpus.images.count, "users": corpus.users.count],
+                    database: options.database,
+                    gzip: options.gzip,
+                    routes: results)
+let encoder = JSONEncoder()
+encoder.outputFormatting = .prettyPrinted
+let json = try encoder.encode(report)
+
+if let output = options.output {
+  try json.write(to: URL(fileURLWithPath: output))
+} else {
+  FileHandle.standardOutput.write(json)
+  FileHandle.standardOutput.write("\n".data(using: .utf8)!)
+}
+
+server.stop()
+couchDBServer?.stop()
+try? FileManager.default.removeItem(atPath: seedFile)
+exit(results.contains { $0.errors > 0 } ? 1 : 0)
@@ -0,0 +1,44 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#ifndef CATOMICS_H
+#define CATOMICS_H
+
+#include <stdint.h>
+
+/*
+ Relaxed atomic operations on 64-bit words, which Swift 4 cannot express.
+ Metrics only need each word to be updated without lost increments, not any
+ ordering between words, so every operation is relaxed.
+ */
+
+static inline void catomics_add_u64(uint64_t *word, uint64_t value) {
+  __atomic_fetch_add(word, value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t catomics_load_u64(uint64_t *word) {
+  return __atomic_load_n(word, __ATOMIC_RELAXED);
+}
+
+static inline void catomics_add_i64(int64_t *word, int64_t value) {
+  __atomic_fetch_add(word, value, __ATOMIC_RELAXED);
+}
+
+static inline int64_t catomics_load_i64(int64_t *word) {
+  return __atomic_load_n(word, __ATOMIC_RELAXED);
+}
+
+#endif
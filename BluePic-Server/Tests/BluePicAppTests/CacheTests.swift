@@ -0,0 +1,167 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import XCTest
+
+@testable import BluePicApp
+
+/// The in-process caches: the LRU cache, the image cache and the tag count table
+class CacheTests: XCTestCase {
+
+  static var allTests: [(String, (CacheTests) -> () throws -> Void)] {
+      return [
+          ("testLRUEvictsLeastRecentlyUsed", testLRUEvictsLeastRecentlyUsed),
+          ("testLRUWithoutCapacity", testLRUWithoutCapacity),
+          ("testImageCacheInvalidation", testImageCacheInvalidation),
+          ("testImageCacheDropsStaleFill", testImageCacheDropsStaleFill),
+          ("testTagCountsTopK", testTagCountsTopK),
+          ("testTagCountsKeepChangesBeforeSeed", testTagCountsKeepChangesBeforeSeed),
+          ("testTagCountsDropSeedFromBeforeReset", testTagCountsDropSeedFromBeforeReset)
+      ]
+  }
+
+  private func makeImage(id: String, userId: String) throws -> Image {
+    let json = "{\"_id\":\"\(id)\",\"fileName\":\"\(id).png\",\"caption\":\"\",\"width\":1,\"height\":1,\"userId\":\"\(userId)\"}"
+    return try JSONDecoder().decode(Image.self, from: Data(json.utf8))
+  }
+
+  private func assignments(_ labelsByImage: [String: [String]]) -> [TagAssignment] {
+    return labelsByImage.flatMap { imageId, labels in
+      labels.map { TagAssignment(imageId: imageId, label: $0, rev: nil) }
+    }
+  }
+
+  func testLRUEvictsLeastRecentlyUsed() {
+    let cache = LRUCache<String, Int>(capacity: 2)
+    cache.setValue(1, forKey: "a")
+    cache.setValue(2, forKey: "b")
+
+    // Reading "a" makes "b" the least recently used
+    XCTAssertEqual(cache.value(forKey: "a"), 1)
+    cache.setValue(3, forKey: "c")
+
+    XCTAssertNil(cache.value(forKey: "b"))
+    XCTAssertEqual(cache.value(forKey: "a"), 1)
+    XCTAssertEqual(cache.value(forKey: "c"), 3)
+
+    let stats = cache.stats
+    XCTAssertEqual(stats.count, 2)
+    XCTAssertEqual(stats.hits, 3)
+    XCTAssertEqual(stats.misses, 1)
+    XCTAssertEqual(stats.evictions, 1)
+
+    cache.removeValues { $0 > 2 }
+    XCTAssertNil(cache.value(forKey: "c"))
+    XCTAssertEqual(cache.removeValue(forKey: "a"), 1)
+    XCTAssertEqual(cache.stats.count, 0)
+  }
+
+  func testLRUWithoutCapacity() {
+    let cache = LRUCache<String, Int>(capacity: 0)
+    cache.setValue(1, forKey: "a")
+    XCTAssertNil(cache.value(forKey: "a"))
+    XCTAssertEqual(cache.stats.count, 0)
+  }
+
+  func testImageCacheInvalidation() throws {
+    let cache = ImageCache(capacity: 10)
+    cache.store(try makeImage(id: "i1", userId: "u1"), token: cache.fillToken())
+    cache.store(try makeImage(id: "i2", userId: "u1"), token: cache.fillToken())
+    cache.store(try makeImage(id: "i3", userId: "u2"), token: cache.fillToken())
+
+    // An image id drops that image only
+    cache.invalidate(id: "i3")
+    XCTAssertNil(cache.image(withId: "i3"))
+    XCTAssertNotNil(cache.image(withId: "i1"))
+
+    // A new image document is not looked for among the users' images
+    cache.invalidate(id: "u1", documentType: "image")
+    XCTAssertNotNil(cache.image(withId: "i1"))
+
+    // A user id drops every image embedding that user
+    cache.invalidate(id: "u1", documentType: "user")
+    XCTAssertNil(cache.image(withId: "i1"))
+    XCTAssertNil(cache.image(withId: "i2"))
+
+    // So does one whose document type is not known
+    cache.store(try makeImage(id: "i4", userId: "u2"), token: cache.fillToken())
+    cache.invalidate(id: "u2")
+    XCTAssertNil(cache.image(withId: "i4"))
+  }
+
+  func testImageCacheDropsStaleFill() throws {
+    let cache = ImageCache(capacity: 10)
+
+    // The image changes while it is being read, so the copy read is not cached
+    let token = cache.fillToken()
+    cache.invalidate(id: "i1")
+    cache.store(try makeImage(id: "i1", userId: "u1"), token: token)
+    XCTAssertNil(cache.image(withId: "i1"))
+
+    cache.store(try makeImage(id: "i1", userId: "u1"), token: cache.fillToken())
+    XCTAssertEqual(cache.image(withId: "i1")?.id, "i1")
+
+    cache.removeAll()
+    XCTAssertNil(cache.image(withId: "i1"))
+  }
+
+  func testTagCountsTopK() {
+    let table = TagCountTable()
+    XCTAssertFalse(table.isSeeded)
+
+    table.seed(with: assignments(["i1": ["lake", "mountain"], "i2": ["lake", "city"], "i3": ["mountain", "lake"]]),
+               generation: 0)
+    XCTAssertTrue(table.isSeeded)
+
+    // Ties are broken alphabetically
+    XCTAssertEqual(table.top(2).map { $0.key }, ["lake", "mountain"])
+    XCTAssertEqual(table.top(2).map { $0.value }, [3, 2])
+    XCTAssertEqual(table.top(10).map { $0.key }, ["lake", "mountain", "city"])
+    XCTAssertEqual(table.top(0).count, 0)
+
+    // Updates apply as deltas, and deleted images have no labels
+    table.update(imageId: "i2", labels: ["city", "mountain"])
+    table.update(imageId: "i3", labels: [])
+    XCTAssertEqual(table.top(3).map { $0.key }, ["mountain", "city", "lake"])
+    XCTAssertEqual(table.top(3).map { $0.value }, [2, 1, 1])
+  }
+
+  func testTagCountsKeepChangesBeforeSeed() {
+    let table = TagCountTable()
+    let generation = table.reset()
+
+    // The feed reports a newer state of i1 than the seed read
+    table.update(imageId: "i1", labels: ["city"])
+    table.seed(with: assignments(["i1": ["lake"], "i2": ["lake"]]), generation: generation)
+
+    XCTAssertEqual(table.top(10).map { $0.key }, ["city", "lake"])
+    XCTAssertEqual(table.top(10).map { $0.value }, [1, 1])
+  }
+
+  func testTagCountsDropSeedFromBeforeReset() {
+    let table = TagCountTable()
+    let stale = table.reset()
+    let current = table.reset()
+
+    table.seed(with: assignments(["i1": ["lake"]]), generation: stale)
+    XCTAssertFalse(table.isSeeded)
+
+    table.seed(with: assignments(["i1": ["city"]]), generation: current)
+    XCTAssertTrue(table.isSeeded)
+    XCTAssertEqual(table.top(10).map { $0.key }, ["city"])
+  }
+}
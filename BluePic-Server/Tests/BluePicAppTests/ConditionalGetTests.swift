@@ -0,0 +1,59 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import XCTest
+
+@testable import BluePicApp
+
+/// Entity tags derived from the database update sequence, and matching them against If-None-Match
+class ConditionalGetTests: XCTestCase {
+
+  static var allTests: [(String, (ConditionalGetTests) -> () throws -> Void)] {
+      return [
+          ("testETagForSequence", testETagForSequence),
+          ("testMatchingIfNoneMatch", testMatchingIfNoneMatch)
+      ]
+  }
+
+  func testETagForSequence() {
+    let etag = ConditionalGetMiddleware.etag(forSequence: "42-g1AAAAEzeJzLYWBgYMlgTmFQSElKzi9KdUhJMtbLTMrVNTAw1EvOyS9NScwr0ctLLckBKmRKZEiy____PyuDOZExFyjAbmFsZmZgYUaqA7s6zIzBgoC")
+
+    XCTAssertTrue(etag.hasPrefix("\"") && etag.hasSuffix("\""), "\(etag) should be a strong entity tag")
+    XCTAssertEqual(etag, ConditionalGetMiddleware.etag(forSequence: "42-g1AAAAEzeJzLYWBgYMlgTmFQSElKzi9KdUhJMtbLTMrVNTAw1EvOyS9NScwr0ctLLckBKmRKZEiy____PyuDOZExFyjAbmFsZmZgYUaqA7s6zIzBgoC"))
+    XCTAssertNotEqual(etag, ConditionalGetMiddleware.etag(forSequence: "43"))
+
+    // 64-bit FNV-1a of the empty string is its offset basis
+    XCTAssertEqual(ConditionalGetMiddleware.etag(forSequence: ""), "\"cbf29ce484222325\"")
+  }
+
+  func testMatchingIfNoneMatch() {
+    let etag = ConditionalGetMiddleware.etag(forSequence: "7")
+    let opaque = String(etag.dropFirst().dropLast())
+
+    XCTAssertEqual(ConditionalGetMiddleware.match(etag, etag: etag), etag)
+    XCTAssertEqual(ConditionalGetMiddleware.match("W/" + etag, etag: etag), etag)
+    XCTAssertEqual(ConditionalGetMiddleware.match("\"other\", " + etag, etag: etag), etag)
+    XCTAssertEqual(ConditionalGetMiddleware.match("*", etag: etag), etag)
+
+    // A client holding the compressed representation gets its own tag echoed
+    let gzipTag = "\"" + opaque + "-gzip\""
+    XCTAssertEqual(ConditionalGetMiddleware.match(gzipTag, etag: etag), gzipTag)
+
+    XCTAssertNil(ConditionalGetMiddleware.match("\"other\"", etag: etag))
+    XCTAssertNil(ConditionalGetMiddleware.match(opaque, etag: etag))
+  }
+}
@@ -0,0 +1,94 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import XCTest
+
+@testable import BluePicApp
+
+/// Hashing of uploaded binaries, which finds an earlier upload of the same photo
+class ContentHashTests: XCTestCase {
+
+  static var allTests: [(String, (ContentHashTests) -> () throws -> Void)] {
+      return [
+          ("testHashOfKnownInput", testHashOfKnownInput),
+          ("testHashingInPieces", testHashingInPieces),
+          ("testLookingUpImageByHash", testLookingUpImageByHash)
+      ]
+  }
+
+  func testHashOfKnownInput() {
+    XCTAssertEqual(ContentHasher.hash(Data("abc".utf8)),
+                   "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad")
+    XCTAssertEqual(ContentHasher.hash(Data()),
+                   "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855")
+  }
+
+  func testHashingInPieces() {
+    let binary = Data((0..<10000).map { UInt8(truncatingIfNeeded: $0 &* 31) })
+
+    // A streamed upload hashes the same as the whole binary, however it was split
+    let hasher = ContentHasher()
+    var offset = 0
+    while offset < binary.count {
+      let end = min(offset + 1021, binary.count)
+      hasher.update(binary.subdata(in: offset..<end))
+      offset = end
+    }
+    XCTAssertEqual(hasher.finalize(), ContentHasher.hash(binary))
+    XCTAssertNotEqual(ContentHasher.hash(binary), ContentHasher.hash(binary.subdata(in: 1..<binary.count)))
+  }
+
+  /// Ids of the rows the upload routes read for a hash, queried with the parameters they send
+  private func imageIds(withContentHash contentHash: String, in database: InMemoryDatabase) throws -> [String] {
+    var body: Data?
+    var queryError: Error?
+    database.queryView(View.images_by_content_hash, params: ServerController.contentHashQuery(contentHash)) { reader, error in
+      do {
+        body = try reader?.readAll()
+        queryError = error
+      } catch {
+        queryError = error
+      }
+    }
+    if let queryError = queryError {
+      throw queryError
+    }
+    let object = try JSONSerialization.jsonObject(with: body ?? Data(), options: []) as? [String: Any]
+    let rows = object?["rows"] as? [[String: Any]] ?? []
+    return rows.flatMap { $0["id"] as? String }
+  }
+
+  func testLookingUpImageByHash() throws {
+    let database = InMemoryDatabase()
+    let contentHash = ContentHasher.hash(Data("photo".utf8))
+    let documents: [(String, String, String)] = [("i1", "2017-05-01T10:00:00", contentHash),
+                                                 ("i2", "2017-05-02T10:00:00", contentHash),
+                                                 ("i3", "2017-05-03T10:00:00", "0000")]
+    for (id, uploadedTs, hash) in documents {
+      let document: [String: Any] = ["_id": id, "type": "image", "userId": "u1", "uploadedTs": uploadedTs,
+                                     "contentHash": hash]
+      _ = try database.createDocument(JSONSerialization.data(withJSONObject: document, options: []))
+    }
+
+    // The most recent image with the hash
+    XCTAssertEqual(try imageIds(withContentHash: contentHash, in: database), ["i2"])
+
+    // No image has this hash; the range must not run on into the lower hash of i3
+    XCTAssertEqual(try imageIds(withContentHash: ContentHasher.hash(Data("other photo".utf8)), in: database), [])
+    XCTAssertEqual(try imageIds(withContentHash: "1111", in: database), [])
+  }
+}
@@ -0,0 +1,114 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import XCTest
+
+@testable import BluePicApp
+
+/// Rendering of the server metrics in the Prometheus text format
+class MetricsTests: XCTestCase {
+
+  static var allTests: [(String, (MetricsTests) -> () throws -> Void)] {
+      return [
+          ("testHistogramBuckets", testHistogramBuckets),
+          ("testRenderingRouteMetrics", testRenderingRouteMetrics),
+          ("testRenderingCollectors", testRenderingCollectors),
+          ("testRenderingNamedHistograms", testRenderingNamedHistograms)
+      ]
+  }
+
+  private func lines(of text: String) -> [String] {
+    return text.components(separatedBy: "\n")
+  }
+
+  func testHistogramBuckets() {
+    let histogram = Histogram(buckets: [0.5, 0.1, 1])
+    XCTAssertEqual(histogram.buckets, [0.1, 0.5, 1])
+
+    histogram.observe(0.05)
+    histogram.observe(0.1)
+    histogram.observe(0.7)
+    histogram.observe(3)
+
+    let snapshot = histogram.snapshot
+    XCTAssertEqual(snapshot.cumulativeCounts, [2, 2, 3, 4])
+    XCTAssertEqual(snapshot.sum, 3.85, accuracy: 0.00001)
+  }
+
+  func testRenderingRouteMetrics() {
+    let registry = MetricsRegistry()
+    let images = registry.route(method: "GET", path: "/images")
+    XCTAssertTrue(images === registry.route(method: "GET", path: "/images"))
+
+    images.latency.observe(0.003)
+    _ = registry.route(method: "POST", path: "/images").start()
+    registry.dependency("cloudant", operation: "queryView").latency.observe(0.2)
+
+    let rendered = lines(of: registry.render())
+    let expected = [
+      "# HELP bluepic_http_request_duration_seconds Time from receiving a request to ending its response.",
+      "# TYPE bluepic_http_request_duration_seconds histogram",
+      "bluepic_http_request_duration_seconds_bucket{method=\"GET\",route=\"/images\",le=\"0.0025\"} 0",
+      "bluepic_http_request_duration_seconds_bucket{method=\"GET\",route=\"/images\",le=\"0.005\"} 1",
+      "bluepic_http_request_duration_seconds_bucket{method=\"GET\",route=\"/images\",le=\"+Inf\"} 1",
+      "bluepic_http_request_duration_seconds_sum{method=\"GET\",route=\"/images\"} 0.003",
+      "bluepic_http_request_duration_seconds_count{method=\"GET\",route=\"/images\"} 1",
+      "bluepic_http_request_duration_seconds_count{method=\"POST\",route=\"/images\"} 0",
+      "# TYPE bluepic_http_requests_in_flight gauge",
+      "bluepic_http_requests_in_flight{method=\"GET\",route=\"/images\"} 0",
+      "bluepic_http_requests_in_flight{method=\"POST\",route=\"/images\"} 1",
+      "# TYPE bluepic_dependency_duration_seconds histogram",
+      "bluepic_dependency_duration_seconds_bucket{dependency=\"cloudant\",operation=\"queryView\",le=\"0.25\"} 1",
+      "bluepic_dependency_duration_seconds_count{dependency=\"cloudant\",operation=\"queryView\"} 1"
+    ]
+    for line in expected {
+      XCTAssertTrue(rendered.contains(line), "Missing line: \(line)")
+    }
+
+    // Series of a family are sorted by their labels
+    let getIndex = rendered.index(of: "bluepic_http_requests_in_flight{method=\"GET\",route=\"/images\"} 0")
+    let postIndex = rendered.index(of: "bluepic_http_requests_in_flight{method=\"POST\",route=\"/images\"} 1")
+    XCTAssertLessThan(getIndex ?? Int.max, postIndex ?? Int.max)
+  }
+
+  func testRenderingCollectors() {
+    let registry = MetricsRegistry()
+    registry.addCollector(name: "bluepic_cache_hits_total", type: .counter, help: "Cache hits.") {
+      [(labels: ["cache": "image\"s\\\n"], value: 12), (labels: [:], value: 0.5)]
+    }
+
+    let rendered = lines(of: registry.render())
+    XCTAssertTrue(rendered.contains("# HELP bluepic_cache_hits_total Cache hits."))
+    XCTAssertTrue(rendered.contains("# TYPE bluepic_cache_hits_total counter"))
+    XCTAssertTrue(rendered.contains("bluepic_cache_hits_total{cache=\"image\\\"s\\\\\\n\"} 12"))
+    XCTAssertTrue(rendered.contains("bluepic_cache_hits_total 0.5"))
+  }
+
+  func testRenderingNamedHistograms() {
+    let registry = MetricsRegistry()
+    let histogram = registry.histogram(name: "bluepic_processing_queue_duration_seconds", help: "Queue time.",
+                                       buckets: [1, 60])
+    histogram.observe(30)
+
+    let rendered = lines(of: registry.render())
+    XCTAssertTrue(rendered.contains("# TYPE bluepic_processing_queue_duration_seconds histogram"))
+    XCTAssertTrue(rendered.contains("bluepic_processing_queue_duration_seconds_bucket{le=\"1\"} 0"))
+    XCTAssertTrue(rendered.contains("bluepic_processing_queue_duration_seconds_bucket{le=\"60\"} 1"))
+    XCTAssertTrue(rendered.contains("bluepic_processing_queue_duration_seconds_sum 30"))
+    XCTAssertTrue(rendered.contains("bluepic_processing_queue_duration_seconds_count 1"))
+  }
+}
@@ -0,0 +1,203 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import XCTest
+
+@testable import BluePicApp
+
+/// Page cursors, view row splitting and grouping, and view collation of the in-memory database
+class PaginationTests: XCTestCase {
+
+  static var allTests: [(String, (PaginationTests) -> () throws -> Void)] {
+      return [
+          ("testCursorRoundTrip", testCursorRoundTrip),
+          ("testCursorRejectsMalformedInput", testCursorRejectsMalformedInput),
+          ("testCursorKeyPrefix", testCursorKeyPrefix),
+          ("testViewKeyCollation", testViewKeyCollation),
+          ("testInMemoryViewRange", testInMemoryViewRange),
+          ("testSplittingRowsAcrossChunks", testSplittingRowsAcrossChunks),
+          ("testSplitterKeepsUndelimitedBody", testSplitterKeepsUndelimitedBody),
+          ("testGroupingImageRows", testGroupingImageRows)
+      ]
+  }
+
+  private var database = InMemoryDatabase()
+
+  override func setUp() {
+    super.setUp()
+
+    database = InMemoryDatabase()
+    createDocument(["_id": "u1", "type": "user", "name": "Alice"])
+    createDocument(["_id": "u2", "type": "user", "name": "Bob"])
+    createImage(id: "i1", userId: "u1", uploadedTs: "2017-05-01T10:00:00")
+    createImage(id: "i2", userId: "u2", uploadedTs: "2017-05-02T10:00:00")
+    createImage(id: "i3", userId: "u1", uploadedTs: "2017-05-03T10:00:00")
+  }
+
+  private func createDocument(_ document: [String: Any]) {
+    do {
+      _ = try database.createDocument(JSONSerialization.data(withJSONObject: document, options: []))
+    } catch {
+      XCTFail("Could not create document: \(error)")
+    }
+  }
+
+  private func createImage(id: String, userId: String, uploadedTs: String) {
+    createDocument(["_id": id, "type": "image", "fileName": id + ".png", "caption": "", "width": 1, "height": 1,
+                    "userId": userId, "uploadedTs": uploadedTs, "tags": [["label": "lake", "confidence": 0.9]]])
+  }
+
+  /// Ids of the rows of a view response
+  private func rowIds(_ body: Data) -> [String] {
+    let object = try? JSONSerialization.jsonObject(with: body, options: [])
+    let rows = (object as? [String: Any])?["rows"] as? [[String: Any]] ?? []
+    return rows.flatMap { $0["id"] as? String }
+  }
+
+  func testCursorRoundTrip() {
+    let cursor = PageCursor(startKey: ["u1", "2017-05-03T10:00:00", 1], startKeyDocId: "i3")
+    guard let encoded = cursor.encoded() else {
+      XCTFail("Could not encode cursor.")
+      return
+    }
+    XCTAssertFalse(encoded.contains("+") || encoded.contains("/") || encoded.contains("="))
+
+    guard let decoded = PageCursor(encoded: encoded) else {
+      XCTFail("Could not decode cursor.")
+      return
+    }
+    XCTAssertEqual(decoded.startKeyDocId, "i3")
+    XCTAssertEqual(decoded.databaseKey.count, 3)
+    XCTAssertEqual(decoded.startKey[0] as? String, "u1")
+    XCTAssertEqual(decoded.startKey[1] as? String, "2017-05-03T10:00:00")
+    XCTAssertEqual((decoded.databaseKey[2] as? NSNumber)?.intValue, 1)
+  }
+
+  func testCursorRejectsMalformedInput() {
+    let encode = { (json: String) -> String in
+      Data(json.utf8).base64EncodedString()
+        .replacingOccurrences(of: "+", with: "-")
+        .replacingOccurrences(of: "/", with: "_")
+        .replacingOccurrences(of: "=", with: "")
+    }
+
+    XCTAssertNil(PageCursor(encoded: "not a cursor"))
+    XCTAssertNil(PageCursor(encoded: encode("{\"k\":[]}")))
+    XCTAssertNil(PageCursor(encoded: encode("{\"k\":\"u1\"}")))
+    XCTAssertNil(PageCursor(encoded: encode("{\"k\":[\"u1\",{}]}")))
+    XCTAssertNil(PageCursor(encoded: encode("{\"k\":[\"u1\",[\"nested\"]]}")))
+    XCTAssertNotNil(PageCursor(encoded: encode("{\"k\":[\"u1\",2]}")))
+  }
+
+  func testCursorKeyPrefix() {
+    let cursor = PageCursor(startKey: ["u1", "2017-05-03T10:00:00"], startKeyDocId: nil)
+    XCTAssertTrue(cursor.hasKeyPrefix([]))
+    XCTAssertTrue(cursor.hasKeyPrefix(["u1"]))
+    XCTAssertFalse(cursor.hasKeyPrefix(["u2"]))
+    XCTAssertFalse(cursor.hasKeyPrefix(["u1", "2017-05-03T10:00:00", "i3"]))
+  }
+
+  func testViewKeyCollation() {
+    let ordered: [ViewKey] = [.null, .bool(false), .bool(true), .number(-1), .number(2), .string("a"),
+                              .string("b"), .array([]), .array([.string("a")]), .array([.string("a"), .null]),
+                              .array([.string("b")]), .object]
+    for (index, key) in ordered.enumerated() {
+      for later in ordered[(index + 1)...] {
+        XCTAssertTrue(key < later, "\(key.json) should collate before \(later.json)")
+        XCTAssertFalse(later < key, "\(later.json) should collate after \(key.json)")
+      }
+    }
+    XCTAssertEqual(ViewKey(json: "[\"u1\",{}]"), .array([.string("u1"), .object]))
+  }
+
+  func testInMemoryViewRange() throws {
+    // The same range the user images route queries, newest first
+    let body = try database.viewResponse(named: View.images_per_user.rawValue,
+                                         query: ["descending": "true",
+                                                 "startkey": "[\"u1\",{}]",
+                                                 "endkey": "[\"u1\",\"0\"]"])
+    XCTAssertEqual(rowIds(body), ["i3", "i1"])
+
+    // Resuming from a cursor row includes that row
+    let resumed = try database.viewResponse(named: View.images_per_user.rawValue,
+                                            query: ["descending": "true",
+                                                    "startkey": "[\"u1\",\"2017-05-01T10:00:00\"]",
+                                                    "endkey": "[\"u1\",\"0\"]"])
+    XCTAssertEqual(rowIds(resumed), ["i1"])
+
+    let limited = try database.viewResponse(named: View.image_docs.rawValue, query: ["descending": "true", "limit": "2"])
+    XCTAssertEqual(rowIds(limited), ["i3", "i2"])
+  }
+
+  func testSplittingRowsAcrossChunks() throws {
+    let body = try database.viewResponse(named: View.image_docs.rawValue, query: [:])
+
+    // Feed the body a few bytes at a time, so rows and the header straddle chunks
+    var splitter = ViewRowSplitter()
+    var rows = [Data]()
+    var offset = 0
+    while offset < body.count {
+      let end = min(offset + 7, body.count)
+      rows += splitter.append(body.subdata(in: offset..<end))
+      offset = end
+    }
+    rows += splitter.finish()
+
+    XCTAssertNil(splitter.unsplitBody)
+    let ids = rows.flatMap { row -> String? in
+      let object = try? JSONSerialization.jsonObject(with: row, options: [])
+      return (object as? [String: Any])?["id"] as? String
+    }
+    XCTAssertEqual(ids, ["i1", "i2", "i3"])
+  }
+
+  func testSplitterKeepsUndelimitedBody() {
+    let body = Data("{\"total_rows\":1,\"rows\":[{\"id\":\"i1\",\"key\":\"a\",\"value\":null}]}".utf8)
+
+    var splitter = ViewRowSplitter()
+    XCTAssertTrue(splitter.append(body).isEmpty)
+    XCTAssertTrue(splitter.finish().isEmpty)
+    XCTAssertEqual(splitter.unsplitBody, body + Data("\n".utf8))
+  }
+
+  func testGroupingImageRows() throws {
+    // An image whose user does not exist decodes to nothing, but still spans its rows
+    createImage(id: "i4", userId: "ghost", uploadedTs: "2017-05-04T10:00:00")
+
+    let body = try database.viewResponse(named: View.images.rawValue, query: ["descending": "true", "include_docs": "true"])
+    var splitter = ViewRowSplitter()
+    var rows = splitter.append(body)
+    rows += splitter.finish()
+
+    let rowsPerObject = Image.rowsPerObject(hasDocs: true)
+    XCTAssertEqual(rows.count, 4 * rowsPerObject)
+
+    let decoder = JSONDecoder()
+    decoder.userInfo[ViewDecodingOptions.userInfoKey] = ViewDecodingOptions(hasDocs: true, limit: nil)
+
+    var images = [Image?]()
+    for start in stride(from: 0, to: rows.count, by: rowsPerObject) {
+      var groupData = Data("[".utf8)
+      groupData.append(contentsOf: rows[start..<(start + rowsPerObject)].joined(separator: Data(",".utf8)))
+      groupData.append(contentsOf: "]".utf8)
+      images.append(try decoder.decode(RowGroup<Image>.self, from: groupData).item)
+    }
+
+    XCTAssertEqual(images.map { $0?.id ?? "none" }, ["none", "i3", "i2", "i1"])
+    XCTAssertEqual(images.map { $0?.user?.name ?? "none" }, ["none", "Alice", "Bob", "Alice"])
+  }
+}
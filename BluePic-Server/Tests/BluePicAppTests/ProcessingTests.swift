@@ -0,0 +1,180 @@
+/**
+ * Copyright IBM Corporation 2017
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+import Foundation
+import XCTest
+
+@testable import BluePicApp
+
+/// Dispatching image processing invocations and journaling the jobs not yet handed over
+class ProcessingTests: XCTestCase {
+
+  static var allTests: [(String, (ProcessingTests) -> () throws -> Void)] {
+      return [
+          ("testDispatcherBatches", testDispatcherBatches),
+          ("testDispatcherRetriesFailedInvocation", testDispatcherRetriesFailedInvocation),
+          ("testDispatcherGivesUpAfterRetries", testDispatcherGivesUpAfterRetries),
+          ("testDispatcherDropsWhenQueueIsFull", testDispatcherDropsWhenQueueIsFull),
+          ("testJournalReplaysPendingJobs", testJournalReplaysPendingJobs),
+          ("testJournalIgnoresTruncatedEntry", testJournalIgnoresTruncatedEntry),
+          ("testJournalCompacts", testJournalCompacts)
+      ]
+  }
+
+  private let timeout: TimeInterval = 5.0
+
+  private var journalPath = ""
+
+  override func setUp() {
+    super.setUp()
+    journalPath = NSTemporaryDirectory() + "processing-journal-" + UUID().uuidString
+  }
+
+  override func tearDown() {
+    try? FileManager.default.removeItem(atPath: journalPath)
+    super.tearDown()
+  }
+
+  private func journalContents() -> String {
+    return (try? String(contentsOfFile: journalPath, encoding: .utf8)) ?? ""
+  }
+
+  /// Records jobs and waits until they are on disk
+  private func recordPending(_ imageIds: [String], in journal: ProcessingJournal) {
+    let durable = expectation(description: "Jobs \(imageIds) are synced to the journal.")
+    journal.recordPending(imageIds: imageIds) {
+      durable.fulfill()
+    }
+    waitForExpectations(timeout: timeout, handler: nil)
+  }
+
+  func testDispatcherBatches() {
+    let invoked = expectation(description: "Every queued image is sent.")
+    var batches = [[String]]()
+    var documents = [[Data?]]()
+    let latency = Histogram()
+
+    // Invocations are made on the dispatcher's queue, one at a time here
+    let dispatcher = ProcessingDispatcher(maxInFlight: 1, batchSize: 2, latency: latency) { imageIds, batchDocuments, completion in
+      batches.append(imageIds)
+      documents.append(batchDocuments)
+      completion(true)
+      if batches.joined().count == 3 {
+        invoked.fulfill()
+      }
+    }
+    dispatcher.enqueue(imageIds: ["i1", "i2", "i3"], documents: [Data("{}".utf8)])
+    waitForExpectations(timeout: timeout, handler: nil)
+
+    XCTAssertEqual(batches.count, 2)
+    XCTAssertEqual(batches.first ?? [], ["i1", "i2"])
+    XCTAssertEqual(batches.last ?? [], ["i3"])
+    XCTAssertEqual(documents.first?.map { $0 != nil } ?? [], [true, false])
+
+    let stats = dispatcher.stats
+    XCTAssertEqual(stats.completed, 3)
+    XCTAssertEqual(stats.queueDepth, 0)
+    XCTAssertEqual(stats.inFlight, 0)
+    XCTAssertEqual(latency.snapshot.cumulativeCounts.last, 3)
+  }
+
+  func testDispatcherRetriesFailedInvocation() {
+    let retried = expectation(description: "The failed invocation is sent again.")
+    var attempts = 0
+
+    let dispatcher = ProcessingDispatcher(maxInFlight: 1, maxRetries: 2, retryDelay: 0.01) { imageIds, _, completion in
+      XCTAssertEqual(imageIds, ["i1"])
+      attempts += 1
+      completion(attempts > 1)
+      if attempts == 2 {
+        retried.fulfill()
+      }
+    }
+    dispatcher.enqueue(imageId: "i1")
+    waitForExpectations(timeout: timeout, handler: nil)
+
+    let stats = dispatcher.stats
+    XCTAssertEqual(stats.completed, 1)
+    XCTAssertEqual(stats.failed, 0)
+    XCTAssertEqual(stats.retrying, 0)
+  }
+
+  func testDispatcherGivesUpAfterRetries() {
+    let exhausted = expectation(description: "Every attempt is made.")
+    var attempts = 0
+
+    let dispatcher = ProcessingDispatcher(maxInFlight: 1, maxRetries: 1, retryDelay: 0.01) { _, _, completion in
+      attempts += 1
+      completion(false)
+      if attempts == 2 {
+        exhausted.fulfill()
+      }
+    }
+    dispatcher.enqueue(imageId: "i1")
+    waitForExpectations(timeout: timeout, handler: nil)
+
+    let stats = dispatcher.stats
+    XCTAssertEqual(stats.completed, 0)
+    XCTAssertEqual(stats.failed, 1)
+    XCTAssertEqual(stats.retrying, 0)
+  }
+
+  func testDispatcherDropsWhenQueueIsFull() {
+    // Invocations never complete, so the first image holds the only slot
+    let dispatcher = ProcessingDispatcher(maxInFlight: 1, queueCapacity: 1) { _, _, _ in }
+    dispatcher.enqueue(imageId: "i1")
+    dispatcher.enqueue(imageId: "i2")
+    dispatcher.enqueue(imageIds: ["i3", "i4"])
+
+    let stats = dispatcher.stats
+    XCTAssertEqual(stats.inFlight, 1)
+    XCTAssertEqual(stats.queueDepth, 1)
+    XCTAssertEqual(stats.dropped, 2)
+  }
+
+  func testJournalReplaysPendingJobs() throws {
+    let journal = try ProcessingJournal(path: journalPath)
+    recordPending(["i1", "i2"], in: journal)
+    recordPending(["i3"], in: journal)
+    journal.recordDone(imageIds: ["i2", "unknown"])
+    XCTAssertEqual(journal.pendingImageIds, ["i1", "i3"])
+
+    // A restart replays what is left pending, oldest first, from a journal rewritten with only those jobs
+    let reopened = try ProcessingJournal(path: journalPath)
+    XCTAssertEqual(reopened.pendingImageIds, ["i1", "i3"])
+    XCTAssertEqual(journalContents(), "+i1\n+i3\n")
+  }
+
+  func testJournalIgnoresTruncatedEntry() throws {
+    try "+i1\n-i1\n+i2\n+i3".write(toFile: journalPath, atomically: true, encoding: .utf8)
+
+    let journal = try ProcessingJournal(path: journalPath)
+    XCTAssertEqual(journal.pendingImageIds, ["i2"])
+  }
+
+  func testJournalCompacts() throws {
+    let journal = try ProcessingJournal(path: journalPath)
+    recordPending(["kept"], in: journal)
+
+    // Finished entries come to dominate the journal, so it is rewritten with the pending job only
+    let finished = (0..<600).map { "i\($0)" }
+    recordPending(finished, in: journal)
+    journal.recordDone(imageIds: finished)
+
+    XCTAssertEqual(journal.pendingImageIds, ["kept"])
+    XCTAssertEqual(journalContents(), "+kept\n")
+  }
+}
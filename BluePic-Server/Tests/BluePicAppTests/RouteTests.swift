@@ -42,10 +42,13 @@ class RouteTests: XCTestCase {
       return [
           ("testPing", testPing),
           ("testGetTags", testGetTags),
+          ("testConditionalGettingTags", testConditionalGettingTags),
           ("testGettingImages", testGettingImages),
+          ("testPaginatingImages", testPaginatingImages),
           ("testGettingSingleImage", testGettingSingleImage),
           ("testGettingImagesByTag", testGettingImagesByTag),
           ("testPostingImage", testPostingImage),
+          ("testUploadingImageBinary", testUploadingImageBinary),
           ("testGettingImagesForUser", testGettingImagesForUser),
           ("testGettingUsers", testGettingUsers),
           ("testGettingSingleUser", testGettingSingleUser),
@@ -154,6 +157,30 @@ class RouteTests: XCTestCase {
 
   // MARK: Image related tests
 
+  func testConditionalGettingTags() {
+
+    let notModifiedExpectation = expectation(description: "Get a 304 for tags that have not changed.")
+
+    let req = RestRequest(method: .get, route: "/tags")
+
+    req.responseData { res in
+      guard let etag = res.response?.allHeaderFields["ETag"] as? String else {
+        XCTFail("Tags response did not include an ETag.")
+        return
+      }
+
+      let conditionalReq = RestRequest(method: .get, route: "/tags")
+      conditionalReq.headerParameters["If-None-Match"] = etag
+      conditionalReq.responseData { conditionalRes in
+        XCTAssertEqual(conditionalRes.response?.statusCode, 304)
+        XCTAssertEqual(conditionalRes.response?.allHeaderFields["ETag"] as? String, etag)
+        notModifiedExpectation.fulfill()
+      }
+    }
+
+    waitForExpectations(timeout: timeout, handler: nil)
+  }
+
   func testGettingImages() {
 
     let imageExpectation = expectation(description: "Get all images.")
@@ -179,6 +206,45 @@ class RouteTests: XCTestCase {
     waitForExpectations(timeout: timeout, handler: nil)
   }
 
+  func testPaginatingImages() {
+
+    let firstPageExpectation = expectation(description: "Get the first page of images.")
+    let secondPageExpectation = expectation(description: "Get the second page of images using the cursor.")
+
+    let req = RestRequest(method: .get, route: "/images?limit=5")
+
+    req.responseData { res in
+      switch res.result {
+      case .success(let data):
+        let records = SwiftyJSON.JSON(data: data).arrayValue
+        XCTAssertEqual(records.count, 5)
+        self.assertImage2010(image: records.first!)
+
+        guard let cursor = res.response?.allHeaderFields["X-Next-Cursor"] as? String else {
+          XCTFail("First page of images did not include a cursor for the next page.")
+          return
+        }
+        firstPageExpectation.fulfill()
+
+        let nextReq = RestRequest(method: .get, route: "/images?limit=5&cursor=\(cursor)")
+        nextReq.responseData { nextRes in
+          switch nextRes.result {
+          case .success(let data):
+            let records = SwiftyJSON.JSON(data: data).arrayValue
+            XCTAssertEqual(records.count, 4)
+            XCTAssertNil(nextRes.response?.allHeaderFields["X-Next-Cursor"])
+            self.assertImage2001(image: records.last!)
+            secondPageExpectation.fulfill()
+          case .failure(let err): self.handleError(err)
+          }
+        }
+      case .failure(let err): self.handleError(err)
+      }
+    }
+
+    waitForExpectations(timeout: timeout, handler: nil)
+  }
+
   func testGettingSingleImage() {
 
     let imageExpectation = expectation(description: "Get an image with a specific image.")
@@ -252,6 +318,37 @@ class RouteTests: XCTestCase {
     waitForExpectations(timeout: timeout, handler: nil)
   }
 
+  func testUploadingImageBinary() {
+
+    let imageExpectation = expectation(description: "Upload an image binary with server.")
+
+    let imageURL = fileURL(directoriesUp: 4, path: "Cloud-Scripts/Object-Storage/images/road.png")
+    guard let imageData = try? Data(contentsOf: imageURL) else {
+      XCTFail("Could not read image to upload.")
+      return
+    }
+
+    let route = "/images/upload?userId=anonymous&fileName=streamed.png&caption=Streamed&width=600&height=402"
+    let req = RestRequest(method: .post, route: route, authToken: self.accessToken)
+    req.headerParameters["Content-Type"] = "image/png"
+    req.messageBody = imageData
+
+    req.responseData { resp in
+      switch resp.result {
+      case .success(let data):
+        let image = SwiftyJSON.JSON(data: data)
+        XCTAssertEqual(image["fileName"].stringValue, "streamed.png")
+        XCTAssertEqual(image["userId"].stringValue, "anonymous")
+        XCTAssertTrue(image["url"].stringValue.contains("anonymous/streamed.png"))
+        XCTAssertNotNil(image["_rev"].string)
+        imageExpectation.fulfill()
+      case .failure(let err): self.handleError(err)
+      }
+    }
+
+    waitForExpectations(timeout: timeout, handler: nil)
+  }
+
   func testGettingImagesForUser() {
 
     let imageExpectation = expectation(description: "Gets all images posted by a specific user.")
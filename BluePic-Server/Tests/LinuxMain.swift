@@ -19,5 +19,11 @@ import XCTest
 @testable import BluePicAppTests
 
 XCTMain([
-    testCase(RouteTests.allTests)
+    testCase(RouteTests.allTests),
+    testCase(PaginationTests.allTests),
+    testCase(CacheTests.allTests),
+    testCase(ProcessingTests.allTests),
+    testCase(ConditionalGetTests.allTests),
+    testCase(MetricsTests.allTests),
+    testCase(ContentHashTests.allTests)
 ])
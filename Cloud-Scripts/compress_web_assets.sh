@@ -0,0 +1,30 @@
+#!/bin/bash
+
+##
+# Copyright IBM Corporation 2017
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+##
+
+# Writes a gzip copy next to every text asset of the web app, which the server
+# hands to clients that accept gzip. Run it again after editing an asset, and
+# before pushing to Cloud Foundry.
+
+set -e
+
+# Set webFolder variable
+WEB_FOLDER=${1:-`dirname $( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )`/BluePic-Server/BluePic-Web}
+echo "webFolder: $WEB_FOLDER"
+
+find "$WEB_FOLDER" -type f \( -name '*.html' -o -name '*.js' -o -name '*.css' -o -name '*.svg' -o -name '*.json' \) \
+  -exec sh -c 'gzip -9 -n -c "$1" > "$1.gz"' _ {} \;